@@ -1,13 +1,149 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <iterator>
 #include <vector>
-#include <deque>
 #include <optional>
 #include <stdexcept>
 
 #include "config.hpp"
 
 namespace ksets {
+    // Read-only view of consecutive history values, oldest first.
+    // Invalidated by the next put, resize or restore of the history it came from.
+    class HistorySpan {
+        const numeric *first;
+        std::size_t length;
+    public:
+        HistorySpan(const numeric *first, std::size_t length) noexcept: first(first), length(length) {}
+
+        const numeric *data() const noexcept { return first; }
+        std::size_t size() const noexcept { return length; }
+        const numeric *begin() const noexcept { return first; }
+        const numeric *end() const noexcept { return first + length; }
+        numeric operator[](std::size_t index) const noexcept { return first[index]; }
+    };
+
+    // Iterates a history's values oldest first, across the end of its ring buffer.
+    // Invalidated by the next put, resize or restore of the history it came from.
+    class HistoryIterator {
+        const numeric *values;
+        std::size_t historySize;
+        std::size_t oldest;
+        // how many values past the oldest
+        std::size_t index;
+    public:
+        using value_type = numeric;
+        using reference = const numeric&;
+        using pointer = const numeric *;
+        using difference_type = std::ptrdiff_t;
+        using iterator_category = std::random_access_iterator_tag;
+
+        HistoryIterator(const numeric *values, std::size_t historySize, std::size_t oldest, std::size_t index) noexcept:
+            values(values), historySize(historySize), oldest(oldest), index(index) {}
+
+        reference operator*() const noexcept {
+            std::size_t position = oldest + index;
+            return values[position < historySize ? position : position - historySize];
+        }
+        reference operator[](difference_type n) const noexcept { return *(*this + n); }
+
+        HistoryIterator& operator++() noexcept {
+            index++;
+            return *this;
+        }
+        HistoryIterator operator++(int) noexcept {
+            HistoryIterator old = *this;
+            index++;
+            return old;
+        }
+        HistoryIterator& operator--() noexcept {
+            index--;
+            return *this;
+        }
+        HistoryIterator operator--(int) noexcept {
+            HistoryIterator old = *this;
+            index--;
+            return old;
+        }
+        HistoryIterator& operator+=(difference_type n) noexcept {
+            index += n;
+            return *this;
+        }
+        HistoryIterator& operator-=(difference_type n) noexcept {
+            index -= n;
+            return *this;
+        }
+        HistoryIterator operator+(difference_type n) const noexcept { return {values, historySize, oldest, index + n}; }
+        HistoryIterator operator-(difference_type n) const noexcept { return {values, historySize, oldest, index - n}; }
+        difference_type operator-(const HistoryIterator& other) const noexcept { return index - other.index; }
+
+        bool operator==(const HistoryIterator& other) const noexcept { return index == other.index; }
+        bool operator!=(const HistoryIterator& other) const noexcept { return index != other.index; }
+        bool operator<(const HistoryIterator& other) const noexcept { return index < other.index; }
+        bool operator>(const HistoryIterator& other) const noexcept { return index > other.index; }
+        bool operator<=(const HistoryIterator& other) const noexcept { return index <= other.index; }
+        bool operator>=(const HistoryIterator& other) const noexcept { return index >= other.index; }
+    };
+
+    enum class MatrixLayout {
+        /// One row per history, so each history's samples are contiguous.
+        ROW_MAJOR,
+        /// One column per history, so the values of every history at a given time are contiguous.
+        COLUMN_MAJOR
+    };
+
+    // Minimum, maximum and mean of consecutive history values.
+    struct HistorySummary {
+        numeric min;
+        numeric max;
+        numeric mean;
+    };
+
+    struct HistoryTierConfig {
+        /// Number of values, for the first tier, or of entries of the previous tier, summarized by each entry.
+        std::size_t decimation;
+        /// Number of entries kept.
+        std::size_t length;
+    };
+
+    // Ring of summaries of a history's older values, each covering getValuesPerEntry() consecutive values.
+    // Entries are only made once all of their values were put.
+    class HistoryTier {
+        friend class ActivationHistory;
+
+        std::vector<HistorySummary> entries;
+        std::size_t oldest = 0;
+        std::size_t numEntries = 0;
+        std::size_t decimation;
+        std::size_t valuesPerEntry;
+        uint64_t numEntriesMade = 0;
+
+        // summary of the entry in progress
+        HistorySummary pending;
+        double pendingSum = 0;
+        std::size_t numPending = 0;
+
+        HistoryTier(HistoryTierConfig config, std::size_t valuesPerInput);
+
+        // returns whether the input completed an entry, which is then the newest
+        bool add(const HistorySummary& input) noexcept;
+    public:
+        // number of entries made so far, up to capacity()
+        std::size_t size() const noexcept { return numEntries; }
+        std::size_t capacity() const noexcept { return entries.size(); }
+        std::size_t getValuesPerEntry() const noexcept { return valuesPerEntry; }
+        uint64_t getNumEntriesMade() const noexcept { return numEntriesMade; }
+
+        // offset 0 is the newest entry
+        // throws if offset >= size()
+        const HistorySummary& get(std::size_t offset=0) const;
+
+        // writes every entry, oldest first, to destination, which must hold size() entries
+        void copyEntries(HistorySummary *destination) const noexcept;
+    };
+
     class ActivationHistory {
         struct MonitoringStats {
             std::size_t windowSize;
@@ -15,26 +151,52 @@ namespace ksets {
             numeric varianceNumerator;
             MonitoringStats(std::size_t windowSize): windowSize(windowSize), sum(0), varianceNumerator(0) {};
         };
-        std::deque<ksets::numeric> history;
+        // Ring buffer of the last historySize values. The newest value is just before oldest, wrapping around.
+        std::vector<ksets::numeric> history;
+        std::size_t historySize;
+        std::size_t oldest = 0;
         std::optional<MonitoringStats> monitoredWindow;
         std::size_t numPuts = 0;
+        // each tier summarizes the entries completed by the previous one
+        std::vector<HistoryTier> tiers;
 
         // returns variance numerator and sum of window, in that order
         std::pair<numeric, numeric> varianceNumeratorAndSum(std::size_t window) const;
+        // doMonitoring reads windowSize + 1 values back
+        static bool fitsMonitoringWindow(std::size_t windowSize, std::size_t historySize) noexcept {
+            return windowSize + 1 < historySize;
+        }
         void initMonitoring();
         void doMonitoring(numeric newestValue);
     public:
 
         ActivationHistory(std::size_t historySize=DEFAULT_HISTORY_SIZE);
 
+        // The rolling update reads windowSize + 1 values back, so the window must be at least 2 shorter than the
+        // history.
         // pass 0 to disable
+        // throws if the window is too long
         void setActivityMonitoring(std::size_t windowSize);
 
         std::size_t getNumPutsMade() const noexcept;
         void put(numeric rawValue);
         numeric get(std::size_t offset=0) const;
         std::size_t size() const noexcept;
+        // keeps the oldest values, padding with zeros after the newest when growing
+        // throws if the new size is too short for the activity monitoring window
         void resize(std::size_t newSize);
+        // back to a new history's state: zeros, no puts made and empty summary tiers, keeping every setting
+        void clear() noexcept;
+
+        // Keeps summaries of values older than the full rate history can hold, so long runs can be inspected in
+        // bounded memory. For example, {{20, 6'000}, {100, 3'600}} keeps the min, max and mean of every 10 ms over
+        // the last minute and of every second over the last hour. Tiers start empty, and are not saved by K3::save.
+        // Pass no tiers to disable.
+        // throws if a tier has a decimation below 2 or no length
+        void setSummaryTiers(const std::vector<HistoryTierConfig>& configs);
+        std::size_t numSummaryTiers() const noexcept { return tiers.size(); }
+        // throws if tier >= numSummaryTiers()
+        const HistoryTier& summaryTier(std::size_t tier) const;
 
         struct Slice {
             const std::size_t creationNumPuts;
@@ -56,27 +218,65 @@ namespace ksets {
         numeric stddev() const;
         numeric stddev(std::size_t window) const;
 
+        // Everything but the values, for serialization (see K3::save).
+        struct RawState {
+            std::size_t numPuts;
+            // 0 if activity monitoring is disabled
+            std::size_t monitoringWindow;
+            numeric monitoringSum;
+            numeric monitoringVarianceNumerator;
+        };
+        RawState getRawState() const noexcept;
+
+        // resizes the history to numValues, which are oldest first
+        void restoreRawState(const RawState& state, const numeric *values, std::size_t numValues);
+
         // this existed solely to debug the monitoring system
         // numeric varianceSlow(std::size_t window) const;
 
-        auto begin() const {
-            return history.begin();
+        HistoryIterator begin() const noexcept {
+            return HistoryIterator(history.data(), historySize, oldest, 0);
         }
 
-        auto end() const {
-            return history.end();
+        HistoryIterator end() const noexcept {
+            return HistoryIterator(history.data(), historySize, oldest, historySize);
         }
 
-        auto tail(std::size_t n) const {
-            if (n > history.size())
+        HistoryIterator tail(std::size_t n) const {
+            if (n > historySize)
                 throw std::invalid_argument("Tail length must be less than or equal to history size.");
             return end() - n;
         }
 
+        // The last n values, oldest first, as at most two contiguous pieces: the second is empty unless the values
+        // wrap around the end of the ring buffer.
+        // throws if n > size()
+        std::array<HistorySpan, 2> spans(std::size_t n) const;
+
+        // the last n values as a single contiguous view, if they do not wrap around the end of the ring buffer
+        // throws if n > size()
+        std::optional<HistorySpan> span(std::size_t n) const;
+
+        // writes the last n values, oldest first, to destination[0], destination[stride], ... with at most two
+        // memcpys if stride is 1
+        // throws if n > size()
+        void copyTail(std::size_t n, numeric *destination, std::size_t stride=1) const;
+
         template<typename RNG>
         void fillWithNoise(std::size_t nSamples, RNG& rng) {
             for (std::size_t i = 0; i < nSamples; i++)
                 put(rng());
         }
     };
+
+    // Copies the last numSamples values of each history, oldest first, into destination, which must hold
+    // numHistories * numSamples values laid out as given.
+    // throws if numSamples is larger than any of the histories
+    void exportHistories(
+        const ActivationHistory *const *histories,
+        std::size_t numHistories,
+        std::size_t numSamples,
+        numeric *destination,
+        MatrixLayout layout
+    );
 }
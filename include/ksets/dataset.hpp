@@ -0,0 +1,86 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "ksets/config.hpp"
+
+namespace ksets {
+    /*
+       Binary pattern dataset, in native byte order:
+           char     magic[8]       "KSETSDS" followed by a null byte
+           uint32_t version        DATASET_VERSION
+           uint32_t flags          DATASET_HAS_LABELS if the labels block is present
+           uint64_t numPatterns
+           uint64_t patternSize    values per pattern, which must match the K3 input layer size
+           float    patterns[numPatterns][patternSize]
+           int32_t  labels[numPatterns]
+    */
+    constexpr uint32_t DATASET_VERSION = 1;
+    constexpr uint32_t DATASET_HAS_LABELS = 1;
+
+    enum class DatasetAccess {
+        /// Patterns will be read in order: the kernel reads ahead aggressively and may drop pages soon
+        /// after they are read, so files larger than RAM can be streamed.
+        SEQUENTIAL,
+        /// Patterns will be read in any order, e.g. shuffled epochs: no readahead.
+        RANDOM
+    };
+
+    /*
+       Read only memory mapping of a dataset file. Patterns are views straight into the mapping, which
+       can be handed to K3::present, K3::setPattern or extractFeatures without copying:
+
+           k3.present(ms, dataset.pattern(i), dataset.pattern(i) + dataset.patternSize());
+    */
+    class PatternDataset {
+        int fd = -1;
+        void *mapping = nullptr;
+        std::size_t mappingLength = 0;
+
+        std::size_t numPatterns = 0;
+        std::size_t numValues = 0;
+        const numeric *patterns = nullptr;
+        const int32_t *labels = nullptr;
+
+        void close() noexcept;
+        void advise(std::size_t first, std::size_t last, int advice) const noexcept;
+    public:
+        // throws if the file cannot be opened or mapped, or is not a valid dataset
+        explicit PatternDataset(const std::string& path, DatasetAccess access=DatasetAccess::SEQUENTIAL);
+        PatternDataset(const PatternDataset& other) = delete;
+        PatternDataset(PatternDataset&& other) noexcept;
+        PatternDataset& operator=(PatternDataset&& other) noexcept;
+        ~PatternDataset();
+
+        std::size_t size() const noexcept;
+        std::size_t patternSize() const noexcept;
+        bool hasLabels() const noexcept;
+
+        // every pattern, row major
+        const numeric *data() const noexcept;
+
+        // throws if index >= size()
+        const numeric *pattern(std::size_t index) const;
+
+        // throws if index >= size() or the dataset has no labels
+        int32_t label(std::size_t index) const;
+
+        // Hints that patterns [first, last) will be needed soon, so they are read in the background.
+        void prefetch(std::size_t first, std::size_t last) const noexcept;
+
+        // Hints that patterns [first, last) will not be needed again, so their pages can be dropped.
+        // Reading them afterwards is still valid, just slower.
+        void release(std::size_t first, std::size_t last) const noexcept;
+    };
+
+    // Writes a dataset file, through a temporary file so a crash mid-write never leaves a truncated dataset.
+    // labels may be null. throws if the file cannot be written
+    void writePatternDataset(
+        const std::string& path,
+        const numeric *patterns,
+        std::size_t numPatterns,
+        std::size_t patternSize,
+        const int32_t *labels=nullptr
+    );
+}
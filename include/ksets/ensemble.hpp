@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+#include "ksets/k3.hpp"
+
+namespace ksets {
+    struct EnsembleConfig {
+        /// Number of worker processes evaluating jobs concurrently.
+        std::size_t numWorkers = 4;
+
+        /// Number of values each job writes as its result.
+        std::size_t resultSize = 1;
+
+        /// Wall clock time after which a running job is considered hung. Its worker is killed, the job is
+        /// marked as failed and a new worker takes its place. Pass 0 to wait forever.
+        numeric jobTimeoutMilliseconds = 60'000;
+
+        /// Interval at which the supervising process checks on its workers.
+        numeric pollMilliseconds = 5;
+    };
+
+    enum class JobStatus : int32_t {
+        PENDING,
+        RUNNING,
+        DONE,
+        /// The evaluator returned false or threw, its worker crashed, or it exceeded the job timeout.
+        FAILED
+    };
+
+    struct JobResult {
+        JobStatus status;
+        /// Has EnsembleConfig::resultSize values, only meaningful if status is DONE.
+        std::vector<numeric> values;
+    };
+
+    /*
+       Evaluates a sweep of K3 configurations in forked worker processes, so that a configuration
+       that trips an assert or otherwise kills its process only fails its own job.
+
+       Jobs and results live in an anonymous shared memory mapping created before forking: workers
+       claim jobs from an atomic counter and write results in place, so there is no serialization
+       and no process startup per evaluation. Crashed or hung workers are replaced automatically.
+       A job its worker claimed but never started, because the worker was killed first, is queued
+       again rather than failed.
+
+       Only the ensemble's own workers are waited on, so the host process may have other children.
+       Since this forks, it should be run from a single threaded process.
+    */
+    class ProcessEnsemble {
+    public:
+        // Runs inside a worker process. Must write EnsembleConfig::resultSize values to result and
+        // return true, or return false (or throw) to mark the job as failed.
+        using Evaluator = std::function<bool(const K3Config& config, std::size_t jobIndex, numeric *result)>;
+
+    private:
+        EnsembleConfig config;
+        Evaluator evaluator;
+        std::size_t numWorkerRestarts = 0;
+
+    public:
+        // throws if numWorkers or resultSize is 0
+        ProcessEnsemble(EnsembleConfig config, Evaluator evaluator);
+
+        // blocks until every job is either done or failed.
+        // throws if shared memory or a worker cannot be created, after killing and reaping the workers already started
+        std::vector<JobResult> run(const std::vector<K3Config>& jobs);
+
+        // number of workers that had to be replaced after crashing or hanging, over all runs
+        std::size_t getNumWorkerRestarts() const noexcept;
+    };
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vector>
+
+#include "ksets/k3.hpp"
+
+namespace ksets {
+    enum class FeatureKind {
+        /// Standard deviation of each olfactory bulb unit's primary output over the window.
+        STDDEV,
+        /// Root mean square of each olfactory bulb unit's primary output over the window.
+        RMS
+    };
+
+    struct FeatureExtractionConfig {
+        /// How long each pattern is presented for.
+        numeric presentationMilliseconds = 200;
+
+        /// Length of the window features are computed over, at the end of each presentation.
+        numeric windowMilliseconds = 100;
+
+        FeatureKind kind = FeatureKind::STDDEV;
+
+        /// Number of threads presenting patterns, each on its own copy of the model.
+        /// Pass 0 to use one per hardware thread.
+        std::size_t numThreads = 0;
+    };
+
+    struct FeatureMatrix {
+        std::size_t numPatterns = 0;
+        std::size_t numFeatures = 0;
+
+        /// Row major, one row of numFeatures values per pattern. Rows of aborted presentations are NaN.
+        std::vector<numeric> values;
+
+        /// How each presentation ended, see K3::getRunStatus.
+        std::vector<RunStatus> statuses;
+
+        numeric at(std::size_t pattern, std::size_t feature) const noexcept {
+            return values[pattern * numFeatures + feature];
+        }
+    };
+
+    /*
+       Presents every pattern to a copy of warmed, always starting from warmed's state, and reduces the
+       olfactory bulb's response to one feature per unit. Features are accumulated as the model commits
+       each iteration, so no history longer than the model's own is kept. Results do not depend on the
+       number of threads.
+
+       patterns is row major, numPatterns rows of warmed.size() values.
+       throws if the window is empty or longer than the presentation
+    */
+    FeatureMatrix extractFeatures(
+        const K3& warmed,
+        const numeric *patterns,
+        std::size_t numPatterns,
+        FeatureExtractionConfig config=FeatureExtractionConfig()
+    );
+}
@@ -1,15 +1,21 @@
 #pragma once
 
 #include <vector>
+#include <atomic>
+#include <string>
 #include <utility>
 #include <array>
 #include <memory>
 #include <map>
 #include <optional>
 #include <functional>
+#include <iterator>
+#include <type_traits>
+#include <cmath>
 
 #include "ksets/config.hpp"
 #include "ksets/activationhistory.hpp"
+#include "ksets/philox.hpp"
 
 /*
    This file technically abuses noexcept, because there are places where
@@ -29,31 +35,118 @@ namespace ksets {
     class K0;
     class K0Collection;
 
-    struct K0Connection {
-        std::shared_ptr<K0> source;
-        K0 *target;
-        numeric weight;
-        std::size_t delay;
+    /*
+       View of one of a node's inbound connections. Connections are stored in compact parallel arrays in
+       their target node (see K0), so weight, delay and tag are copies taken when the view was made. Changes
+       go through setWeight and setDelay, which write to the target node; only those take a private copy of
+       weights and delays the node shares with its copies, so reading connections never does.
+    */
+    template<bool IsConst>
+    struct BasicK0Connection {
+        using Node = std::conditional_t<IsConst, const K0, K0>;
+
+        K0 *source;
+        Node *target;
+        std::size_t index;
+        const numeric weight;
+        const uint16_t delay;
+
+        const std::optional<conntag> tag;
+
+        void setWeight(numeric newWeight) noexcept {
+            static_assert(!IsConst, "Cannot change a connection through a const node");
+            target->connectionWeight(index) = newWeight;
+        }
 
-        std::optional<conntag> tag;
+        // throws if newDelay does not fit in 16 bits
+        void setDelay(std::size_t newDelay) {
+            static_assert(!IsConst, "Cannot change a connection through a const node");
+            target->setConnectionDelay(index, newDelay);
+        }
 
-        K0Connection(
-            std::shared_ptr<K0> source,
-            K0 *target,
-            numeric weight,
-            std::size_t delay,
-            std::optional<conntag> tag=std::nullopt
-        ) noexcept
-            : source(source), target(target), weight(weight), delay(delay), tag(tag) {}
+        // false, leaving the weight as it is, if adding delta would flip its sign
+        bool perturbWeight(numeric delta) noexcept {
+            numeric newWeight = weight + delta;
+            if (std::copysign(1.0, weight) != std::copysign(1.0, newWeight))
+                return false;
+            setWeight(newWeight);
+            return true;
+        }
+    };
+    using K0Connection = BasicK0Connection<false>;
+    using K0ConstConnection = BasicK0Connection<true>;
+
+    // Iterates a node's inbound connections. Views are made on dereference and held by the iterator, so the
+    // reference is only valid until the iterator is dereferenced again, advanced or destroyed, which makes
+    // this an input iterator.
+    template<bool IsConst>
+    class K0ConnectionIterator {
+        using Node = std::conditional_t<IsConst, const K0, K0>;
+        Node *node;
+        std::size_t index;
+        mutable std::optional<BasicK0Connection<IsConst>> current;
+    public:
+        using value_type = BasicK0Connection<IsConst>;
+        using reference = value_type&;
+        using pointer = value_type*;
+        using difference_type = std::ptrdiff_t;
+        using iterator_category = std::input_iterator_tag;
+
+        K0ConnectionIterator(Node *node, std::size_t index) noexcept: node(node), index(index) {}
+        // the held view is not copied, views cannot be reassigned
+        K0ConnectionIterator(const K0ConnectionIterator& other) noexcept: node(other.node), index(other.index) {}
+        K0ConnectionIterator& operator=(const K0ConnectionIterator& other) noexcept {
+            node = other.node;
+            index = other.index;
+            current.reset();
+            return *this;
+        }
+
+        reference operator*() const noexcept { return current.emplace(node->connectionAt(index)); }
+        pointer operator->() const noexcept { return &**this; }
 
-        bool perturbWeight(numeric delta) noexcept;
+        K0ConnectionIterator& operator++() noexcept {
+            index++;
+            return *this;
+        }
+        K0ConnectionIterator operator++(int) noexcept {
+            K0ConnectionIterator old = *this;
+            index++;
+            return old;
+        }
+        K0ConnectionIterator operator+(difference_type n) const noexcept { return {node, index + n}; }
+        difference_type operator-(const K0ConnectionIterator& other) const noexcept { return index - other.index; }
+
+        bool operator==(const K0ConnectionIterator& other) const noexcept { return node == other.node && index == other.index; }
+        bool operator!=(const K0ConnectionIterator& other) const noexcept { return !(*this == other); }
     };
 
     class K0 {
         numeric calculateNetInput() noexcept;
         void pushOutputToHistory() noexcept;
 
-        std::vector<K0Connection> inboundConnections;
+        // Inbound connections as parallel arrays, so the net input loop only streams through what it uses.
+        // Tags are rare and only used when wiring or learning, so they live in a side table.
+        // Everything but the sources can be shared between copies of a node (see copyStateFrom), so replicas
+        // of a set do not duplicate its weights until they change one.
+        // Sources are plain pointers: a node does not keep its sources alive, whatever owns it does (see
+        // K0Collection), so a connection costs 14 bytes and no reference counting.
+        struct ConnectionParameters {
+            std::vector<numeric> weights;
+            std::vector<uint16_t> delays;
+            // (connection index, tag), sorted by connection index
+            std::vector<std::pair<uint32_t, conntag>> tags;
+            // Set once a second node points at these. From then on they are never written again, even after
+            // the other node lets go, so no node ever has to know whether it is the last one holding them.
+            mutable std::atomic<bool> shared {false};
+
+            ConnectionParameters() = default;
+            ConnectionParameters(const ConnectionParameters& other):
+                weights(other.weights), delays(other.delays), tags(other.tags) {}
+        };
+        std::vector<K0 *> connectionSources;
+        // never null
+        std::shared_ptr<const ConnectionParameters> connectionParameters;
         numeric currentExternalStimulus = 0;
 
         // [0] = current output (pre-sigmoid)
@@ -69,9 +162,12 @@ namespace ksets {
         numeric sigmoidQ;
         std::optional<std::reference_wrapper<K0Collection>> collection = std::nullopt;
         std::optional<std::size_t> id = std::nullopt;
-        std::optional<std::function<numeric()>> noiseRng;
+        std::optional<NoiseStream> noise;
 
         void swap(K0& other) noexcept;
+        // takes a private copy of connectionParameters first if they were ever shared
+        ConnectionParameters& mutableConnectionParameters() noexcept;
+        void shareConnectionParametersOf(const K0& other) noexcept;
     public:
         explicit K0(K0Config config=K0Config()) noexcept;
         explicit K0(K0Collection& collection, std::size_t id, K0Config config=K0Config()) noexcept;
@@ -84,45 +180,117 @@ namespace ksets {
         std::optional<std::reference_wrapper<K0Collection>> getCollection() noexcept { return collection; }
         std::optional<std::size_t> getId() noexcept { return id; }
 
-        void setRngEngine(std::function<numeric()> newEngine);
+        void setNoiseStream(NoiseStream newNoise);
+        // changes the noise's standard deviation, keeping its position in the stream
+        // throws if the node has no noise stream
+        void setNoiseStdDev(numeric stdDev);
 
         void setHistorySize(std::size_t nIter);
         void setActivityMonitoring(std::size_t nIter);
+        // see ActivationHistory::setSummaryTiers
+        void setHistoryTiers(const std::vector<HistoryTierConfig>& tiers);
         void setCollection(K0Collection& collection) noexcept;
         void setId(std::size_t id) noexcept;
 
+        // Copies other's ODE state, history, stimulus, noise stream and the weights, delays and tags of the first
+        // numConnections connections, which both nodes must have, leaving this node's later connections as they
+        // are. Meant for nodes in graphs of the same shape, e.g. the connections a K3 makes itself, before those
+        // a K4 appends. If neither node has any other connection, the weights, delays and tags are shared
+        // instead of copied, until either node changes them.
+        // Sharing is only safe if other is not changing its weights meanwhile: copying from a node that
+        // another thread is learning on or rewiring is a data race.
+        void copyStateFrom(const K0& other, std::size_t numConnections) noexcept;
+
+        // Replaces this node's connections with copies of other's, redirecting those whose source is a key of
+        // oldToNew to the mapped node. Used to move a graph to new storage. Weights, delays and tags are shared
+        // as in copyStateFrom. Sources missing from oldToNew are read from as they are, so they must outlive
+        // this node.
+        void copyConnectionsFrom(const K0& other, const std::map<const K0 *, std::shared_ptr<K0>>& oldToNew);
+
+        // clones this node and every node it reads from, directly or not; the returned map owns the clones
         std::map<const K0 *, std::shared_ptr<K0>> cloneSubgraph() const noexcept;
         void cloneSubgraph(std::map<const K0 *, std::shared_ptr<K0>>& partialMapping) const noexcept;
 
         std::string repr() const noexcept;
 
+        // The source is not kept alive by this node, and must outlive it or have the connection cleared first.
+        // throws if delay does not fit in 16 bits
+        void addInboundConnection(
+            K0& source,
+            numeric weight,
+            std::size_t delay=0,
+            std::optional<conntag> tag=std::nullopt
+        );
         void addInboundConnection(
-            std::shared_ptr<K0> source,
+            const std::shared_ptr<K0>& source,
             numeric weight,
             std::size_t delay=0,
             std::optional<conntag> tag=std::nullopt
-        ) noexcept;
+        ) {
+            addInboundConnection(*source, weight, delay, tag);
+        }
         void clearInboundConnections() noexcept;
+        // makes room for numConnections inbound connections in total, so wiring them does not reallocate
+        void reserveInboundConnections(std::size_t numConnections) noexcept;
+
+        // Sets the weight and delay of the connection from source, searching from connection hint on, so that
+        // rewriting connections in the order they were added takes one step each. Weights and delays shared with
+        // copies of this node are only detached if they change. Returns the connection's index.
+        // throws if no connection comes from source or delay does not fit in 16 bits
+        std::size_t setInboundConnection(const K0& source, numeric weight, std::size_t delay=0, std::size_t hint=0);
+
+        // points an existing connection at a different source, e.g. a mirror (see K3::runPartitioned), which
+        // is not kept alive either
+        void redirectConnection(std::size_t index, K0& source, std::size_t delay);
+
+        std::size_t numInboundConnections() const noexcept {
+            return connectionSources.size();
+        }
+
+        K0Connection connectionAt(std::size_t index) noexcept;
+        K0ConstConnection connectionAt(std::size_t index) const noexcept;
+
+        // direct access to a connection's weight, without the tag lookup of connectionAt
+        numeric& connectionWeight(std::size_t index) noexcept {
+            return mutableConnectionParameters().weights[index];
+        }
+
+        // throws if delay does not fit in 16 bits
+        void setConnectionDelay(std::size_t index, std::size_t delay);
+
+        // takes a private copy of weights, delays and tags that were ever shared with other nodes, so changing
+        // them later through this node does not allocate, until it is copied from again
+        void unshareConnectionParameters() noexcept {
+            mutableConnectionParameters();
+        }
+
+        // whether this node's weights, delays and tags are currently the same storage as other's
+        bool sharesConnectionParametersWith(const K0& other) const noexcept {
+            return connectionParameters == other.connectionParameters;
+        }
 
         auto begin() {
-            return inboundConnections.begin();
+            return K0ConnectionIterator<false>(this, 0);
         }
 
         auto end() {
-            return inboundConnections.end();
+            return K0ConnectionIterator<false>(this, numInboundConnections());
         }
 
         auto begin() const {
-            return inboundConnections.begin();
+            return K0ConnectionIterator<true>(this, 0);
         }
 
         auto end() const {
-            return inboundConnections.end();
+            return K0ConnectionIterator<true>(this, numInboundConnections());
         }
 
         numeric getCurrentOutput() const noexcept;
         numeric getDelayedOutput(std::size_t delay) const noexcept;
 
+        // false if the ODE state has become NaN or infinite
+        bool isStateFinite() const noexcept;
+
         void setExternalStimulus(numeric newExternalStimulus) noexcept;
         void calculateNextState() noexcept;
         void calculateNextState(numeric newExternalStimulus) noexcept;
@@ -132,13 +300,39 @@ namespace ksets {
         void calculateAndCommitNextState(numeric newExternalStimulus) noexcept;
 
         void randomizeState(std::function<numeric()>& rng) noexcept;
+        // back to the state of a new node: zero ODE state, stimulus and input noise, and a cleared history.
+        // Connections, noise stream and history settings are kept.
+        void clearState() noexcept;
+
+        // pushes an output computed elsewhere straight into the history, bypassing the ODE.
+        // Used by nodes that mirror a node owned by another thread (see K4).
+        void relayOutput(numeric output) noexcept;
 
         const ActivationHistory& getActivationHistory() const noexcept;
+        ActivationHistory& getActivationHistory() noexcept;
+
+        // Everything but the connections and history, for serialization (see K3::save).
+        struct RawState {
+            OdeState odeState;
+            OdeState nextOdeState;
+            numeric externalStimulus;
+            numeric inputNoise;
+            numeric sigmoidQ;
+            std::optional<NoiseStream> noise;
+        };
+        RawState getRawState() const noexcept;
+        void restoreRawState(const RawState& state) noexcept;
     };
 
+    // Owns its nodes. Nodes only point at their sources, so whatever wires nodes of different collections
+    // together (K3, K4, Network) keeps all of them alive for as long as they are connected.
     class K0Collection {
         std::vector<std::shared_ptr<K0>> nodes;
-        std::optional<std::string> name;
+        // nodes of other collections that were cloned along with this one's by the copy constructor, since
+        // this one's nodes read from them and nothing else owns them
+        std::vector<std::shared_ptr<K0>> clonedSources;
+        // shared between copies, see shareNameWith
+        std::shared_ptr<const std::string> name;
 
         void initNodes(std::size_t nNodes, const K0Config& config);
     public:
@@ -146,17 +340,24 @@ namespace ksets {
         explicit K0Collection(std::size_t nNodes, std::optional<std::string> name=std::nullopt, K0Config config=K0Config());
 
         K0Collection(const K0Collection& other) noexcept;
-        ~K0Collection();
 
-        void setName(std::string name) { this->name = name; }
-        bool hasName() const { return this->name.has_value(); }
-        std::optional<std::string>& getName() noexcept { return name; }
+        void setName(std::string name) { this->name = std::make_shared<const std::string>(std::move(name)); }
+        bool hasName() const { return this->name != nullptr; }
+        // empty if the collection has no name
+        const std::string& getName() const noexcept;
+
+        // makes this collection use other's name without keeping a copy of it
+        void shareNameWith(const K0Collection& other) noexcept { name = other.name; }
 
         std::size_t size() const noexcept;
 
         // sets the nodes in this collection to have a reference to it
         void updateNodeCollectionReferenceAndId() noexcept;
 
+        // swaps every node for the one oldToNew maps it to, which takes over its collection and id.
+        // throws if a node is missing from oldToNew
+        void replaceNodes(const std::map<const K0 *, std::shared_ptr<K0>>& oldToNew);
+
         std::shared_ptr<K0> primaryNode() noexcept { return node(0); }
         const std::shared_ptr<K0> primaryNode() const noexcept { return node(0); }
 
@@ -18,6 +18,10 @@ namespace ksets {
         K1(K1Config config);
         K1(const K1& other) noexcept;
 
+        // rewrites the intra unit weights in place; config.k0config is ignored
+        // throws if signs of the weights are different
+        void setWeights(const K1Config& config);
+
         std::shared_ptr<K0> secondaryNode() noexcept { return node(1); }
         const std::shared_ptr<K0> secondaryNode() const noexcept { return node(1); }
     };
@@ -28,6 +28,10 @@ namespace ksets {
         explicit K2(const K2Config config, std::optional<std::string> name=std::nullopt) noexcept;
         K2(const K2& other) noexcept;
 
+        // rewrites the intra unit weights in place; config.k0config is ignored
+        // throws if the weights are invalid (see K2Config::checkWeights)
+        void setWeights(const K2Config& config);
+
         // TODO: if this gets readded to the spec, make it receive a std::function<numeric()> instead of
         // being a member template function
         // template<typename RNG>
@@ -25,13 +25,35 @@ namespace ksets {
             std::optional<conntag> tag=std::nullopt
         ) noexcept;
 
+        // rewrite the weights and delays of lateral connections made by the above in place, scaled the same way.
+        // throw if the weight is invalid (as the above would reject it) or if any unit lacks such a connection
+        void setPrimaryLateralWeights(numeric interUnitWeight, std::size_t delay=0);
+        void setAntipodalLateralWeights(numeric interUnitWeight, std::size_t delay=0);
+
+        // rewrites every unit's intra unit weights in place
+        // throws if the weights are invalid
+        void setUnitWeights(const K2Config& k2config);
+
+        // clears the average activation histories (see ActivationHistory::clear)
+        void clearAverageActivationHistories() noexcept;
+
         void setPrimaryHistorySize(std::size_t newSize);
         void setAntipodalHistorySize(std::size_t newSize);
         void setPrimaryActivityMonitoring(std::size_t newSize);
         void setAntipodalActivityMonitoring(std::size_t newSize);
+        void setPrimaryHistoryTiers(const std::vector<HistoryTierConfig>& tiers);
+        void setAntipodalHistoryTiers(const std::vector<HistoryTierConfig>& tiers);
 
         const ActivationHistory& getAveragePrimaryActivationHistory() const noexcept;
         const ActivationHistory& getAverageAntipodalActivationHistory() const noexcept;
+        void copyAverageActivationHistories(const K2Layer& other);
+        ActivationHistory& getAveragePrimaryActivationHistory() noexcept;
+        ActivationHistory& getAverageAntipodalActivationHistory() noexcept;
+
+        // copy the last numSamples outputs of every unit's primary or antipodal node, oldest first, into
+        // destination, which must hold size() * numSamples values (see ksets::exportHistories)
+        void exportPrimaryHistories(std::size_t numSamples, numeric *destination, MatrixLayout layout) const;
+        void exportAntipodalHistories(std::size_t numSamples, numeric *destination, MatrixLayout layout) const;
 
         std::size_t size() const noexcept;
 
@@ -5,11 +5,16 @@
 #include <cassert>
 #include <memory>
 #include <functional>
+#include <chrono>
+#include <optional>
+#include <string>
 
 #include "ksets/k0.hpp"
 #include "ksets/k1.hpp"
 #include "ksets/k2.hpp"
 #include "ksets/k2layer.hpp"
+#include "ksets/learning.hpp"
+#include "ksets/trace.hpp"
 
 namespace ksets {
     struct K3Config {
@@ -142,7 +147,8 @@ namespace ksets {
         std::size_t outputHistorySize = odeMillisecondsToIters(4'000);
 
         /// Number of latest iterations for which output nodes (primary and antipodal nodes of the olfactory bulb,
-        /// layer 1 of K2 sets) variance and standard deviation will be tracked.
+        /// layer 1 of K2 sets) variance and standard deviation will be tracked. Must be at least 2 below
+        /// outputHistorySize, or 0 to disable.
         std::size_t outputActivityMonitoring = odeMillisecondsToIters(300);
 
         /// Length of history tracking for non-output nodes. See outputHistorySize for more information.
@@ -151,8 +157,33 @@ namespace ksets {
         /// Standard deviation of the gaussian RNG used to initialize all K0 in the K3 set.
         numeric noiseInitialK0States = 0.2;
 
-        /// Number of RNG seeds to be created in a batch.
-        std::size_t rngSeedGenBatchSize = 32;
+
+        /// Number of iterations between degeneracy checks performed while running: non-finite state in any node,
+        /// saturation of the olfactory bulb (OB, layer 1 of K2 sets) at the sigmoid floor and collapsed OB variance.
+        /// A run that fails any of them is aborted. See RunStatus for more information. Pass 0 to disable them.
+        std::size_t degeneracyCheckInterval = 0;
+
+        /// Number of latest iterations of the olfactory bulb output inspected by each degeneracy check.
+        /// Saturation and variance are only checked once this many iterations have been run.
+        /// Clamped to outputHistorySize - 1. Saturation and variance are never checked if outputHistorySize is below 3.
+        std::size_t degeneracyCheckWindow = odeMillisecondsToIters(100);
+
+        /// The olfactory bulb is considered saturated if every one of its primary nodes stayed within this distance
+        /// of the sigmoid floor (-1) during the whole check window.
+        numeric saturationTolerance = 1e-4;
+
+        /// The olfactory bulb is considered collapsed if the variance of its average primary activation over the
+        /// check window falls below this value.
+        numeric minOutputVariance = 1e-8;
+
+        /// Maximum number of iterations a single evaluation may run for, including the initial rest.
+        /// See K3::resetRunStatus for how to start a new evaluation. Pass 0 for no limit.
+        std::size_t maxRunIterations = 0;
+
+        /// Maximum wall clock time a single evaluation may take, including the initial rest. It is only checked
+        /// every degeneracyCheckInterval iterations, or every 64 iterations if those checks are disabled.
+        /// Pass 0 for no limit.
+        numeric maxRunWallMilliseconds = 0;
 
         K3Config() {
             // assert default weights are valid
@@ -168,13 +199,154 @@ namespace ksets {
                 && pos(wOB_inter[0]) && neg(wOB_inter[1])
                 && wOB_unitConfig.checkWeights() && wAON_unitConfig.checkWeights() && wPC_unitConfig.checkWeights();
         }
+
+        // whether every delay is shorter than the history of the node it reads from, and fits in 16 bits
+        bool checkDelaysValidity() const {
+            return fits(dPG_interUnit, nonOutputHistorySize) && fits(dPG_intraUnit, nonOutputHistorySize)
+                && fits(dPG_OB, nonOutputHistorySize) && fits(dPC_DPC, nonOutputHistorySize)
+                && fits(dOB_AON_lot, outputHistorySize) && fits(dOB_PC_lot, outputHistorySize)
+                && fits(dAON_PG_mot, outputHistorySize) && fits(dAON_OB_toAntipodal, outputHistorySize)
+                && fits(dPC_AON_toAntipodal, outputHistorySize) && fits(dDPC_PC, outputHistorySize)
+                && fits(dDPC_OB_toAntipodal, outputHistorySize);
+        }
     private:
         bool pos(numeric value) const { return value > 0; }
         bool neg(numeric value) const { return value < 0; }
+        bool fits(std::size_t delay, std::size_t historySize) const { return delay < historySize && delay <= 65535; }
+    };
+
+    /// Order nodes are laid out in memory by K3::reorderNodes.
+    enum class NodeOrdering {
+        /// Layer by layer: input layer, olfactory bulb, AON, PC and DPC.
+        LAYER,
+        /// Reverse Cuthill-McKee over the connection graph, which keeps every node close to the nodes it
+        /// reads from, notably for densely connected olfactory bulbs.
+        REVERSE_CUTHILL_MCKEE
+    };
+
+    struct PartitionConfig {
+        /// Connections with at least this delay may be cut between partitions. Partitions are the strongly
+        /// connected groups of components left when those are ignored, so any cycle between two partitions
+        /// goes through a connection this long, and they can drift that far apart.
+        std::size_t minCutDelay = 16;
+
+        /// How many iterations a partition may run ahead of the partitions reading from it. Larger values
+        /// let workers wait less, at the cost of bigger buffers.
+        std::size_t maxLead = 64;
+
+        /// Number of worker threads, each advancing one or more partitions. Pass 0 to use one per hardware thread.
+        std::size_t numThreads = 0;
+    };
+
+    struct PartitionPlan {
+        /// Component indices of each partition, see K3::planPartitions.
+        std::vector<std::vector<std::size_t>> partitions;
+
+        /// Number of connections between different partitions.
+        std::size_t numCutConnections = 0;
+
+        /// Shortest feedback delay between partitions: the shortest cut connection of at least minCutDelay that is
+        /// part of a cycle between partitions, or 0 if the partitions form no cycle.
+        std::size_t minFeedbackDelay = 0;
+    };
+
+    /// Outcome of running a K3. Anything other than OK means the run was aborted early, and every
+    /// subsequent rest or presentation returns immediately with the same status until K3::resetRunStatus is called.
+    enum class RunStatus {
+        OK,
+        /// Some node's state became NaN or infinite.
+        NON_FINITE,
+        /// Every primary node of the olfactory bulb is stuck at the sigmoid floor.
+        SATURATED,
+        /// The average olfactory bulb output settled to a fixed point.
+        COLLAPSED,
+        /// K3Config::maxRunIterations was reached.
+        ITERATION_BUDGET_EXCEEDED,
+        /// K3Config::maxRunWallMilliseconds was reached.
+        TIME_BUDGET_EXCEEDED
+    };
+
+    const char *runStatusName(RunStatus status) noexcept;
+
+    struct LyapunovConfig {
+        /// Number of exponents estimated, largest first.
+        std::size_t numExponents = 1;
+
+        /// Time the tangent vectors are given to line up with the most expanding directions before being measured.
+        numeric transientMilliseconds = 1'000;
+
+        /// Time over which the exponents are averaged.
+        numeric measureMilliseconds = 10'000;
+
+        /// How often the tangent vectors are orthonormalized. Must be short enough that they neither overflow
+        /// nor collapse onto the largest exponent's direction in between.
+        numeric renormalizationMilliseconds = 5;
+
+        /// Seeds the random initial tangent vectors.
+        rngseed seed = 0;
+    };
+
+    struct LyapunovSpectrum {
+        /// Estimated exponents, largest first, per millisecond of simulated time. A positive largest exponent
+        /// means the set is chaotic.
+        std::vector<numeric> exponents;
+
+        /// Estimate of the largest exponent after each renormalization, to judge convergence.
+        std::vector<numeric> largestExponentHistory;
+
+        numeric measuredMilliseconds = 0;
+
+        /// If the run was aborted, the exponents only cover the time measured until then.
+        RunStatus runStatus = RunStatus::OK;
+    };
+
+    /// What K3::reparameterize takes from the new config. Connection groups update weights and delays.
+    struct ReparameterizationConfig {
+        /// Intra unit weights of the periglomerular K1 units and of the olfactory bulb, AON and PC K2 units.
+        bool intraUnit = true;
+
+        /// Lateral weights between periglomerular units and between olfactory bulb units. The olfactory bulb's
+        /// primary lateral weights are perturbed again as in the constructor, undoing any lateral learning.
+        bool lateral = true;
+
+        /// The feedforward path along the lateral olfactory tract: PG to OB, OB to AON and PC, and PC to DPC.
+        bool lot = true;
+
+        /// The feedback paths along the medial olfactory tract: AON to PG and to the OB antipodal nodes, PC to AON,
+        /// and DPC to the OB antipodal nodes and to PC.
+        bool mot = true;
+
+        /// Standard deviation of the input noise of the periglomerular, olfactory bulb and AON primary nodes.
+        /// The noise streams keep their positions unless the state is reset.
+        bool noise = true;
+
+        /// Whether to put the set back in the state a new set with the same seed and the new config would have
+        /// before its initial rest, rather than keep running from its current state.
+        bool resetState = false;
+
+        /// When resetting the state, how long to rest afterwards, as the constructor's initialRestMilliseconds.
+        numeric initialRestMilliseconds = 0;
     };
 
+    class K3Stream;
+    class K3Tangent;
+    class K3Sensitivity;
+    class RealtimeStepper;
+
     class K3 {
+        friend class K3Stream;
+        friend class K3Tangent;
+        friend class K3Sensitivity;
+        friend class RealtimeStepper;
+
         static constexpr conntag TAG_OB_PRIMARY_LATERAL = 1;
+        static constexpr std::size_t DEFAULT_BUDGET_CHECK_INTERVAL = 64;
+
+        K3Config config;
+        rngseed seed = 0;
+        RunStatus runStatus = RunStatus::OK;
+        std::size_t iterationsRun = 0;
+        std::chrono::steady_clock::time_point runStart;
 
         std::vector<K1> periglomerularCells;
         K2Layer olfactoryBulb;
@@ -182,23 +354,188 @@ namespace ksets {
         K2 prepiriformCortex;
         K0Collection deepPyramidCells;
 
+        std::optional<LateralHebbianLearning> obLateralLearning;
+        std::unique_ptr<TraceRecorder> trace;
+
+        struct StructureOnly {};
+        // builds, names and wires every component, without perturbing, randomizing or running anything
+        K3(std::size_t olfactoryBulbNumUnits, const K3Config& config, StructureOnly);
+
+        // visits every node in a fixed order: input layer, olfactory bulb, AON, PC and DPC,
+        // each collection in node id order
+        template<typename Visitor>
+        void forEachNode(Visitor visit) const {
+            for (auto& pgUnit : periglomerularCells)
+                for (auto& node : pgUnit)
+                    visit(node);
+            for (auto& obUnit : olfactoryBulb)
+                for (auto& node : obUnit)
+                    visit(node);
+            for (auto& node : anteriorOlfactoryNucleus)
+                visit(node);
+            for (auto& node : prepiriformCortex)
+                visit(node);
+            for (auto& node : deepPyramidCells)
+                visit(node);
+        }
+
+        // visits every collection in forEachNode order
+        template<typename Visitor>
+        void forEachCollection(Visitor visit) {
+            for (auto& pgUnit : periglomerularCells)
+                visit(static_cast<K0Collection&>(pgUnit));
+            for (auto& obUnit : olfactoryBulb)
+                visit(static_cast<K0Collection&>(obUnit));
+            visit(static_cast<K0Collection&>(anteriorOlfactoryNucleus));
+            visit(static_cast<K0Collection&>(prepiriformCortex));
+            visit(deepPyramidCells);
+        }
+
+        template<typename Visitor>
+        void forEachCollection(Visitor visit) const {
+            for (auto& pgUnit : periglomerularCells)
+                visit(static_cast<const K0Collection&>(pgUnit));
+            for (auto& obUnit : olfactoryBulb)
+                visit(static_cast<const K0Collection&>(obUnit));
+            visit(static_cast<const K0Collection&>(anteriorOlfactoryNucleus));
+            visit(static_cast<const K0Collection&>(prepiriformCortex));
+            visit(deepPyramidCells);
+        }
+
         void connectPeriglomerularCellsLaterally(numeric weight, std::size_t delay=0) noexcept;
-        void connectLayers(const K3Config& config) noexcept;
+        void setPeriglomerularLateralWeights(numeric weight, std::size_t delay=0);
+        void connectLayers(const K3Config& config, const ReparameterizationConfig *rewrite=nullptr);
 
         void nameAndSetCollectionForAllSubcomponents() noexcept;
         void connectAllSubcomponents(const K3Config& config) noexcept;
 
-        void randomizeK0States(const K3Config& config, std::function<rngseed()>& seedGen) noexcept;
-        void setupInputAndAonNoise(const K3Config& config, std::function<rngseed()>& seedGen) noexcept;
+        // All randomness is drawn from counter-based streams keyed by the model seed and the node's position
+        // in forEachNode, so it does not depend on construction order or on which thread does the drawing.
+        void randomizeK0States(const K3Config& config) noexcept;
+        void setupInputAndAonNoise(const K3Config& config) noexcept;
+
+        void perturbObPrimaryLateralWeights(std::size_t numObUnits, const K3Config& config) noexcept;
 
-        void perturbObPrimaryLateralWeights(std::size_t numObUnits, const K3Config& config, std::function<rngseed()>& seedGen) noexcept;
+        // Components are the parts of the set that are stepped as a whole, numbered in forEachNode order:
+        // each input layer unit, then the olfactory bulb, AON, PC and DPC. Committing a component also
+        // advances its noise and, for the olfactory bulb, lateral learning.
+        std::size_t numComponents() const noexcept;
+        std::vector<std::shared_ptr<K0>> componentNodes(std::size_t component) const;
+        void calculateComponentNextState(std::size_t component) noexcept;
+        void commitComponentNextState(std::size_t component) noexcept;
 
         void calculateNextState() noexcept;
         void commitNextState() noexcept;
         void calculateAndCommitNextState() noexcept;
 
-        void eraseExternalStimulus() noexcept;
+        void recordTrace() noexcept;
+
+        bool hasFiniteState() const noexcept;
+        bool isOlfactoryBulbSaturated(std::size_t window) const noexcept;
+        RunStatus checkRunHealth() const noexcept;
+
+        RunStatus run(numeric milliseconds) noexcept;
+
+    public:
+        // seeded from std::random_device
+        explicit K3(std::size_t olfactoryBulbNumUnits, numeric initialRestMilliseconds, K3Config config=K3Config());
+        // seeded with one value drawn from seedFactory
+        explicit K3(std::size_t olfactoryBulbNumUnits, numeric initialRestMilliseconds, std::function<rngseed()> seedFactory, K3Config config=K3Config());
+        // Two sets built with the same seed, size and config are bit identical, and stay so as long as they are
+        // run the same way.
+        explicit K3(std::size_t olfactoryBulbNumUnits, numeric initialRestMilliseconds, rngseed seed, K3Config config=K3Config());
+
+        // Copy of the weights, state, histories and noise streams. The replica is built from other's config like
+        // any set, so it allocates its own nodes, connection sources and histories; only the weights, delays and
+        // tags of the connections the set made itself, and the collection names, are shared with other until
+        // either set changes them. Inter-set connections made by a K4 are not copied.
+        // other must not be run or have its weights changed by another thread meanwhile.
+        K3(const K3& other);
+        K3& operator=(const K3& other) = delete;
+
+        // Makes this set's state, weights and noise streams identical to other's, reusing the state's
+        // allocations and sharing the weights as in the copy constructor. Nodes with inter-set connections made
+        // by a K4 get the set's own weights copied instead, leaving the inter-set ones untouched.
+        // throws if other has a different number of units
+        void copyStateFrom(const K3& other);
+
+        // Writes the topology, weights, delays, ODE states, histories and noise stream positions to a versioned
+        // binary file laid out as fixed size records (see k3io.cpp). Inter-set connections made by a K4 and
+        // lateral learning statistics are not saved, though learned weights are.
+        // throws if the file cannot be written
+        void save(const std::string& path) const;
+
+        // Maps a file written by save and rebuilds the set exactly as it was saved, ready to keep running.
+        // The records are read in place, but the set is still built and wired from its config as in the
+        // constructor, and every weight, state and history is then copied out of the file, so loading costs as
+        // much as building a new set of the same size; what it saves is the initial rest.
+        // throws if the file cannot be read, is not a K3 model, has an unsupported version, was written on a
+        // machine with a different byte order or numeric type, is corrupt, or its topology does not match its config
+        static std::unique_ptr<K3> load(const std::string& path);
+
+        // Moves every node into one contiguous block of memory in the given order, reallocating their histories
+        // in that same order, so that nodes reading each other's delay lines sit close together.
+        // Node ids, collections, tags, forEachNode order and results are all unchanged.
+        // Must not be called on a set that is part of a K4, whose links point at the old nodes.
+        void reorderNodes(NodeOrdering ordering=NodeOrdering::REVERSE_CUTHILL_MCKEE);
+
+        // Updates the weights, delays and noise levels of this set from newConfig in place, group by group, reusing
+        // every node, connection and history instead of building a new set. The set's config takes newConfig's
+        // fields for the selected groups, and for the run budgets and checks; history sizes and activity
+        // monitoring are kept, since changing them would reallocate. Inter-set connections made by a K4 are left
+        // untouched.
+        // Returns the run status, after the rest if the state was reset.
+        // throws if newConfig's weights are invalid, or a delay is not shorter than the history it reads from or does
+        // not fit in 16 bits, before changing anything
+        RunStatus reparameterize(const K3Config& newConfig, ReparameterizationConfig reparameterization={});
+
+        // Keeps summaries of the output nodes' and olfactory bulb averages' older values, beyond
+        // K3Config::outputHistorySize, which can then be kept short on long runs (see
+        // ActivationHistory::setSummaryTiers). Pass no tiers to disable.
+        // throws if a tier is invalid
+        void setOutputHistoryTiers(const std::vector<HistoryTierConfig>& tiers);
+
+        RunStatus rest(numeric milliseconds) noexcept;
+
+        // Splits the set into partitions, each a list of components: 0 to size()-1 are the input layer units,
+        // then come the olfactory bulb, AON, PC and DPC. With the default delays this yields the input layer,
+        // the olfactory bulb, the AON, and the PC together with the DPC.
+        PartitionPlan planPartitions(std::size_t minCutDelay) const;
+
+        // Same as run, but with each partition advanced by a worker thread with no global barriers. Every
+        // connection between partitions reads from a buffer its source fills as it commits, so a partition only
+        // waits for the outputs it actually needs. Results are bit identical to run.
+        // Degeneracy and budget checks are made at the same intervals as in run, where all workers stop.
+        // Must not be called on a set that is part of a K4.
+        RunStatus runPartitioned(numeric milliseconds, PartitionConfig partitionConfig=PartitionConfig());
+        RunStatus restPartitioned(numeric milliseconds, PartitionConfig partitionConfig=PartitionConfig());
+
+        // Rests the set while propagating tangent vectors through the linearized dynamics, delay lines included,
+        // and estimates the Lyapunov exponents from their growth (Benettin et al.). Input noise is additive, so
+        // it does not enter the tangent dynamics, and connections from other sets are treated as inputs.
+        // throws if lateral learning is enabled, since the weights are taken as fixed, or if lyapunovConfig is
+        // invalid or asks for more exponents than the set has dimensions
+        LyapunovSpectrum estimateLyapunovExponents(LyapunovConfig lyapunovConfig=LyapunovConfig());
 
+        template<typename Iterator>
+        RunStatus present(numeric milliseconds, Iterator patternFirst, Iterator patternLast) {
+            setPattern(patternFirst, patternLast);
+            return run(milliseconds);
+        }
+
+        RunStatus getRunStatus() const noexcept;
+        rngseed getSeed() const noexcept;
+        std::size_t getIterationsRun() const noexcept;
+
+        // starts a new evaluation: clears an abort status and restarts the iteration and wall clock budgets
+        void resetRunStatus() noexcept;
+        // restarts only the wall clock budget, e.g. for a copy of a set warmed up long before it is run, whose
+        // initial rest still counts towards the iteration budget
+        void restartRunClock() noexcept;
+
+        // External scheduling: these let a container (see K4) drive the set one iteration at a time.
+        // step performs no degeneracy or budget checks.
+        void eraseExternalStimulus() noexcept;
         template<typename Iterator>
         void setPattern(Iterator patternFirst, Iterator patternEnd) {
             if (patternEnd - patternFirst != periglomerularCells.size())
@@ -217,25 +554,60 @@ namespace ksets {
             }
         }
 
-        void advanceSystemNoise() noexcept;
-
-        void run(numeric milliseconds) noexcept;
+        void step() noexcept;
 
-    public:
-        explicit K3(std::size_t olfactoryBulbNumUnits, numeric initialRestMilliseconds, K3Config config=K3Config());
-        explicit K3(std::size_t olfactoryBulbNumUnits, numeric initialRestMilliseconds, std::function<rngseed()> seedFactory, K3Config config=K3Config());
-
-        void rest(numeric milliseconds) noexcept;
-
-        template<typename Iterator>
-        void present(numeric milliseconds, Iterator patternFirst, Iterator patternLast) {
-            setPattern(patternFirst, patternLast);
-            run(milliseconds);
-        }
+        // number of units in the input layer and olfactory bulb
+        std::size_t size() const noexcept;
 
         const K2Layer& getOlfactoryBulb() const noexcept;
         const K2& getAnteriorOlfactoryNucleus() const noexcept;
         const std::shared_ptr<const K0> getPrepiriformCortexPrimary() const noexcept;
         const std::shared_ptr<const K0> getDeepPyramidCells() const noexcept;
+
+        // Copies the last numSamples outputs of each of the given nodes, oldest first, into destination, which
+        // must hold nodes.size() * numSamples values (see ksets::exportHistories). For whole layers see
+        // K2Layer::exportPrimaryHistories.
+        // throws if a node is not part of this set or numSamples exceeds its history size
+        void exportHistories(
+            const std::vector<std::shared_ptr<const K0>>& nodes,
+            std::size_t numSamples,
+            numeric *destination,
+            MatrixLayout layout
+        ) const;
+
+        // Online Hebbian learning and habituation of the lateral weights between the primary nodes of the
+        // olfactory bulb. Habituation decays weights towards the values they had when learning was enabled.
+        void enableObLateralLearning(HebbianConfig config);
+        void disableObLateralLearning() noexcept;
+
+        // these throw if learning is disabled
+        // applies one learning update right away, e.g. at the end of a presentation
+        void learnObLateralWeights();
+        const LateralHebbianLearning& getObLateralLearning() const;
+
+        // Records the output of every olfactory bulb node after each commit, one channel per node, unit by unit
+        // and each unit in node id order, stamped with the number of commits the olfactory bulb has made. Files are written by a background thread, see TraceRecorder.
+        // Replaces any running trace. Traces are not copied, saved or loaded.
+        // throws if the trace files cannot be created
+        void startTrace(const std::string& pathPrefix, TraceConfig config=TraceConfig());
+
+        // writes out everything recorded so far and returns the final counters
+        // throws if no trace is running, or if any write failed
+        TraceStats stopTrace();
+
+        // throws if no trace is running
+        TraceStats getTraceStats() const;
+
+        // throws if index >= size()
+        const K1& getPeriglomerularUnit(std::size_t index) const;
+
+        // Node handles for wiring sets together, see K4. Named apart from the getters above so that calls on a
+        // non-const set still pick those.
+        // throws if index >= size()
+        K1& getMutablePeriglomerularUnit(std::size_t index);
+        K2Layer& getMutableOlfactoryBulb() noexcept;
+        K2& getMutableAnteriorOlfactoryNucleus() noexcept;
+        std::shared_ptr<K0> getMutablePrepiriformCortexPrimary() noexcept;
+        std::shared_ptr<K0> getMutableDeepPyramidCells() noexcept;
     };
 }
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <optional>
+#include <map>
+#include <tuple>
+
+#include "ksets/k3.hpp"
+
+namespace ksets {
+    /*
+       A K4 couples several K3 sets through long-delay inter-set connections and runs each
+       set on its own thread.
+
+       Inter-set connections never read another set's history directly, since that set may be
+       stepping concurrently. Instead, each (source node, target set, delay) triple gets a mirror
+       node owned by the target set's thread, whose output is relayed from a buffer filled while
+       all threads are stopped. A connection with delay d only needs the source's output from d
+       iterations ago, so every set can advance up to min(d)+1 iterations between synchronizations.
+    */
+    class K4 {
+        struct Link {
+            std::size_t sourceSet;
+            std::size_t targetSet;
+            std::shared_ptr<K0> source;
+            std::shared_ptr<K0> mirror;
+            std::size_t delay;
+            std::vector<numeric> buffer;
+        };
+
+        std::vector<std::unique_ptr<K3>> sets;
+        std::vector<Link> links;
+        std::map<std::tuple<const K0 *, std::size_t, std::size_t>, std::size_t> linkIndices;
+
+        void exchange(std::size_t epochLength) noexcept;
+    public:
+        K4() = default;
+        K4(const K4& other) = delete;
+
+        // returns the index of the new set
+        std::size_t addSet(std::unique_ptr<K3> set);
+
+        std::size_t size() const noexcept;
+
+        // throws if index >= size()
+        K3& set(std::size_t index);
+        const K3& set(std::size_t index) const;
+
+        // Connects a node of one set to a node of another. The nodes must belong to the given sets.
+        // Throws if either index is out of range, if both sets are the same (wire those inside the K3),
+        // or if the source's history is too short to hold delay iterations.
+        void connect(
+            std::size_t sourceSet,
+            std::shared_ptr<K0> source,
+            std::size_t targetSet,
+            std::shared_ptr<K0> target,
+            numeric weight,
+            std::size_t delay,
+            std::optional<conntag> tag=std::nullopt
+        );
+
+        // Number of iterations every set advances between synchronizations: the minimum inter-set
+        // delay plus one. Returns 0 if there are no inter-set connections, in which case sets never synchronize.
+        std::size_t getSynchronizationInterval() const noexcept;
+
+        // Sets should only be advanced through these once connected, otherwise mirrors fall out of step.
+        // Each set keeps its current external stimulus (see K3::setPattern and K3::eraseExternalStimulus).
+        void run(numeric milliseconds);
+        void rest(numeric milliseconds);
+    };
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+
+#include "ksets/config.hpp"
+#include "ksets/k2layer.hpp"
+
+namespace ksets {
+    struct HebbianConfig {
+        /// Rate at which the weight between two simultaneously active units is reinforced.
+        numeric learningRate = 0.01;
+
+        /// Rate at which every weight decays back towards the value it had when learning was enabled.
+        numeric habituationRate = 0.001;
+
+        /// A unit only counts as active once its activity exceeds the layer's mean activity by this
+        /// fraction of it (the K constant in Kozma & Freeman's KIII learning rule).
+        numeric activityThreshold = 0.05;
+
+        /// Number of iterations the activity statistics (exponential moving mean and variance of each unit's
+        /// output) are averaged over.
+        std::size_t activityWindow = odeMillisecondsToIters(50);
+
+        /// Number of iterations between weight updates while running. Pass 0 to only update them when
+        /// explicitly asked to, e.g. once per presentation.
+        std::size_t updateInterval = 1;
+    };
+
+    /*
+       Hebbian reinforcement and habituation of the tagged lateral connections between the primary nodes
+       of a K2Layer.
+
+       The weights are gathered once into a contiguous n*n block (row = target unit, column = source unit),
+       along with where each one lives in its node's connections. Updates are branchless passes over the
+       block which the compiler can vectorize, followed by a scatter back into the connections, so there is
+       no tag scan per update. As in K0Connection::perturbWeight, updates that would flip a weight's sign
+       are rejected.
+    */
+    class LateralHebbianLearning {
+        struct Binding {
+            std::size_t blockIndex;
+            K0 *target;
+            std::size_t connectionIndex;
+        };
+
+        HebbianConfig config;
+        K2Layer& layer;
+        conntag tag;
+        std::size_t numUnits;
+        std::size_t numObservations = 0;
+
+        std::vector<numeric> weights;
+        std::vector<numeric> baselineWeights;
+        // 1 where the block holds an actual connection
+        std::vector<numeric> connectedMask;
+        std::vector<Binding> bindings;
+
+        std::vector<numeric> output;
+        std::vector<numeric> activityMean;
+        std::vector<numeric> activityVariance;
+        std::vector<numeric> excessActivity;
+
+        void scatter() noexcept;
+    public:
+        // binds to every primary lateral connection with the given tag.
+        // throws if two units are joined by more than one such connection
+        LateralHebbianLearning(K2Layer& layer, conntag tag, HebbianConfig config);
+
+        // binds to layer, which must have the same shape as other's, and takes over other's weights and statistics
+        LateralHebbianLearning(K2Layer& layer, const LateralHebbianLearning& other);
+
+        // folds the layer's current outputs into the activity statistics, and updates the weights every
+        // updateInterval calls. Meant to be called after every commit.
+        void observe() noexcept;
+
+        // applies one weight update from the current activity statistics
+        void update() noexcept;
+
+        // restores the weights the connections had when learning was enabled
+        void resetWeights() noexcept;
+
+        std::size_t size() const noexcept;
+        const HebbianConfig& getConfig() const noexcept { return config; }
+
+        // weight from source unit to target unit, 0 if they are not connected
+        numeric weight(std::size_t target, std::size_t source) const;
+    };
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <random>
+#include <limits>
+#include <memory>
+
+#include "ksets/k3.hpp"
+
+namespace ksets {
+    /// A K3Config field being optimized, searched within [lowerBound, upperBound].
+    struct SearchParameter {
+        std::string name;
+        std::function<numeric&(K3Config&)> field;
+        numeric lowerBound;
+        numeric upperBound;
+    };
+
+    /// The ten weights exposed by testparam, with the ranges gridsearch.py searched over.
+    std::vector<SearchParameter> defaultSearchParameters();
+
+    enum class OptimizerAlgorithm {
+        /// Elitist genetic algorithm with tournament selection, blend crossover and gaussian mutation.
+        GENETIC,
+        /// Separable CMA-ES, which only adapts the diagonal of the covariance matrix. With few parameters
+        /// this loses little against full CMA-ES and needs no eigendecomposition.
+        CMA_ES
+    };
+
+    struct OptimizerConfig {
+        OptimizerAlgorithm algorithm = OptimizerAlgorithm::GENETIC;
+
+        /// Number of individuals evaluated per generation.
+        std::size_t populationSize = 32;
+
+        /// Number of generations run by PopulationOptimizer::run, including any loaded from a checkpoint.
+        std::size_t numGenerations = 50;
+
+        /// Number of threads evaluating a generation. Pass 0 to use one per hardware thread.
+        std::size_t numThreads = 0;
+
+        /// Seed for the optimizer itself and for the seeds passed to the fitness function.
+        rngseed seed = 0;
+
+        /// Number of best individuals carried over unchanged to the next generation. Genetic only.
+        std::size_t eliteCount = 2;
+
+        /// Number of individuals competing for each parent slot. Genetic only.
+        std::size_t tournamentSize = 3;
+
+        /// Probability of a child being a blend of two parents instead of a copy of one. Genetic only.
+        numeric crossoverRate = 0.9;
+
+        /// Probability of each gene being mutated. Genetic only.
+        numeric mutationRate = 0.2;
+
+        /// Standard deviation of mutations, as a fraction of each parameter's range. Genetic only.
+        numeric mutationScale = 0.1;
+
+        /// Initial step size, as a fraction of each parameter's range. CMA-ES only.
+        numeric initialStepSize = 0.3;
+
+        /// File the population is saved to after every checkpointInterval generations. Empty to disable.
+        std::string checkpointPath;
+
+        /// See checkpointPath.
+        std::size_t checkpointInterval = 1;
+    };
+
+    struct Individual {
+        /// Parameter values normalized to [0, 1] within their bounds.
+        std::vector<numeric> genes;
+        numeric fitness = -std::numeric_limits<numeric>::infinity();
+    };
+
+    /*
+       Population based search over K3Config fields, evaluating each generation in parallel.
+       Higher fitness is better. Bounds are validated against K3Config::checkWeightsValidity, so
+       every candidate handed to the fitness function has weights of the right sign.
+    */
+    class PopulationOptimizer {
+    public:
+        // Called concurrently from several threads, so it must not share mutable state between calls.
+        // The seed is derived from OptimizerConfig::seed, the generation and the individual.
+        // Exceptions and NaN are scored as -infinity.
+        using Fitness = std::function<numeric(const K3Config& config, rngseed seed)>;
+
+    private:
+        K3Config baseConfig;
+        std::vector<SearchParameter> parameters;
+        OptimizerConfig config;
+        Fitness fitness;
+
+        std::mt19937_64 rng;
+        std::size_t generation = 0;
+        std::vector<Individual> population;
+        Individual best;
+
+        // separable CMA-ES state
+        numeric sigma = 0;
+        std::vector<numeric> mean;
+        std::vector<numeric> covarianceDiagonal;
+        std::vector<numeric> sigmaPath;
+        std::vector<numeric> covariancePath;
+
+        std::size_t numParameters() const noexcept { return parameters.size(); }
+
+        void evaluate(std::size_t first);
+        void initializeGenetic();
+        void initializeCmaEs();
+        void nextGenerationGenetic();
+        void sampleCmaEs();
+        void updateCmaEs();
+        const Individual& tournament();
+    public:
+        // throws if there are no parameters, if any bounds have mixed signs or would make baseConfig
+        // fail checkWeightsValidity, or if populationSize is too small for the chosen algorithm
+        PopulationOptimizer(K3Config baseConfig, std::vector<SearchParameter> parameters, OptimizerConfig config, Fitness fitness);
+
+        // evaluates the initial population on the first call, then one new generation on every following call
+        void step();
+
+        // steps until numGenerations generations have been evaluated, checkpointing along the way
+        void run();
+
+        // throws if the file cannot be written
+        void saveCheckpoint(const std::string& path) const;
+
+        // throws if the file cannot be read or was made with a different algorithm or parameter list
+        void loadCheckpoint(const std::string& path);
+
+        K3Config toConfig(const std::vector<numeric>& genes) const;
+
+        std::size_t getGeneration() const noexcept;
+        const std::vector<Individual>& getPopulation() const noexcept;
+        const Individual& getBest() const noexcept;
+        K3Config getBestConfig() const;
+    };
+
+    struct HalvingConfig {
+        /// Number of protocol stages (rungs) a candidate that is never eliminated goes through.
+        std::size_t numRungs = 5;
+
+        /// Only the best 1/reductionFactor of the candidates of each rung move on to the next one.
+        std::size_t reductionFactor = 3;
+
+        /// Number of candidates sampled by SuccessiveHalving::runSuccessiveHalving. Hyperband sizes its own brackets.
+        std::size_t numCandidates = 81;
+
+        /// Number of threads advancing candidates. Pass 0 to use one per hardware thread.
+        std::size_t numThreads = 0;
+
+        /// Seed for sampling candidates and for the seeds passed to the build function.
+        rngseed seed = 0;
+    };
+
+    struct HalvingTrial {
+        /// Parameter values normalized to [0, 1] within their bounds.
+        std::vector<numeric> genes;
+        /// Fitness after the last rung the candidate went through.
+        numeric fitness = -std::numeric_limits<numeric>::infinity();
+        std::size_t rungsCompleted = 0;
+    };
+
+    /*
+       Multi-fidelity search over K3Config fields. Candidates are evaluated on a short protocol first, and
+       only the best fraction of them continue, resumed from the exact state their model was left in rather
+       than restarted, until the survivors have run the whole protocol. Most of the budget thus goes to the
+       candidates that look promising, and many more candidates can be tried than with full evaluations.
+
+       The protocol is split into rungs by the caller: advance(model, rung) runs stage `rung` on a model that
+       already went through the previous ones, e.g. one 500 ms phase of testparam's rest/present protocol per
+       rung, and scores the model on everything it has seen so far. Higher is better.
+    */
+    class SuccessiveHalving {
+    public:
+        // Builds and warms up the model of a candidate. Called concurrently from several threads.
+        using Build = std::function<std::unique_ptr<K3>(const K3Config& config, rngseed seed)>;
+
+        // Called concurrently on different models. Exceptions, NaN and aborted runs should all be scored as
+        // -infinity, which eliminates the candidate on the spot.
+        using Advance = std::function<numeric(K3& model, std::size_t rung)>;
+
+    private:
+        K3Config baseConfig;
+        std::vector<SearchParameter> parameters;
+        HalvingConfig config;
+        Build build;
+        Advance advance;
+
+        std::mt19937_64 rng;
+        std::size_t numCandidatesSampled = 0;
+        std::size_t numRungsRun = 0;
+        std::vector<HalvingTrial> trials;
+
+        // runs one bracket of numCandidates new candidates, the first of which is eliminated after firstCut
+        void runBracket(std::size_t numCandidates, std::size_t firstCut);
+    public:
+        // throws if there are no parameters, if any bounds have mixed signs or would make baseConfig fail
+        // checkWeightsValidity, or if numRungs is 0 or reductionFactor is less than 2
+        SuccessiveHalving(K3Config baseConfig, std::vector<SearchParameter> parameters, HalvingConfig config, Build build, Advance advance);
+
+        // Samples numCandidates candidates and halves them after every rung until the last.
+        void runSuccessiveHalving();
+
+        // Runs one successive halving bracket per possible first cut, from aggressive (many candidates,
+        // eliminating after the first rung) to conservative (few candidates, all run the whole protocol),
+        // each sized to use about the same budget. This hedges against early rungs being poor predictors.
+        void runHyperband();
+
+        K3Config toConfig(const std::vector<numeric>& genes) const;
+
+        // every candidate evaluated so far, over all runs
+        const std::vector<HalvingTrial>& getTrials() const noexcept;
+        // the best candidate among those that completed the most rungs
+        // throws if nothing was evaluated yet
+        const HalvingTrial& getBest() const;
+        K3Config getBestConfig() const;
+        // number of advance calls made, the unit of budget
+        std::size_t getNumRungsRun() const noexcept;
+    };
+}
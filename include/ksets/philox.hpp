@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+#include "ksets/config.hpp"
+
+namespace ksets {
+    /*
+       Philox4x32-10 counter-based generator (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3", 2011).
+
+       Each output is a pure function of a key and a counter, so a random stream needs no state besides its
+       position: any value can be drawn in any order, from any thread, and always comes out the same.
+    */
+    using PhiloxCounter = std::array<uint32_t, 4>;
+    using PhiloxKey = std::array<uint32_t, 2>;
+
+    constexpr PhiloxCounter philox4x32(PhiloxCounter counter, PhiloxKey key) noexcept {
+        constexpr uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+        constexpr uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+        for (int round = 0; round < 10; round++) {
+            uint64_t p0 = static_cast<uint64_t>(M0) * counter[0];
+            uint64_t p1 = static_cast<uint64_t>(M1) * counter[2];
+            counter = {
+                static_cast<uint32_t>(p1 >> 32) ^ counter[1] ^ key[0],
+                static_cast<uint32_t>(p1),
+                static_cast<uint32_t>(p0 >> 32) ^ counter[3] ^ key[1],
+                static_cast<uint32_t>(p0)
+            };
+            key[0] += W0;
+            key[1] += W1;
+        }
+        return counter;
+    }
+
+    /*
+       Independent stream of standard normal values, selected by a seed and a stream id. The index-th value
+       is philox4x32({index, stream}, seed) turned into a gaussian by the Box-Muller transform.
+    */
+    class CounterGaussian {
+        PhiloxKey key;
+        uint64_t stream;
+    public:
+        constexpr CounterGaussian(rngseed seed, uint64_t stream) noexcept:
+            key {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)}, stream(stream) {}
+
+        numeric operator()(uint64_t index) const noexcept {
+            PhiloxCounter bits = philox4x32(
+                {
+                    static_cast<uint32_t>(index), static_cast<uint32_t>(index >> 32),
+                    static_cast<uint32_t>(stream), static_cast<uint32_t>(stream >> 32)
+                },
+                key
+            );
+            // 53 bit uniforms, u1 in (0, 1] so the log is finite
+            constexpr double TWO_POW_MINUS_53 = 1.0 / 9007199254740992.0;
+            // M_PI is POSIX, not standard C++
+            constexpr double PI = 3.14159265358979323846;
+            double u1 = (((static_cast<uint64_t>(bits[0]) << 32 | bits[1]) >> 11) + 1) * TWO_POW_MINUS_53;
+            double u2 = ((static_cast<uint64_t>(bits[2]) << 32 | bits[3]) >> 11) * TWO_POW_MINUS_53;
+            return static_cast<numeric>(std::sqrt(-2 * std::log(u1)) * std::cos(2 * PI * u2));
+        }
+    };
+
+    /// Gaussian noise source that can be saved and restored: its next value is value position of its stream.
+    struct NoiseStream {
+        rngseed seed = 0;
+        uint64_t stream = 0;
+        numeric stdDev = 0;
+        uint64_t position = 0;
+
+        numeric next() noexcept {
+            return stdDev * CounterGaussian(seed, stream)(position++);
+        }
+    };
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "ksets/k3.hpp"
+
+namespace ksets {
+    struct RealtimeConfig {
+        /// Whether step sleeps until each step's release time, one period after the last, on a monotonic clock.
+        bool pace = false;
+
+        /// Wall time between releases when pacing. The default keeps simulated time in step with wall time.
+        std::chrono::nanoseconds period = std::chrono::microseconds(500);
+
+        /// Longest acceptable latency, measured from a step's release (its call, when not pacing) to its end.
+        std::chrono::nanoseconds deadline = std::chrono::microseconds(500);
+
+        /// When a paced step overruns, whether later steps keep their original schedule and run back to back
+        /// until they catch up, as needed to keep up with a sensor's sample clock, or the schedule restarts
+        /// from the late step's end.
+        bool catchUp = true;
+
+        /// Latency histogram buckets, the last of which also counts every longer latency.
+        std::chrono::nanoseconds histogramBucketWidth = std::chrono::microseconds(1);
+        std::size_t numHistogramBuckets = 1'000;
+    };
+
+    struct RealtimeStats {
+        uint64_t numSteps = 0;
+        uint64_t numDeadlineMisses = 0;
+        /// Times the schedule restarted after an overrun, see RealtimeConfig::catchUp.
+        uint64_t numResynchronizations = 0;
+        std::chrono::nanoseconds maxLatency {0};
+
+        /// Number of steps by latency: bucket i counts latencies in [i, i + 1) * histogramBucketWidth.
+        std::vector<uint64_t> latencyHistogram;
+        std::chrono::nanoseconds histogramBucketWidth {0};
+
+        // upper bound of the bucket holding the given fraction of steps, e.g. 0.99 for the 99th percentile
+        // throws if no step was recorded or fraction is not in [0, 1]
+        std::chrono::nanoseconds latencyPercentile(double fraction) const;
+    };
+
+    /*
+       Steps a K3 one iteration at a time against a deadline, for sets fed from live sensors. Everything is
+       allocated up front: step allocates nothing, throws nothing and takes no locks, provided that
+
+       - no trace is started with TraceOverflow::BLOCK, which would wait on the disk;
+       - the set's nodes are not copied from, which would share their weights again (see K0::copyStateFrom);
+       - nothing else runs the set meanwhile.
+
+       Like K3::step, stepping makes no degeneracy or budget checks, whose cost would show up as latency spikes.
+       Statistics are kept by the stepping thread and must be read from it.
+    */
+    class RealtimeStepper {
+        using Clock = std::chrono::steady_clock;
+
+        K3& model;
+        RealtimeConfig config;
+
+        bool started = false;
+        Clock::time_point nextRelease;
+
+        uint64_t numSteps = 0;
+        uint64_t numDeadlineMisses = 0;
+        uint64_t numResynchronizations = 0;
+        Clock::duration maxLatency {0};
+        std::vector<uint64_t> latencyHistogram;
+    public:
+        // Unshares the set's weights, so that learning can write them without allocating.
+        // throws if the config is invalid or a trace with TraceOverflow::BLOCK is running
+        RealtimeStepper(K3& model, RealtimeConfig config=RealtimeConfig());
+
+        // Runs one iteration with stimulus[i] as the external stimulus of input unit i, for every one of the
+        // set's size() units, or with no stimulus if it is null. The first paced step is released right away.
+        // Returns whether the step met its deadline.
+        bool step(const numeric *stimulus) noexcept;
+
+        // allocates, so must not be called where latency matters
+        RealtimeStats getStats() const;
+        void resetStats() noexcept;
+    };
+}
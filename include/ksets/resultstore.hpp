@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ksets/k3.hpp"
+
+namespace ksets {
+    // version of the library the simulation results came from, as set in CMakeLists.txt
+    const char *libraryVersion() noexcept;
+
+    /// Everything that determines the outcome of an evaluation.
+    struct EvaluationKey {
+        K3Config config;
+        std::size_t numUnits = 0;
+        /// Caller chosen name of what was run on the model and how it was scored, e.g. "testparam-v1".
+        /// Must change whenever either does.
+        std::string protocol;
+        rngseed seed = 0;
+
+        // Field by field serialization of the key and libraryVersion(), so equal keys give equal bytes
+        // regardless of padding, and results from another version of the library never match.
+        std::string canonicalBytes() const;
+
+        // FNV-1a hash of canonicalBytes
+        uint64_t hash() const;
+    };
+
+    struct StoredResult {
+        RunStatus runStatus = RunStatus::OK;
+        std::vector<numeric> values;
+    };
+
+    /*
+       On disk store of evaluation results, so sweeps can skip points evaluated by earlier or concurrent runs
+       and resume after a crash. The file is an append-only journal, in native byte order:
+           char     magic[8]           "KSETSRJ" followed by a null byte
+           uint32_t version            RESULT_STORE_VERSION
+           uint32_t reserved
+       then one record per result:
+           uint32_t keySize
+           uint32_t numValues
+           int32_t  runStatus
+           uint32_t reserved
+           uint64_t checksum           FNV-1a hash of the other record fields, key and values
+           char     key[keySize]       EvaluationKey::canonicalBytes
+           float    values[numValues]
+           padding to a multiple of 8 bytes
+
+       Any number of processes may share a file: appends take an exclusive flock, reads a shared one. A record
+       torn by a crash fails its checksum and is cut off by the next append.
+    */
+    constexpr uint32_t RESULT_STORE_VERSION = 1;
+
+    class ResultStore {
+        std::string path;
+        int fd = -1;
+        std::mutex mutex;
+
+        std::vector<std::pair<std::string, StoredResult>> entries;
+        std::unordered_multimap<uint64_t, std::size_t> index;
+        // end of the last valid record read
+        uint64_t validLength = 0;
+
+        const StoredResult *lookup(const std::string& key, uint64_t hash) const;
+        // reads records appended since the last refresh; returns false if the file ends in a torn record
+        bool readNewRecords();
+    public:
+        // opens or creates the store
+        // throws if the file cannot be opened or is not a result store of this version
+        explicit ResultStore(const std::string& path);
+        ResultStore(const ResultStore& other) = delete;
+        ResultStore& operator=(const ResultStore& other) = delete;
+        ~ResultStore();
+
+        // looks in memory first, then for results appended by other processes since
+        std::optional<StoredResult> find(const EvaluationKey& key);
+
+        // Appends the result, unless some process already stored one for the same key. Returns whether it was
+        // appended. The record is synced to disk before returning.
+        // throws if the file cannot be written
+        bool insert(const EvaluationKey& key, const StoredResult& result);
+
+        // Returns the stored result for key, or evaluates and stores it. Concurrent callers may both evaluate
+        // the same key, in which case the first result stored wins and is returned to both.
+        StoredResult findOrEvaluate(const EvaluationKey& key, const std::function<StoredResult()>& evaluate);
+
+        // picks up results appended by other processes
+        void refresh();
+
+        // number of results read so far
+        std::size_t size();
+    };
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "ksets/k3.hpp"
+#include "ksets/tangent.hpp"
+
+namespace ksets {
+    /*
+       Runs a K3 while tracking the derivatives of some nodes' outputs with respect to K3Config weights, in forward
+       mode (see K3Tangent), so the gradient of an output statistic costs one simulation instead of one per weight.
+
+           K3Sensitivity sensitivity(model, {[](K3Config& c) -> numeric& { return c.wOB_PC_lot; }});
+           sensitivity.rest(1000);
+           numeric slope = sensitivity.getStdDevSensitivity(0, 0);
+
+       Derivatives are of the trajectory from the set's state when the sensitivity was created, taken as fixed.
+       A weight's effect through the set's earlier history, such as its initial rest, is not included. In a chaotic
+       regime derivatives grow with the length of the run, so statistics over long runs have large, noisy gradients.
+
+       The set must outlive the sensitivity, must not be run by anything else meanwhile, and must not have lateral
+       learning enabled, since the weights are taken as fixed.
+    */
+    class K3Sensitivity {
+    public:
+        using Field = std::function<numeric&(K3Config&)>;
+    private:
+        K3& model;
+        std::size_t numFields;
+        std::vector<std::shared_ptr<const K0>> nodes;
+        // row of each selected node in the tangent
+        std::vector<std::size_t> tangentNodes;
+        K3Tangent tangent;
+
+        // sums over every sample since the last resetStatistics, as [node] and [node][field]
+        std::size_t numSamples = 0;
+        std::vector<double> outputSums, squaredOutputSums;
+        std::vector<double> tangentSums, crossSums;
+
+        void deriveWeights(const std::vector<Field>& fields);
+        RunStatus run(numeric milliseconds);
+    public:
+        // An empty selection tracks the primary node of every olfactory bulb unit.
+        // throws if a node is not part of model, if a field sets no connection weight of model, or if lateral
+        // learning is enabled
+        K3Sensitivity(K3& model, const std::vector<Field>& fields, std::vector<std::shared_ptr<const K0>> nodes={});
+
+        RunStatus rest(numeric milliseconds);
+
+        template<typename Iterator>
+        RunStatus present(numeric milliseconds, Iterator patternFirst, Iterator patternLast) {
+            model.setPattern(patternFirst, patternLast);
+            return run(milliseconds);
+        }
+
+        // Output of a selected node after the last iteration, and its derivative with respect to a field.
+        numeric getOutput(std::size_t node) const;
+        numeric getOutputSensitivity(std::size_t node, std::size_t field) const;
+
+        // Mean and standard deviation of a selected node's output over every iteration since the sensitivity was
+        // created or its statistics reset, and their derivatives with respect to a field.
+        // throw if no iteration was run
+        numeric getMean(std::size_t node) const;
+        numeric getMeanSensitivity(std::size_t node, std::size_t field) const;
+        numeric getStdDev(std::size_t node) const;
+        numeric getStdDevSensitivity(std::size_t node, std::size_t field) const;
+
+        // starts the statistics over, keeping the derivatives of the state
+        void resetStatistics() noexcept;
+
+        std::size_t getNumSamples() const noexcept { return numSamples; }
+        std::size_t getNumNodes() const noexcept { return nodes.size(); }
+        std::size_t getNumFields() const noexcept { return numFields; }
+    };
+}
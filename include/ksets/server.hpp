@@ -0,0 +1,167 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ksets/k3.hpp"
+
+namespace ksets {
+    /*
+       Request/response protocol of EvaluationServer, in native byte order. A connection may carry any
+       number of requests, each answered before the next is read.
+
+       Request:
+           char     magic[8]                 "KSETSRQ" followed by a null byte
+           uint32_t version                  SERVER_PROTOCOL_VERSION
+           uint32_t kind                     EvaluationKind
+           uint32_t numUnits
+           uint32_t numPhases
+           uint64_t seed
+           float    initialRestMilliseconds
+           uint32_t configSize               0 for the server's base config, otherwise sizeof(K3Config)
+           K3Config config                   raw bytes, only if configSize is not 0
+           numPhases times:
+               float    milliseconds
+               uint32_t hasPattern           0 to rest, 1 to present the pattern that follows
+               float    pattern[numUnits]    only if hasPattern is 1
+
+       Response:
+           char     magic[8]                 "KSETSRS" followed by a null byte
+           uint32_t version                  SERVER_PROTOCOL_VERSION
+           uint32_t status                   EvaluationStatus
+           uint32_t runStatus                RunStatus the evaluation ended with
+           uint32_t numRows
+           uint32_t numColumns
+           uint32_t messageLength
+           char     message[messageLength]   why the request was rejected, not null terminated
+           float    values[numRows][numColumns]
+    */
+    constexpr uint32_t SERVER_PROTOCOL_VERSION = 1;
+
+    enum class EvaluationKind : uint32_t {
+        /// Primary output of every olfactory bulb unit after each iteration: one row per iteration,
+        /// one column per unit.
+        TRACE = 1,
+        /// Standard deviation of every olfactory bulb unit's primary output over each phase: one row per
+        /// phase, one column per unit.
+        PHASE_STDDEV = 2
+    };
+
+    enum class EvaluationStatus : uint32_t {
+        OK = 0,
+        /// The run was aborted, see the response's runStatus. Values hold whatever was computed, NaN elsewhere.
+        ABORTED = 1,
+        /// The request was malformed or exceeded the server's limits. The connection is closed after the
+        /// response, since the rest of the stream cannot be trusted.
+        REJECTED = 2
+    };
+
+    struct ServerConfig {
+        /// Number of connections served concurrently. Pass 0 to use one per hardware thread.
+        std::size_t numWorkers = 0;
+
+        /// Config used by requests that do not send their own.
+        K3Config baseConfig = K3Config();
+
+        /// Unit counts warmed up with baseConfig, seed and initialRestMilliseconds before accepting connections.
+        std::vector<std::size_t> prewarmUnitCounts;
+        rngseed prewarmSeed = 0;
+        numeric prewarmInitialRestMilliseconds = 500;
+
+        /// Number of warmed up models kept, least recently used first out.
+        std::size_t maxCachedModels = 32;
+
+        /// Largest number of units and total iterations a single request may ask for.
+        std::size_t maxUnits = 1024;
+        std::size_t maxIterations = odeMillisecondsToIters(600'000);
+
+        /// Largest history size a request's config may ask for, which also bounds its monitoring and degeneracy
+        /// check windows. Every cached model holds about 4 * numUnits histories of this size.
+        std::size_t maxHistorySize = odeMillisecondsToIters(10'000);
+
+        /// Largest number of values a single response may hold: units times iterations for TRACE, units times
+        /// phases for PHASE_STDDEV. Requests are rejected as soon as they exceed it, before the rest of them is
+        /// read or any of the response is allocated.
+        std::size_t maxResponseValues = std::size_t(64) << 20;
+
+        /// Connections that send nothing for this long are closed, so idle clients do not hold a worker.
+        /// Pass 0 to wait forever.
+        std::size_t idleTimeoutMilliseconds = 60'000;
+    };
+
+    /*
+       Long running evaluation service over a Unix domain socket, so tools that evaluate K3 configurations
+       pay neither process startup nor warm up per query.
+
+       Every distinct (numUnits, seed, initial rest, config) is built and warmed up once and kept in a
+       cache. Each request then runs on a worker's own copy of the warmed model, refreshed with
+       K3::copyStateFrom, so results are identical to building the model from scratch and do not depend on
+       which worker serves them or what it served before. The wall clock budget (see
+       K3Config::maxRunWallMilliseconds) restarts with each request, while the initial rest still counts towards
+       the iteration budget.
+    */
+    class EvaluationServer {
+        struct ModelKey {
+            std::size_t numUnits = 0;
+            rngseed seed = 0;
+            numeric initialRestMilliseconds = 0;
+            K3Config config;
+            // EvaluationKey::canonicalBytes of config, since K3Config has padding
+            std::string configBytes;
+
+            ModelKey() = default;
+            ModelKey(std::size_t numUnits, rngseed seed, numeric initialRestMilliseconds, const K3Config& config);
+            bool operator==(const ModelKey& other) const noexcept;
+        };
+        struct CachedModel {
+            ModelKey key;
+            std::shared_ptr<const K3> model;
+        };
+
+        ServerConfig config;
+        std::string socketPath;
+        int listener = -1;
+
+        std::mutex cacheMutex;
+        // most recently used first
+        std::list<CachedModel> cache;
+
+        std::mutex queueMutex;
+        std::condition_variable queueChanged;
+        std::deque<int> pendingConnections;
+        std::set<int> openConnections;
+        std::atomic<bool> stopping {false};
+        std::vector<std::thread> workers;
+
+        std::shared_ptr<const K3> warmedModel(const ModelKey& key);
+        void workerMain() noexcept;
+        void serveConnection(int connection, std::unique_ptr<K3>& scratch, ModelKey& scratchKey);
+    public:
+        // warms up the prewarm models, then binds and listens on socketPath, replacing any stale socket file
+        // throws if the socket cannot be created
+        EvaluationServer(const std::string& socketPath, ServerConfig config=ServerConfig());
+        EvaluationServer(const EvaluationServer& other) = delete;
+        EvaluationServer& operator=(const EvaluationServer& other) = delete;
+        // stops the server and removes the socket file
+        ~EvaluationServer();
+
+        // accepts and serves connections until stop is called
+        // throws if the worker threads cannot be started
+        void serve();
+
+        // Makes serve return once the requests being evaluated are answered. Only sets a flag and shuts the
+        // listening socket down, so it may be called from any thread or from a signal handler.
+        void stop() noexcept;
+
+        std::size_t getNumCachedModels();
+    };
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include "ksets/k3.hpp"
+
+namespace ksets {
+    /*
+       Advances a K3 one iteration at a time as it is read from, exposing the outputs of a chosen set of
+       nodes after every iteration. Stepping goes through the same path as K3::rest and K3::present, with the
+       same degeneracy and budget checks, so a stream read to the end leaves the set exactly as a plain run
+       of the same length would. Nothing is buffered beyond the current sample.
+
+           K3Stream stream(model, 200, pattern.begin(), pattern.end());
+           for (const auto& sample : stream)
+               classifier.observe(sample);
+           if (stream.getRunStatus() != RunStatus::OK) ...
+
+       The set must outlive the stream, and must not be run by anything else while the stream is read.
+    */
+    class K3Stream {
+        K3& model;
+        std::vector<std::shared_ptr<const K0>> nodes;
+        std::size_t numIterations;
+        std::size_t numStepsTaken = 0;
+        std::vector<numeric> sample;
+        bool started = false;
+        bool aborted = false;
+
+        void selectNodes(std::vector<std::shared_ptr<const K0>> selected);
+    public:
+        class Iterator {
+            K3Stream *stream;
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = std::vector<numeric>;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const std::vector<numeric> *;
+            using reference = const std::vector<numeric>&;
+
+            explicit Iterator(K3Stream *stream) noexcept: stream(stream) {}
+
+            reference operator*() const noexcept { return stream->current(); }
+            pointer operator->() const noexcept { return &stream->current(); }
+            Iterator& operator++() {
+                if (!stream->next())
+                    stream = nullptr;
+                return *this;
+            }
+            bool operator==(const Iterator& other) const noexcept { return stream == other.stream; }
+            bool operator!=(const Iterator& other) const noexcept { return stream != other.stream; }
+        };
+
+        // Streams milliseconds of rest, with no external stimulus. An empty selection streams the primary
+        // node of every olfactory bulb unit.
+        // throws if a node is not part of model
+        K3Stream(K3& model, numeric milliseconds, std::vector<std::shared_ptr<const K0>> nodes={});
+
+        // Streams a presentation of the pattern, which is applied right away.
+        // throws if the pattern length does not match model.size(), or a node is not part of model
+        template<typename PatternIterator>
+        K3Stream(
+            K3& model,
+            numeric milliseconds,
+            PatternIterator patternFirst,
+            PatternIterator patternLast,
+            std::vector<std::shared_ptr<const K0>> nodes={}
+        ):
+            model(model),
+            numIterations(odeMillisecondsToIters(milliseconds))
+        {
+            selectNodes(std::move(nodes));
+            model.setPattern(patternFirst, patternLast);
+        }
+
+        K3Stream(const K3Stream& other) = delete;
+        K3Stream& operator=(const K3Stream& other) = delete;
+
+        // Advances the set by one iteration and reads the selected outputs. Returns false, leaving the last
+        // sample in place, once the whole duration was streamed or the run was aborted.
+        bool next();
+
+        // outputs of the selected nodes after the latest iteration, in selection order
+        const std::vector<numeric>& current() const noexcept;
+
+        // Takes the first step, so begin() must only be called once.
+        Iterator begin();
+        Iterator end() noexcept;
+
+        std::size_t getNumStepsTaken() const noexcept;
+        std::size_t getNumIterations() const noexcept;
+        RunStatus getRunStatus() const noexcept;
+    };
+}
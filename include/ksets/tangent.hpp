@@ -0,0 +1,73 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "ksets/k3.hpp"
+
+namespace ksets {
+    /*
+       Tangent-linear companion of a K3: carries a batch of tangent vectors of the set's state through the same
+       iterations as the set. A node's tangent state is its (x, dx/dt) and the outputs in its delay line; input
+       noise is additive, so it drops out, and connections from other sets are treated as inputs.
+
+       Vectors are stored interleaved, as the columns of a row-major matrix whose rows are the x and dx/dt of
+       each node in turn, then every delay line slot of every node, so the inner loops run across the batch.
+
+       Each vector may also be driven by the derivatives of some connection weights with respect to a parameter,
+       which makes it the forward mode derivative of the state with respect to that parameter (see K3Sensitivity).
+       Weights are read once, so they must not change while the tangent is in use.
+    */
+    class K3Tangent {
+        K3& model;
+        std::vector<K0 *> nodes;
+        std::size_t numVectors;
+        std::size_t numSlots;
+        std::size_t newestSlot = 0;
+
+        // inbound connections within the set, grouped by target
+        std::vector<std::size_t> firstConnection;
+        std::vector<std::size_t> connectionSources;
+        std::vector<std::size_t> connectionDelays;
+        std::vector<numeric> connectionWeights;
+        // position in the arrays above of every node's inbound connections, or -1 for connections from other sets
+        std::vector<std::vector<std::size_t>> connectionPositions;
+
+        struct WeightDerivative {
+            std::size_t target;
+            std::size_t connection;
+            std::size_t vector;
+            numeric derivative;
+        };
+        std::vector<WeightDerivative> weightDerivatives;
+
+        std::vector<numeric> tangents;
+        std::vector<numeric> netInputs;
+
+        numeric *outputSlot(std::size_t slot, std::size_t node) noexcept;
+    public:
+        // all vectors start at zero
+        // throws if numVectors is 0
+        K3Tangent(K3& model, std::size_t numVectors);
+
+        // nodes in the order of the tangent's rows
+        const std::vector<K0 *>& getNodes() const noexcept { return nodes; }
+        std::size_t getNumVectors() const noexcept { return numVectors; }
+        std::size_t getNumRows() const noexcept { return tangents.size() / numVectors; }
+
+        // the tangent vectors, as the columns of a getNumRows() x getNumVectors() row-major matrix
+        numeric *data() noexcept { return tangents.data(); }
+
+        // tangent of a node's last output in every vector
+        const numeric *outputTangents(std::size_t node) const noexcept;
+
+        // Drives vector with the derivative of the weight of an inbound connection of nodes[node], given as its
+        // index among the node's inbound connections.
+        // throws if any index is out of range, or the connection comes from another set
+        void addWeightDerivative(std::size_t vector, std::size_t node, std::size_t connection, numeric derivative);
+
+        // Runs the set for one iteration, with its usual checks, and advances the vectors with it. Returns false,
+        // leaving the vectors in an unspecified state, if the set had already been aborted and did not step.
+        bool step();
+    };
+}
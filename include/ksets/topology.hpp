@@ -0,0 +1,145 @@
+#pragma once
+
+#include <istream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ksets/k0.hpp"
+
+namespace ksets {
+    /// Kind of the units a population is made of, wired internally like ksets::K1 and ksets::K2.
+    enum class UnitType {
+        K0,
+        K1,
+        K2
+    };
+
+    enum class ConnectionPattern {
+        /// Unit i of the source drives unit i of the target. Both populations must have the same size.
+        ONE_TO_ONE,
+        /// Every source unit drives every target unit.
+        ALL_TO_ALL,
+        /// Every source unit drives every target unit but its own, for lateral connections within a population.
+        ALL_TO_OTHERS
+    };
+
+    struct PopulationDescription {
+        std::string name;
+        UnitType unitType = UnitType::K0;
+        std::size_t numUnits = 1;
+        /// Intra unit weights: wPrimarySecondary and wSecondaryPrimary for K1, wee, wei, wie and wii for K2.
+        std::vector<numeric> unitWeights;
+        K0Config k0config;
+        /// Standard deviation of the input noise of each unit's primary node, 0 for none.
+        numeric noise = 0;
+    };
+
+    struct ConnectionDescription {
+        std::size_t sourcePopulation, targetPopulation;
+        /// Node within each unit, 0 being the primary node.
+        std::size_t sourceNode = 0, targetNode = 0;
+        ConnectionPattern pattern = ConnectionPattern::ONE_TO_ONE;
+        numeric weight = 0;
+        /// In iterations.
+        std::size_t delay = 0;
+        std::optional<conntag> tag;
+    };
+
+    /*
+       A network's shape as data, so new wirings can be tried without recompiling. The text format has one
+       declaration per line, with # starting a comment:
+
+           population <name> <K0|K1|K2> <units> [weights=<w>,...] [history=<iterations>] [q=<sigmoid q>] [noise=<stddev>]
+           connect <population>.<node> -> <population>.<node> <one-to-one|all-to-all|all-to-others> weight=<w> [delay=<iterations>] [tag=<n>]
+
+       K1 and K2 populations need their intra unit weights, in the order of PopulationDescription::unitWeights.
+       A node is primary, secondary, antipodal (K2 only) or its index within the unit. For example, a periglomerular
+       layer driving a laterally connected olfactory bulb:
+
+           population PG K1 8 weights=1.5,1.5 q=1.824 noise=0.025
+           population OB K2 8 weights=1.5,1.5,-2,-2 noise=0.025
+           connect PG.primary -> OB.primary one-to-one weight=1 delay=1
+           connect OB.primary -> OB.primary all-to-others weight=0.0214 tag=1
+    */
+    struct TopologyDescription {
+        std::vector<PopulationDescription> populations;
+        std::vector<ConnectionDescription> connections;
+
+        // throws if no population has that name
+        std::size_t populationIndex(const std::string& name) const;
+
+        // these throw if the text is malformed, naming the offending line
+        static TopologyDescription parse(std::istream& in);
+        static TopologyDescription load(const std::string& path);
+    };
+
+    /*
+       A network built from a TopologyDescription. Every node lives in a single array, laid out population by
+       population and unit by unit. Connections are gathered into one edge array grouped by target before any node
+       is wired, so each node's connections are allocated once, sorted by source, rather than grown one by one.
+
+       Nodes are updated like in K3: every node calculates its next state from the current outputs, then every
+       node commits it, so the result does not depend on the layout.
+    */
+    class Network {
+        struct Population {
+            std::string name;
+            UnitType unitType;
+            std::size_t firstNode;
+            std::size_t numUnits;
+            std::size_t unitSize;
+        };
+
+        // Every node, wired by plain pointers into this storage. Null once moved from.
+        std::unique_ptr<std::vector<K0>> nodes;
+        std::vector<Population> populations;
+        // nodes with input noise, by index
+        std::vector<std::size_t> noisyNodes;
+        std::size_t iterationsRun = 0;
+
+        const Population& population(std::size_t index) const;
+    public:
+        // Noise streams are numbered by node index, so the same topology and seed give the same run.
+        // throws if a connection refers to a node its units do not have, joins populations of different sizes
+        // unit by unit or has a delay longer than its source's history, or if unit weights are missing or invalid
+        explicit Network(const TopologyDescription& topology, rngseed seed=0);
+        Network(const Network& other) = delete;
+        Network(Network&& other) noexcept = default;
+        Network& operator=(const Network& other) = delete;
+        Network& operator=(Network&& other) noexcept = default;
+
+        std::size_t numNodes() const noexcept { return nodes->size(); }
+        std::size_t numPopulations() const noexcept { return populations.size(); }
+
+        // throws if no population has that name
+        std::size_t populationIndex(const std::string& name) const;
+        const std::string& populationName(std::size_t population) const;
+        std::size_t populationSize(std::size_t population) const;
+
+        // these throw if any index is out of range
+        K0& node(std::size_t population, std::size_t unit, std::size_t unitNode=0);
+        const K0& node(std::size_t population, std::size_t unit, std::size_t unitNode=0) const;
+
+        // sets the external stimulus of each unit's primary node in a population, in order
+        template<typename Iterator>
+        void setExternalStimulus(std::size_t population, Iterator stimulusFirst, Iterator stimulusLast) {
+            const Population& stimulated = this->population(population);
+            if (static_cast<std::size_t>(stimulusLast - stimulusFirst) != stimulated.numUnits)
+                throw std::invalid_argument("Stimulus length does not match population size");
+            std::size_t nodeIndex = stimulated.firstNode;
+            for (auto stimulus = stimulusFirst; stimulus != stimulusLast; stimulus++) {
+                (*nodes)[nodeIndex].setExternalStimulus(*stimulus);
+                nodeIndex += stimulated.unitSize;
+            }
+        }
+        void eraseExternalStimulus() noexcept;
+
+        void step() noexcept;
+        void run(numeric milliseconds) noexcept;
+
+        std::size_t getIterationsRun() const noexcept { return iterationsRun; }
+    };
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ksets/config.hpp"
+
+namespace ksets {
+    /*
+       Trace files, in native byte order. Every chunk holds consecutive iterations:
+           char     magic[8]         "KSETSTC" followed by a null byte
+           uint32_t version          TRACE_VERSION
+           uint32_t numChannels
+           uint64_t firstIteration
+           uint64_t numSamples
+           float    values[numSamples][numChannels]
+       The index gets one entry appended as each chunk is finished, so it only ever lists complete chunks:
+           char     magic[8]         "KSETSTI" followed by a null byte
+           uint32_t version          TRACE_VERSION
+           uint32_t numChannels
+           entries of { uint64_t chunk; uint64_t firstIteration; uint64_t numSamples; }
+    */
+    constexpr uint32_t TRACE_VERSION = 1;
+
+    enum class TraceOverflow {
+        /// Samples that find the buffer full are dropped, so the simulation never waits on the disk.
+        DROP,
+        /// The simulation waits for the writer to make room, so no sample is lost.
+        BLOCK
+    };
+
+    struct TraceConfig {
+        /// Number of samples buffered between the simulation and the writer thread.
+        std::size_t bufferSamples = 4096;
+
+        /// Number of samples per chunk file. A chunk also ends wherever samples were dropped.
+        std::size_t chunkSamples = odeMillisecondsToIters(60'000);
+
+        TraceOverflow overflow = TraceOverflow::DROP;
+    };
+
+    struct TraceStats {
+        /// Samples handed to the recorder, whether or not they were kept.
+        uint64_t numRecorded = 0;
+        uint64_t numDropped = 0;
+        /// Times a sample found the buffer full, whether it was then dropped or waited for room.
+        uint64_t numBackpressureEvents = 0;
+        uint64_t numWritten = 0;
+        uint64_t numChunks = 0;
+    };
+
+    /*
+       Streams fixed size sample vectors to chunked trace files. Samples go through a single producer,
+       single consumer lock free ring buffer to a writer thread, so recording never touches the disk.
+       Files are named pathPrefix.index and pathPrefix.000000.chunk, pathPrefix.000001.chunk, ...
+    */
+    class TraceRecorder {
+        TraceConfig config;
+        std::string pathPrefix;
+        std::size_t numChannels;
+
+        std::vector<numeric> values;
+        std::vector<uint64_t> iterations;
+
+        // written by the recording thread only
+        alignas(64) std::atomic<uint64_t> writeIndex {0};
+        uint64_t cachedReadIndex = 0;
+        std::atomic<uint64_t> numRecorded {0};
+        std::atomic<uint64_t> numDropped {0};
+        std::atomic<uint64_t> numBackpressureEvents {0};
+
+        // written by the writer thread only
+        alignas(64) std::atomic<uint64_t> readIndex {0};
+        std::atomic<uint64_t> numWritten {0};
+        std::atomic<uint64_t> numChunks {0};
+
+        std::atomic<bool> stopping {false};
+        std::exception_ptr writeError;
+        std::FILE *index = nullptr;
+        std::thread writer;
+
+        // current chunk, if chunkFile is not null
+        std::FILE *chunkFile = nullptr;
+        uint64_t chunkFirstIteration = 0;
+        uint64_t chunkNumSamples = 0;
+
+        std::string chunkPath(uint64_t chunk) const;
+        void writerMain() noexcept;
+        void writeSamples(uint64_t first, uint64_t last);
+        void startChunk(uint64_t firstIteration);
+        void finishChunk();
+    public:
+        // starts the writer thread
+        // throws if numChannels or a config size is 0, or the index cannot be created
+        TraceRecorder(const std::string& pathPrefix, std::size_t numChannels, TraceConfig config=TraceConfig());
+        TraceRecorder(const TraceRecorder& other) = delete;
+        TraceRecorder& operator=(const TraceRecorder& other) = delete;
+        // closes the recorder, ignoring write errors
+        ~TraceRecorder();
+
+        // Must only be called from one thread at a time. fill(numeric *sample) writes the numChannels
+        // values of the sample straight into the buffer. Returns false if the sample was dropped.
+        template<typename Fill>
+        bool record(uint64_t iteration, Fill fill) noexcept {
+            std::size_t capacity = iterations.size();
+            uint64_t head = writeIndex.load(std::memory_order_relaxed);
+            numRecorded.store(numRecorded.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            if (stopping.load(std::memory_order_relaxed)) {
+                numDropped.store(numDropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return false;
+            }
+            if (head - cachedReadIndex == capacity) {
+                cachedReadIndex = readIndex.load(std::memory_order_acquire);
+                if (head - cachedReadIndex == capacity) {
+                    numBackpressureEvents.store(numBackpressureEvents.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    if (config.overflow == TraceOverflow::DROP) {
+                        numDropped.store(numDropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                        return false;
+                    }
+                    while (head - cachedReadIndex == capacity) {
+                        std::this_thread::yield();
+                        cachedReadIndex = readIndex.load(std::memory_order_acquire);
+                    }
+                }
+            }
+
+            std::size_t slot = head % capacity;
+            iterations[slot] = iteration;
+            fill(values.data() + slot * numChannels);
+            writeIndex.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        // waits for every buffered sample to be written, finishes the last chunk and stops the writer.
+        // Must not be called while record is. Later samples are dropped.
+        // throws if any write failed
+        void close();
+
+        TraceStats getStats() const noexcept;
+        std::size_t getNumChannels() const noexcept;
+        const TraceConfig& getConfig() const noexcept;
+    };
+}
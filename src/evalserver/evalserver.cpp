@@ -0,0 +1,53 @@
+#include "ksets/server.hpp"
+
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+
+using ksets::EvaluationServer, ksets::ServerConfig;
+
+// USAGE: evalserver SOCKET_PATH [UNIT_COUNT...]
+// Serves evaluation requests on SOCKET_PATH until interrupted, with models of each UNIT_COUNT warmed up
+// in advance. See include/ksets/server.hpp for the protocol.
+
+// CONFIG
+constexpr ksets::rngseed PREWARM_SEED = 1997'12'02;
+constexpr ksets::numeric PREWARM_INITIAL_REST = 500;
+// END CONFIG
+
+namespace {
+    EvaluationServer *runningServer = nullptr;
+
+    void stopServer(int) {
+        if (runningServer != nullptr)
+            runningServer->stop();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " SOCKET_PATH [UNIT_COUNT...]\n";
+        return 2;
+    }
+
+    ServerConfig config;
+    config.prewarmSeed = PREWARM_SEED;
+    config.prewarmInitialRestMilliseconds = PREWARM_INITIAL_REST;
+    for (int i = 2; i < argc; i++) {
+        char *errptr;
+        unsigned long numUnits = std::strtoul(argv[i], &errptr, 10);
+        if (*errptr || numUnits == 0) {
+            std::cerr << "Invalid unit count: " << argv[i] << '\n';
+            return 2;
+        }
+        config.prewarmUnitCounts.push_back(numUnits);
+    }
+
+    EvaluationServer server(argv[1], config);
+    runningServer = &server;
+    std::signal(SIGINT, stopServer);
+    std::signal(SIGTERM, stopServer);
+    std::cerr << "Serving on " << argv[1] << '\n';
+    server.serve();
+    runningServer = nullptr;
+}
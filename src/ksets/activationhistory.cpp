@@ -1,23 +1,96 @@
 #include "ksets/activationhistory.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <stdexcept>
 #include <cassert>
 
-using ksets::ActivationHistory;
+using ksets::ActivationHistory, ksets::HistorySpan, ksets::HistorySummary, ksets::HistoryTier, ksets::HistoryTierConfig;
+using ksets::MatrixLayout;
 using ksets::numeric;
 
 ActivationHistory::ActivationHistory(std::size_t historySize):
     history(historySize, 0),
+    historySize(historySize),
     monitoredWindow(std::nullopt) {}
 
+HistoryTier::HistoryTier(HistoryTierConfig config, std::size_t valuesPerInput):
+    entries(config.length),
+    decimation(config.decimation),
+    valuesPerEntry(valuesPerInput * config.decimation) {}
+
+bool HistoryTier::add(const HistorySummary& input) noexcept {
+    if (numPending == 0) {
+        pending = input;
+    } else {
+        pending.min = std::min(pending.min, input.min);
+        pending.max = std::max(pending.max, input.max);
+    }
+    pendingSum += input.mean;
+    if (++numPending < decimation)
+        return false;
+
+    // every input covers as many values, so the mean of their means is the mean of the values
+    pending.mean = pendingSum / decimation;
+    std::size_t newest = (oldest + numEntries) % entries.size();
+    entries[newest] = pending;
+    if (numEntries < entries.size())
+        numEntries++;
+    else
+        oldest = oldest + 1 == entries.size() ? 0 : oldest + 1;
+    numEntriesMade++;
+    pendingSum = 0;
+    numPending = 0;
+    return true;
+}
+
+const HistorySummary& HistoryTier::get(std::size_t offset) const {
+    if (offset >= numEntries)
+        throw std::out_of_range("History tier offset out of range");
+    return entries[(oldest + numEntries - offset - 1) % entries.size()];
+}
+
+void HistoryTier::copyEntries(HistorySummary *destination) const noexcept {
+    for (std::size_t i = 0; i < numEntries; i++)
+        destination[i] = entries[(oldest + i) % entries.size()];
+}
+
 void ActivationHistory::put(numeric newValue) {
     if (monitoredWindow.has_value())
         doMonitoring(newValue);
-    history.pop_front();
-    history.push_back(newValue);
+    if (!tiers.empty()) {
+        HistorySummary summary {newValue, newValue, newValue};
+        for (std::size_t tier = 0; tier < tiers.size() && tiers[tier].add(summary); tier++)
+            summary = tiers[tier].get();
+    }
+    if (historySize > 0) {
+        // the oldest value is overwritten by the newest
+        history[oldest] = newValue;
+        oldest = oldest + 1 == historySize ? 0 : oldest + 1;
+    }
     numPuts++;
 }
 
+void ActivationHistory::setSummaryTiers(const std::vector<HistoryTierConfig>& configs) {
+    std::vector<HistoryTier> newTiers;
+    std::size_t valuesPerInput = 1;
+    for (auto& config : configs) {
+        if (config.decimation < 2)
+            throw std::invalid_argument("History tier decimation must be at least 2");
+        if (config.length == 0)
+            throw std::invalid_argument("History tier length cannot be 0");
+        newTiers.push_back(HistoryTier(config, valuesPerInput));
+        valuesPerInput = newTiers.back().getValuesPerEntry();
+    }
+    tiers = std::move(newTiers);
+}
+
+const HistoryTier& ActivationHistory::summaryTier(std::size_t tier) const {
+    if (tier >= tiers.size())
+        throw std::out_of_range("History tier index out of range");
+    return tiers[tier];
+}
+
 std::size_t ActivationHistory::getNumPutsMade() const noexcept {
     return numPuts;
 }
@@ -43,16 +116,111 @@ std::size_t ActivationHistory::Slice::transformIndex(std::size_t sliceIndex) con
 }
 
 numeric ActivationHistory::get(std::size_t offset) const {
-    std::size_t index = history.size() - offset - 1;
-    return history.at(index);
+    if (offset >= historySize)
+        throw std::out_of_range("History offset out of range");
+    std::size_t index = oldest + historySize - offset - 1;
+    return history[index < historySize ? index : index - historySize];
 }
 
 std::size_t ActivationHistory::size() const noexcept {
-    return history.size();
+    return historySize;
 }
 
 void ActivationHistory::resize(std::size_t newSize) {
-    history.resize(newSize);
+    if (monitoredWindow.has_value() && !fitsMonitoringWindow(monitoredWindow->windowSize, newSize))
+        throw std::invalid_argument("History size is too short for its monitoring window");
+    std::vector<numeric> values(begin(), begin() + std::min(historySize, newSize));
+    values.resize(newSize, 0);
+    history = std::move(values);
+    historySize = newSize;
+    oldest = 0;
+}
+
+void ActivationHistory::clear() noexcept {
+    std::fill(history.begin(), history.end(), 0);
+    oldest = 0;
+    numPuts = 0;
+    if (monitoredWindow.has_value()) {
+        monitoredWindow->sum = 0;
+        monitoredWindow->varianceNumerator = 0;
+    }
+    for (auto& tier : tiers) {
+        tier.oldest = 0;
+        tier.numEntries = 0;
+        tier.numEntriesMade = 0;
+        tier.pendingSum = 0;
+        tier.numPending = 0;
+    }
+}
+
+std::array<HistorySpan, 2> ActivationHistory::spans(std::size_t n) const {
+    if (n > historySize)
+        throw std::invalid_argument("Span length must be less than or equal to history size.");
+    // the newest value is just before oldest
+    std::size_t first = oldest + historySize - n;
+    if (first >= historySize)
+        first -= historySize;
+    std::size_t firstLength = std::min(n, historySize - first);
+    return {HistorySpan(history.data() + first, firstLength), HistorySpan(history.data(), n - firstLength)};
+}
+
+std::optional<HistorySpan> ActivationHistory::span(std::size_t n) const {
+    auto pieces = spans(n);
+    if (pieces[1].size() > 0)
+        return std::nullopt;
+    return pieces[0];
+}
+
+void ActivationHistory::copyTail(std::size_t n, numeric *destination, std::size_t stride) const {
+    for (const HistorySpan& piece : spans(n)) {
+        if (piece.size() == 0)
+            continue;
+        if (stride == 1) {
+            std::memcpy(destination, piece.data(), piece.size() * sizeof(numeric));
+        } else {
+            for (std::size_t i = 0; i < piece.size(); i++)
+                destination[i * stride] = piece[i];
+        }
+        destination += piece.size() * stride;
+    }
+}
+
+void ksets::exportHistories(
+    const ActivationHistory *const *histories,
+    std::size_t numHistories,
+    std::size_t numSamples,
+    numeric *destination,
+    MatrixLayout layout
+) {
+    for (std::size_t h = 0; h < numHistories; h++)
+        if (numSamples > histories[h]->size())
+            throw std::invalid_argument("Cannot export more samples than a history holds");
+
+    if (layout == MatrixLayout::ROW_MAJOR) {
+        for (std::size_t h = 0; h < numHistories; h++)
+            histories[h]->copyTail(numSamples, destination + h * numSamples);
+        return;
+    }
+
+    std::vector<std::array<HistorySpan, 2>> pieces;
+    pieces.reserve(numHistories);
+    for (std::size_t h = 0; h < numHistories; h++)
+        pieces.push_back(histories[h]->spans(numSamples));
+
+    // transposed in blocks of samples, so both the sources and the destination rows stay in cache
+    constexpr std::size_t BLOCK_SIZE = 64;
+    for (std::size_t blockStart = 0; blockStart < numSamples; blockStart += BLOCK_SIZE) {
+        std::size_t blockEnd = std::min(blockStart + BLOCK_SIZE, numSamples);
+        for (std::size_t h = 0; h < numHistories; h++) {
+            const HistorySpan& first = pieces[h][0];
+            const HistorySpan& second = pieces[h][1];
+            std::size_t split = std::min(std::max(first.size(), blockStart), blockEnd);
+            for (std::size_t sample = blockStart; sample < split; sample++)
+                destination[sample * numHistories + h] = first[sample];
+            for (std::size_t sample = split; sample < blockEnd; sample++)
+                destination[sample * numHistories + h] = second[sample - first.size()];
+        }
+    }
 }
 
 void ActivationHistory::initMonitoring() {
@@ -64,8 +232,8 @@ void ActivationHistory::initMonitoring() {
 }
 
 void ActivationHistory::setActivityMonitoring(std::size_t windowSize) {
-    if (windowSize > history.size())
-        throw std::invalid_argument("Monitoring window must be less than or equal to history size");
+    if (windowSize > 0 && !fitsMonitoringWindow(windowSize, historySize))
+        throw std::invalid_argument("Monitoring window must be at least 2 shorter than the history");
 
     if (windowSize == 0) {
         monitoredWindow.reset();
@@ -132,6 +300,30 @@ numeric ActivationHistory::variance(std::size_t window) const {
 //     return var / (window - 1);
 // }
 
+ActivationHistory::RawState ActivationHistory::getRawState() const noexcept {
+    if (monitoredWindow.has_value()) {
+        auto& m = monitoredWindow.value();
+        return {numPuts, m.windowSize, m.sum, m.varianceNumerator};
+    }
+    return {numPuts, 0, 0, 0};
+}
+
+void ActivationHistory::restoreRawState(const RawState& state, const numeric *values, std::size_t numValues) {
+    if (state.monitoringWindow > 0 && !fitsMonitoringWindow(state.monitoringWindow, numValues))
+        throw std::invalid_argument("Monitoring window must be at least 2 shorter than the history");
+    history.assign(values, values + numValues);
+    historySize = numValues;
+    oldest = 0;
+    numPuts = state.numPuts;
+    if (state.monitoringWindow == 0) {
+        monitoredWindow.reset();
+    } else {
+        monitoredWindow.emplace(state.monitoringWindow);
+        monitoredWindow->sum = state.monitoringSum;
+        monitoredWindow->varianceNumerator = state.monitoringVarianceNumerator;
+    }
+}
+
 numeric ActivationHistory::stddev() const {
     if (!monitoredWindow.has_value())
         throw std::runtime_error("Cannot infer stddev window size without activity monitoring enabled");
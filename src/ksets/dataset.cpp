@@ -0,0 +1,219 @@
+#include "ksets/dataset.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using ksets::PatternDataset, ksets::DatasetAccess, ksets::numeric;
+
+static_assert(sizeof(numeric) == sizeof(float), "Datasets store float32 patterns, which must be usable in place");
+
+// translation unit "private" types and functions
+namespace {
+    constexpr char DATASET_MAGIC[8] = "KSETSDS";
+
+    struct DatasetHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t flags;
+        uint64_t numPatterns;
+        uint64_t patternSize;
+    };
+    static_assert(sizeof(DatasetHeader) == 32, "Dataset header must have no padding");
+
+    std::size_t pageSize() noexcept {
+        static const std::size_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
+}
+
+PatternDataset::PatternDataset(const std::string& path, DatasetAccess access) {
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Could not open dataset " + path);
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        int error = errno;
+        close();
+        throw std::system_error(error, std::generic_category(), "Could not stat dataset " + path);
+    }
+    mappingLength = info.st_size;
+    if (mappingLength < sizeof(DatasetHeader)) {
+        close();
+        throw std::runtime_error("Dataset " + path + " is too short to hold a header");
+    }
+
+    mapping = mmap(nullptr, mappingLength, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        int error = errno;
+        mapping = nullptr;
+        close();
+        throw std::system_error(error, std::generic_category(), "Could not map dataset " + path);
+    }
+
+    const auto *header = static_cast<const DatasetHeader *>(mapping);
+    std::size_t valuesEnd = 0;
+    const char *problem = nullptr;
+    if (std::memcmp(header->magic, DATASET_MAGIC, sizeof(DATASET_MAGIC)) != 0)
+        problem = "is not a dataset";
+    else if (header->version != DATASET_VERSION)
+        problem = "has an unsupported version";
+    else if (header->patternSize == 0 || header->numPatterns > (mappingLength / sizeof(numeric)) / header->patternSize)
+        problem = "is truncated";
+    else {
+        valuesEnd = sizeof(DatasetHeader) + header->numPatterns * header->patternSize * sizeof(numeric);
+        std::size_t labelsEnd = valuesEnd;
+        if (header->flags & DATASET_HAS_LABELS)
+            labelsEnd += header->numPatterns * sizeof(int32_t);
+        if (labelsEnd > mappingLength)
+            problem = "is truncated";
+    }
+    if (problem != nullptr) {
+        close();
+        throw std::runtime_error("Dataset " + path + " " + problem);
+    }
+
+    numPatterns = header->numPatterns;
+    numValues = header->patternSize;
+    const char *base = static_cast<const char *>(mapping);
+    patterns = reinterpret_cast<const numeric *>(base + sizeof(DatasetHeader));
+    if (header->flags & DATASET_HAS_LABELS)
+        labels = reinterpret_cast<const int32_t *>(base + valuesEnd);
+
+    madvise(mapping, mappingLength, access == DatasetAccess::SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM);
+}
+
+PatternDataset::PatternDataset(PatternDataset&& other) noexcept:
+    fd(std::exchange(other.fd, -1)),
+    mapping(std::exchange(other.mapping, nullptr)),
+    mappingLength(std::exchange(other.mappingLength, 0)),
+    numPatterns(std::exchange(other.numPatterns, 0)),
+    numValues(std::exchange(other.numValues, 0)),
+    patterns(std::exchange(other.patterns, nullptr)),
+    labels(std::exchange(other.labels, nullptr))
+{}
+
+PatternDataset& PatternDataset::operator=(PatternDataset&& other) noexcept {
+    if (this != &other) {
+        close();
+        fd = std::exchange(other.fd, -1);
+        mapping = std::exchange(other.mapping, nullptr);
+        mappingLength = std::exchange(other.mappingLength, 0);
+        numPatterns = std::exchange(other.numPatterns, 0);
+        numValues = std::exchange(other.numValues, 0);
+        patterns = std::exchange(other.patterns, nullptr);
+        labels = std::exchange(other.labels, nullptr);
+    }
+    return *this;
+}
+
+PatternDataset::~PatternDataset() {
+    close();
+}
+
+void PatternDataset::close() noexcept {
+    if (mapping != nullptr)
+        munmap(mapping, mappingLength);
+    if (fd >= 0)
+        ::close(fd);
+    mapping = nullptr;
+    fd = -1;
+}
+
+void PatternDataset::advise(std::size_t first, std::size_t last, int advice) const noexcept {
+    last = std::min(last, numPatterns);
+    if (mapping == nullptr || first >= last)
+        return;
+    std::size_t begin = sizeof(DatasetHeader) + first * numValues * sizeof(numeric);
+    std::size_t end = sizeof(DatasetHeader) + last * numValues * sizeof(numeric);
+    if (advice == MADV_DONTNEED) {
+        // only whole pages, so neighbouring patterns are never dropped
+        begin = (begin + pageSize() - 1) / pageSize() * pageSize();
+        end = end / pageSize() * pageSize();
+    } else {
+        begin = begin / pageSize() * pageSize();
+    }
+    if (begin < end)
+        madvise(static_cast<char *>(mapping) + begin, end - begin, advice);
+}
+
+std::size_t PatternDataset::size() const noexcept {
+    return numPatterns;
+}
+
+std::size_t PatternDataset::patternSize() const noexcept {
+    return numValues;
+}
+
+bool PatternDataset::hasLabels() const noexcept {
+    return labels != nullptr;
+}
+
+const numeric *PatternDataset::data() const noexcept {
+    return patterns;
+}
+
+const numeric *PatternDataset::pattern(std::size_t index) const {
+    if (index >= numPatterns)
+        throw std::out_of_range("Pattern index out of range");
+    return patterns + index * numValues;
+}
+
+int32_t PatternDataset::label(std::size_t index) const {
+    if (labels == nullptr)
+        throw std::logic_error("Dataset has no labels");
+    if (index >= numPatterns)
+        throw std::out_of_range("Pattern index out of range");
+    return labels[index];
+}
+
+void PatternDataset::prefetch(std::size_t first, std::size_t last) const noexcept {
+    advise(first, last, MADV_WILLNEED);
+}
+
+void PatternDataset::release(std::size_t first, std::size_t last) const noexcept {
+    advise(first, last, MADV_DONTNEED);
+}
+
+void ksets::writePatternDataset(
+    const std::string& path,
+    const numeric *patterns,
+    std::size_t numPatterns,
+    std::size_t patternSize,
+    const int32_t *labels
+) {
+    if (patternSize == 0)
+        throw std::invalid_argument("Pattern size cannot be 0");
+
+    DatasetHeader header;
+    std::memcpy(header.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC));
+    header.version = DATASET_VERSION;
+    header.flags = labels != nullptr ? DATASET_HAS_LABELS : 0;
+    header.numPatterns = numPatterns;
+    header.patternSize = patternSize;
+
+    std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream ofs(temporaryPath, std::ios::binary);
+        if (!ofs)
+            throw std::runtime_error("Could not open dataset file " + temporaryPath);
+        ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        ofs.write(reinterpret_cast<const char *>(patterns), numPatterns * patternSize * sizeof(numeric));
+        if (labels != nullptr)
+            ofs.write(reinterpret_cast<const char *>(labels), numPatterns * sizeof(int32_t));
+        if (!ofs)
+            throw std::runtime_error("Could not write dataset file " + temporaryPath);
+    }
+    if (std::rename(temporaryPath.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Could not replace dataset file " + path);
+}
@@ -0,0 +1,261 @@
+#include "ksets/ensemble.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <system_error>
+#include <type_traits>
+#include <set>
+#include <functional>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+using ksets::ProcessEnsemble, ksets::EnsembleConfig, ksets::JobStatus, ksets::JobResult;
+using ksets::K3Config, ksets::numeric;
+
+static_assert(std::is_trivially_copyable_v<K3Config>, "K3Config must be trivially copyable to be shared between processes");
+static_assert(std::atomic<std::size_t>::is_always_lock_free, "Shared memory job queue requires lock free atomics");
+static_assert(std::atomic<int64_t>::is_always_lock_free, "Shared memory job queue requires lock free atomics");
+
+// translation unit "private" types and functions
+namespace {
+    struct JobSlot {
+        std::atomic<JobStatus> status;
+        std::atomic<pid_t> worker;
+        // steady clock nanoseconds, which is CLOCK_MONOTONIC and thus comparable between processes
+        std::atomic<int64_t> startedAt;
+    };
+
+    int64_t steadyNow() noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count();
+    }
+
+    // Layout: next queue position, queue length, the queue of job indices, one JobSlot per job, one K3Config per
+    // job, then resultSize values per job.
+    class SharedRegion {
+        void *base = MAP_FAILED;
+        std::size_t length = 0;
+        std::size_t numJobs;
+        std::size_t queueOffset, slotsOffset, configsOffset, resultsOffset;
+
+        static std::size_t alignUp(std::size_t offset, std::size_t alignment) noexcept {
+            return (offset + alignment - 1) / alignment * alignment;
+        }
+
+        template<typename T>
+        T *at(std::size_t offset) const noexcept {
+            return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+        }
+    public:
+        SharedRegion(std::size_t numJobs, std::size_t resultSize): numJobs(numJobs) {
+            queueOffset = alignUp(2 * sizeof(std::atomic<std::size_t>), alignof(std::size_t));
+            slotsOffset = alignUp(queueOffset + numJobs * sizeof(std::size_t), alignof(JobSlot));
+            configsOffset = alignUp(slotsOffset + numJobs * sizeof(JobSlot), alignof(K3Config));
+            resultsOffset = alignUp(configsOffset + numJobs * sizeof(K3Config), alignof(numeric));
+            length = resultsOffset + numJobs * resultSize * sizeof(numeric);
+
+            base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED)
+                throw std::system_error(errno, std::generic_category(), "Could not map ensemble shared memory");
+
+            new (&nextJob()) std::atomic<std::size_t>(0);
+            new (&queueLength()) std::atomic<std::size_t>(0);
+            for (std::size_t i = 0; i < numJobs; i++) {
+                JobSlot *s = new (slot(i)) JobSlot;
+                s->status.store(JobStatus::PENDING);
+                s->worker.store(0);
+                s->startedAt.store(0);
+            }
+        }
+
+        SharedRegion(const SharedRegion& other) = delete;
+
+        ~SharedRegion() {
+            if (base != MAP_FAILED)
+                munmap(base, length);
+        }
+
+        // position in the queue of the next job to be claimed
+        std::atomic<std::size_t>& nextJob() const noexcept { return at<std::atomic<std::size_t>>(0)[0]; }
+        std::atomic<std::size_t>& queueLength() const noexcept { return at<std::atomic<std::size_t>>(0)[1]; }
+        std::size_t *queue() const noexcept { return at<std::size_t>(queueOffset); }
+        JobSlot *slot(std::size_t job) const noexcept { return at<JobSlot>(slotsOffset) + job; }
+        K3Config *configs() const noexcept { return at<K3Config>(configsOffset); }
+        numeric *results() const noexcept { return at<numeric>(resultsOffset); }
+
+        bool hasQueuedJobs() const noexcept { return nextJob().load() < queueLength().load(); }
+    };
+
+    [[noreturn]] void workerMain(
+        const SharedRegion& region,
+        std::size_t resultSize,
+        const ProcessEnsemble::Evaluator& evaluator
+    ) noexcept {
+        pid_t self = getpid();
+        while (true) {
+            std::size_t position = region.nextJob().fetch_add(1);
+            if (position >= region.queueLength().load())
+                break;
+
+            std::size_t job = region.queue()[position];
+            JobSlot *slot = region.slot(job);
+            slot->worker.store(self);
+            slot->startedAt.store(steadyNow());
+            slot->status.store(JobStatus::RUNNING);
+
+            bool succeeded;
+            try {
+                succeeded = evaluator(region.configs()[job], job, region.results() + job * resultSize);
+            } catch (...) {
+                succeeded = false;
+            }
+
+            // The supervisor may have already given up on this job, and is about to kill this worker. Claiming
+            // another job now would lose it to that kill.
+            JobStatus expected = JobStatus::RUNNING;
+            if (!slot->status.compare_exchange_strong(expected, succeeded ? JobStatus::DONE : JobStatus::FAILED))
+                break;
+        }
+        // skip atexit handlers and stdio buffers inherited from the parent
+        _exit(0);
+    }
+
+    // Queues the given jobs and supervises workers until all of them have exited, replacing those that crash, hang
+    // or give up while jobs remain. Only ever waits on its own workers, so other children of the process are left
+    // for their owners to reap. Returns the number of workers replaced.
+    std::size_t superviseRound(
+        const SharedRegion& region,
+        const std::vector<std::size_t>& round,
+        const EnsembleConfig& config,
+        std::set<pid_t>& workers,
+        const std::function<void()>& spawn
+    ) {
+        for (std::size_t i = 0; i < round.size(); i++) {
+            region.queue()[i] = round[i];
+            region.slot(round[i])->worker.store(0);
+        }
+        region.queueLength().store(round.size());
+        region.nextJob().store(0);
+        for (std::size_t i = 0; i < std::min(config.numWorkers, round.size()); i++)
+            spawn();
+
+        std::size_t numRestarts = 0;
+        int64_t timeout = static_cast<int64_t>(config.jobTimeoutMilliseconds * 1'000'000);
+        auto pollInterval = std::chrono::duration<numeric, std::milli>(config.pollMilliseconds);
+        while (!workers.empty()) {
+            for (auto worker = workers.begin(); worker != workers.end();) {
+                pid_t pid = *worker;
+                int wstatus;
+                // -1 if something else reaped it, e.g. with SIGCHLD ignored, which still means it is gone
+                if (waitpid(pid, &wstatus, WNOHANG) == 0) {
+                    worker++;
+                    continue;
+                }
+                worker = workers.erase(worker);
+                for (std::size_t job : round) {
+                    JobSlot *slot = region.slot(job);
+                    JobStatus expected = JobStatus::RUNNING;
+                    if (slot->worker.load() == pid)
+                        slot->status.compare_exchange_strong(expected, JobStatus::FAILED);
+                }
+                if (region.hasQueuedJobs()) {
+                    spawn();
+                    numRestarts++;
+                }
+            }
+
+            if (timeout > 0) {
+                int64_t now = steadyNow();
+                for (std::size_t job : round) {
+                    JobSlot *slot = region.slot(job);
+                    if (slot->status.load() != JobStatus::RUNNING || now - slot->startedAt.load() < timeout)
+                        continue;
+                    // not yet reaped, since only this thread reaps, so the pid cannot have been reused
+                    JobStatus expected = JobStatus::RUNNING;
+                    if (slot->status.compare_exchange_strong(expected, JobStatus::FAILED))
+                        kill(slot->worker.load(), SIGKILL);
+                }
+            }
+
+            if (!workers.empty())
+                std::this_thread::sleep_for(pollInterval);
+        }
+        return numRestarts;
+    }
+}
+
+ProcessEnsemble::ProcessEnsemble(EnsembleConfig config, Evaluator evaluator):
+    config(config), evaluator(std::move(evaluator))
+{
+    if (config.numWorkers == 0)
+        throw std::invalid_argument("Number of workers cannot be 0");
+    if (config.resultSize == 0)
+        throw std::invalid_argument("Result size cannot be 0");
+}
+
+std::size_t ProcessEnsemble::getNumWorkerRestarts() const noexcept {
+    return numWorkerRestarts;
+}
+
+std::vector<JobResult> ProcessEnsemble::run(const std::vector<K3Config>& jobs) {
+    std::size_t numJobs = jobs.size();
+    if (numJobs == 0)
+        return {};
+
+    SharedRegion region(numJobs, config.resultSize);
+    std::memcpy(static_cast<void *>(region.configs()), jobs.data(), numJobs * sizeof(K3Config));
+
+    std::set<pid_t> workers;
+    std::function<void()> spawn = [&]() {
+        pid_t pid = fork();
+        if (pid < 0)
+            throw std::system_error(errno, std::generic_category(), "Could not fork ensemble worker");
+        if (pid == 0)
+            workerMain(region, config.resultSize, evaluator);
+        workers.insert(pid);
+    };
+
+    try {
+        std::vector<std::size_t> round(numJobs);
+        for (std::size_t job = 0; job < numJobs; job++)
+            round[job] = job;
+        while (!round.empty()) {
+            numWorkerRestarts += superviseRound(region, round, config, workers, spawn);
+
+            // Jobs still pending were claimed by a worker that was killed before it could mark them as running,
+            // through no fault of theirs, so they get another round. Every round must finish some job, or the
+            // rest are given up on as failed.
+            std::vector<std::size_t> lost;
+            for (std::size_t job : round)
+                if (region.slot(job)->status.load() == JobStatus::PENDING)
+                    lost.push_back(job);
+            if (lost.size() == round.size())
+                break;
+            round = std::move(lost);
+        }
+    } catch (...) {
+        for (pid_t worker : workers) {
+            kill(worker, SIGKILL);
+            waitpid(worker, nullptr, 0);
+        }
+        throw;
+    }
+
+    std::vector<JobResult> results;
+    results.reserve(numJobs);
+    for (std::size_t job = 0; job < numJobs; job++) {
+        JobStatus status = region.slot(job)->status.load();
+        // jobs lost in every round they were given
+        if (status != JobStatus::DONE)
+            status = JobStatus::FAILED;
+        numeric *first = region.results() + job * config.resultSize;
+        results.push_back({status, std::vector<numeric>(first, first + config.resultSize)});
+    }
+    return results;
+}
@@ -0,0 +1,114 @@
+#include "ksets/features.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+using ksets::FeatureMatrix, ksets::FeatureExtractionConfig, ksets::FeatureKind;
+using ksets::K3, ksets::numeric, ksets::RunStatus;
+
+// translation unit "private" functions
+namespace {
+    // Welford's algorithm, in double so long windows do not lose precision
+    struct OutputStatistics {
+        std::size_t count = 0;
+        double mean = 0;
+        double sumSquaredDeviations = 0;
+        double sumSquares = 0;
+
+        void add(double x) noexcept {
+            count++;
+            double deviation = x - mean;
+            mean += deviation / count;
+            sumSquaredDeviations += deviation * (x - mean);
+            sumSquares += x * x;
+        }
+
+        numeric feature(FeatureKind kind) const noexcept {
+            if (kind == FeatureKind::RMS)
+                return static_cast<numeric>(std::sqrt(sumSquares / count));
+            return static_cast<numeric>(std::sqrt(sumSquaredDeviations / count));
+        }
+    };
+
+    RunStatus presentAndExtract(
+        K3& model,
+        const numeric *pattern,
+        std::size_t presentationIters,
+        std::size_t windowIters,
+        FeatureKind kind,
+        std::vector<OutputStatistics>& statistics,
+        numeric *row
+    ) {
+        std::size_t numUnits = model.size();
+        model.resetRunStatus();
+        RunStatus status = model.present(
+            ksets::odeItersToMilliseconds(presentationIters - windowIters),
+            pattern,
+            pattern + numUnits
+        );
+
+        statistics.assign(numUnits, OutputStatistics());
+        const auto& olfactoryBulb = model.getOlfactoryBulb();
+        for (std::size_t iter = 0; iter < windowIters && status == RunStatus::OK; iter++) {
+            model.step();
+            for (std::size_t i = 0; i < numUnits; i++)
+                statistics[i].add(olfactoryBulb.unit(i).primaryNode()->getCurrentOutput());
+        }
+
+        for (std::size_t i = 0; i < numUnits && status == RunStatus::OK; i++) {
+            row[i] = statistics[i].feature(kind);
+            if (!std::isfinite(row[i]))
+                status = RunStatus::NON_FINITE;
+        }
+        if (status != RunStatus::OK)
+            std::fill(row, row + numUnits, std::numeric_limits<numeric>::quiet_NaN());
+        return status;
+    }
+}
+
+FeatureMatrix ksets::extractFeatures(
+    const K3& warmed,
+    const numeric *patterns,
+    std::size_t numPatterns,
+    FeatureExtractionConfig config
+) {
+    std::size_t presentationIters = odeMillisecondsToIters(config.presentationMilliseconds);
+    std::size_t windowIters = odeMillisecondsToIters(config.windowMilliseconds);
+    if (windowIters == 0)
+        throw std::invalid_argument("Feature window cannot be empty");
+    if (windowIters > presentationIters)
+        throw std::invalid_argument("Feature window cannot be longer than the presentation");
+
+    FeatureMatrix result;
+    result.numPatterns = numPatterns;
+    result.numFeatures = warmed.size();
+    result.values.assign(numPatterns * result.numFeatures, 0);
+    result.statuses.assign(numPatterns, RunStatus::OK);
+    if (numPatterns == 0)
+        return result;
+
+    ksets::parallelForWithWorkers(config.numThreads, numPatterns, [&]() {
+        // one model per thread, reset from the warmed one before every presentation but its first
+        return [&, model = K3(warmed), fresh = true, statistics = std::vector<OutputStatistics>()](std::size_t pattern) mutable {
+            // every presentation starts from the same state, regardless of which thread runs it
+            // or what it ran before
+            if (!fresh)
+                model.copyStateFrom(warmed);
+            fresh = false;
+            result.statuses[pattern] = presentAndExtract(
+                model,
+                patterns + pattern * result.numFeatures,
+                presentationIters,
+                windowIters,
+                config.kind,
+                statistics,
+                result.values.data() + pattern * result.numFeatures
+            );
+        };
+    });
+
+    return result;
+}
@@ -1,28 +1,21 @@
 #include "ksets/k0.hpp"
 
+#include <algorithm>
+#include <limits>
 #include <numeric>
 #include <ctgmath>
 #include <sstream>
 #include <memory>
 #include <stdexcept>
 
-using ksets::K0, ksets::K0Connection, ksets::K0Collection, ksets::numeric, ksets::conntag;
-
-bool K0Connection::perturbWeight(numeric delta) noexcept {
-    numeric newWeight = weight + delta;
-    if (copysign(1.0, weight) != copysign(1.0, newWeight))
-        return false;
-    weight = newWeight;
-    return true;
-}
+using ksets::K0, ksets::K0Connection, ksets::K0ConstConnection, ksets::K0Collection, ksets::numeric, ksets::conntag;
 
 void K0::swap(K0& other) noexcept {
     activationHistory = std::exchange(other.activationHistory, activationHistory);
     sigmoidQ = std::exchange(other.sigmoidQ, sigmoidQ);
-    inboundConnections = std::exchange(other.inboundConnections, inboundConnections);
     // FIXME: hanging references that need outgoingConnections to be tracked
-    for (auto& connection : inboundConnections)
-        connection.target = std::addressof(other);
+    connectionSources.swap(other.connectionSources);
+    connectionParameters.swap(other.connectionParameters);
     odeState = std::exchange(other.odeState, odeState);
     nextOdeState = std::exchange(other.nextOdeState, nextOdeState);
     currentExternalStimulus = std::exchange(other.currentExternalStimulus, currentExternalStimulus);
@@ -30,15 +23,21 @@ void K0::swap(K0& other) noexcept {
 }
 
 K0::K0(K0Config config) noexcept:
-    activationHistory(config.historySize), sigmoidQ(config.sigmoidQ) {}
+    connectionParameters(std::make_shared<ConnectionParameters>()),
+    activationHistory(config.historySize),
+    sigmoidQ(config.sigmoidQ) {}
 
 K0::K0(K0Collection& collection, std::size_t id, K0Config config) noexcept:
-    activationHistory(config.historySize), sigmoidQ(config.sigmoidQ), collection(collection), id(id) {}
+    connectionParameters(std::make_shared<ConnectionParameters>()),
+    activationHistory(config.historySize),
+    sigmoidQ(config.sigmoidQ),
+    collection(collection),
+    id(id) {}
 
 K0::K0(const K0& other) noexcept:
+    connectionParameters(std::make_shared<ConnectionParameters>()),
     activationHistory(other.activationHistory),
     sigmoidQ(other.sigmoidQ),
-    inboundConnections(),
     odeState(other.odeState),
     nextOdeState(other.nextOdeState),
     currentExternalStimulus(other.currentExternalStimulus),
@@ -47,7 +46,7 @@ K0::K0(const K0& other) noexcept:
     // a collection based on that
     id(other.id) {}
 
-K0::K0(K0&& other) noexcept {
+K0::K0(K0&& other) noexcept: connectionParameters(std::make_shared<ConnectionParameters>()) {
     swap(other);
     // destructor for other (old *this) runs here
 }
@@ -72,6 +71,10 @@ void K0::setActivityMonitoring(std::size_t nIter) {
     activationHistory.setActivityMonitoring(nIter);
 }
 
+void K0::setHistoryTiers(const std::vector<ksets::HistoryTierConfig>& tiers) {
+    activationHistory.setSummaryTiers(tiers);
+}
+
 void K0::setCollection(K0Collection& collection) noexcept {
     this->collection = collection;
 }
@@ -80,18 +83,65 @@ void K0::setId(std::size_t id) noexcept {
     this->id = id;
 }
 
+void K0::copyStateFrom(const K0& other, std::size_t numConnections) noexcept {
+    odeState = other.odeState;
+    nextOdeState = other.nextOdeState;
+    activationHistory = other.activationHistory;
+    currentExternalStimulus = other.currentExternalStimulus;
+    currentInputNoise = other.currentInputNoise;
+    sigmoidQ = other.sigmoidQ;
+    noise = other.noise;
+
+    if (numConnections == numInboundConnections() && numConnections == other.numInboundConnections()) {
+        shareConnectionParametersOf(other);
+        return;
+    }
+
+    std::size_t numCommon = std::min({numConnections, numInboundConnections(), other.numInboundConnections()});
+    ConnectionParameters& own = mutableConnectionParameters();
+    const ConnectionParameters& others = *other.connectionParameters;
+    std::copy_n(others.weights.begin(), numCommon, own.weights.begin());
+    std::copy_n(others.delays.begin(), numCommon, own.delays.begin());
+    auto isCommon = [numCommon](const std::pair<uint32_t, conntag>& entry) { return entry.first < numCommon; };
+    auto ownCommonTagsEnd = std::partition_point(own.tags.begin(), own.tags.end(), isCommon);
+    auto otherCommonTagsEnd = std::partition_point(others.tags.begin(), others.tags.end(), isCommon);
+    own.tags.erase(own.tags.begin(), ownCommonTagsEnd);
+    own.tags.insert(own.tags.begin(), others.tags.begin(), otherCommonTagsEnd);
+}
+
+K0::ConnectionParameters& K0::mutableConnectionParameters() noexcept {
+    // unlike use_count, the flag cannot go back down while another thread drops its copy
+    if (connectionParameters->shared.load(std::memory_order_acquire))
+        connectionParameters = std::make_shared<ConnectionParameters>(*connectionParameters);
+    return const_cast<ConnectionParameters&>(*connectionParameters);
+}
+
+void K0::shareConnectionParametersOf(const K0& other) noexcept {
+    other.connectionParameters->shared.store(true, std::memory_order_release);
+    connectionParameters = other.connectionParameters;
+}
+
+void K0::copyConnectionsFrom(const K0& other, const std::map<const K0 *, std::shared_ptr<K0>>& oldToNew) {
+    clearInboundConnections();
+    connectionSources.reserve(other.numInboundConnections());
+    for (K0 *oldSource : other.connectionSources) {
+        auto mapped = oldToNew.find(oldSource);
+        connectionSources.push_back(mapped != oldToNew.end() ? mapped->second.get() : oldSource);
+    }
+    shareConnectionParametersOf(other);
+}
+
 // translation unit "private" function
 namespace {
     void doCloneSubgraph(std::map<const K0 *, std::shared_ptr<K0>>& oldToNew, const K0 *current) noexcept {
         std::shared_ptr<K0> newCurrent = std::shared_ptr<K0>(new K0(*current));
         oldToNew.insert(std::make_pair(current, newCurrent));
         for (auto& conn : *current) {
-            std::shared_ptr<K0> other = conn.source;
-            if (oldToNew.find(other.get()) == oldToNew.end())
-                doCloneSubgraph(oldToNew, other.get());
-            std::shared_ptr<K0> newOther = oldToNew.at(other.get());
-            newCurrent->addInboundConnection(newOther, conn.weight, conn.delay, conn.tag);
+            const K0 *other = conn.source;
+            if (oldToNew.find(other) == oldToNew.end())
+                doCloneSubgraph(oldToNew, other);
         }
+        newCurrent->copyConnectionsFrom(*current, oldToNew);
     }
 }
 
@@ -114,8 +164,8 @@ std::string K0::repr() const noexcept {
 
     if (collection.has_value()) {
         s << " @ ";
-        if (collection.value().get().getName().has_value())
-            s << collection.value().get().getName().value();
+        if (collection.value().get().hasName())
+            s << collection.value().get().getName();
         else
             s << "<nameless collection>";
     }
@@ -127,22 +177,114 @@ std::string K0::repr() const noexcept {
 numeric K0::calculateNetInput() noexcept {
     numeric accumulation = currentExternalStimulus;
     accumulation += currentInputNoise;
-    for (auto& connection : inboundConnections)
-        accumulation += connection.weight * connection.source->getDelayedOutput(connection.delay);
+    std::size_t numConnections = connectionSources.size();
+    const K0 *const *sources = connectionSources.data();
+    const numeric *weights = connectionParameters->weights.data();
+    const uint16_t *delays = connectionParameters->delays.data();
+    for (std::size_t i = 0; i < numConnections; i++)
+        accumulation += weights[i] * sources[i]->getDelayedOutput(delays[i]);
     return accumulation;
 }
 
 void K0::addInboundConnection(
-    std::shared_ptr<K0> source,
+    K0& source,
     numeric weight,
     std::size_t delay,
     std::optional<conntag> tag
-) noexcept {
-    inboundConnections.emplace_back(source, this, weight, delay, tag);
+) {
+    if (delay > std::numeric_limits<uint16_t>::max())
+        throw std::invalid_argument("Connection delay does not fit in 16 bits");
+    ConnectionParameters& parameters = mutableConnectionParameters();
+    if (tag.has_value())
+        parameters.tags.emplace_back(static_cast<uint32_t>(connectionSources.size()), tag.value());
+    connectionSources.push_back(&source);
+    parameters.weights.push_back(weight);
+    parameters.delays.push_back(static_cast<uint16_t>(delay));
+}
+
+std::size_t K0::setInboundConnection(const K0& source, numeric weight, std::size_t delay, std::size_t hint) {
+    if (delay > std::numeric_limits<uint16_t>::max())
+        throw std::invalid_argument("Connection delay does not fit in 16 bits");
+    std::size_t numConnections = numInboundConnections();
+    for (std::size_t step = 0; step < numConnections; step++) {
+        std::size_t index = (hint + step) % numConnections;
+        if (connectionSources[index] != &source)
+            continue;
+        if (connectionParameters->weights[index] != weight || connectionParameters->delays[index] != delay) {
+            ConnectionParameters& parameters = mutableConnectionParameters();
+            parameters.weights[index] = weight;
+            parameters.delays[index] = static_cast<uint16_t>(delay);
+        }
+        return index;
+    }
+    throw std::invalid_argument("Node has no connection from the given source");
+}
+
+void K0::redirectConnection(std::size_t index, K0& source, std::size_t delay) {
+    if (index >= numInboundConnections())
+        throw std::out_of_range("Connection index out of range");
+    if (delay > std::numeric_limits<uint16_t>::max())
+        throw std::invalid_argument("Connection delay does not fit in 16 bits");
+
+    connectionSources[index] = &source;
+    setConnectionDelay(index, delay);
+}
+
+void K0::setConnectionDelay(std::size_t index, std::size_t delay) {
+    if (delay > std::numeric_limits<uint16_t>::max())
+        throw std::invalid_argument("Connection delay does not fit in 16 bits");
+
+    if (connectionParameters->delays[index] != delay)
+        mutableConnectionParameters().delays[index] = static_cast<uint16_t>(delay);
 }
 
 void K0::clearInboundConnections() noexcept {
-    inboundConnections.clear();
+    connectionSources.clear();
+    connectionParameters = std::make_shared<ConnectionParameters>();
+}
+
+void K0::reserveInboundConnections(std::size_t numConnections) noexcept {
+    connectionSources.reserve(numConnections);
+    ConnectionParameters& parameters = mutableConnectionParameters();
+    parameters.weights.reserve(numConnections);
+    parameters.delays.reserve(numConnections);
+}
+
+// translation unit "private" function
+namespace {
+    std::optional<conntag> findTag(const std::vector<std::pair<uint32_t, conntag>>& tags, std::size_t index) noexcept {
+        auto entry = std::lower_bound(
+            tags.begin(),
+            tags.end(),
+            index,
+            [](const std::pair<uint32_t, conntag>& entry, std::size_t index) { return entry.first < index; }
+        );
+        if (entry != tags.end() && entry->first == index)
+            return entry->second;
+        return std::nullopt;
+    }
+}
+
+K0Connection K0::connectionAt(std::size_t index) noexcept {
+    return {
+        connectionSources[index],
+        this,
+        index,
+        connectionParameters->weights[index],
+        connectionParameters->delays[index],
+        findTag(connectionParameters->tags, index)
+    };
+}
+
+K0ConstConnection K0::connectionAt(std::size_t index) const noexcept {
+    return {
+        connectionSources[index],
+        this,
+        index,
+        connectionParameters->weights[index],
+        connectionParameters->delays[index],
+        findTag(connectionParameters->tags, index)
+    };
 }
 
 numeric K0::getCurrentOutput() const noexcept {
@@ -153,26 +295,38 @@ numeric K0::getDelayedOutput(std::size_t delay) const noexcept {
     return activationHistory.get(delay);
 }
 
+bool K0::isStateFinite() const noexcept {
+    return std::isfinite(odeState[0]) && std::isfinite(odeState[1]);
+}
+
 void K0::setExternalStimulus(numeric newExternalStimulus) noexcept {
     currentExternalStimulus = newExternalStimulus;
 }
 
-void K0::setRngEngine(std::function<numeric()> newEngine) {
-    noiseRng = newEngine;
+void K0::setNoiseStream(NoiseStream newNoise) {
+    noise = newNoise;
     advanceNoise();
 }
 
+void K0::setNoiseStdDev(numeric stdDev) {
+    if (!noise.has_value())
+        throw std::logic_error("Tried to change the noise of a node with no noise engine");
+    noise->stdDev = stdDev;
+    // the current noise is the stream's last value
+    if (noise->position > 0)
+        currentInputNoise = stdDev * ksets::CounterGaussian(noise->seed, noise->stream)(noise->position - 1);
+}
+
 void K0::advanceNoise() {
-    if (!noiseRng.has_value()) {
+    if (!noise.has_value()) {
         std::stringstream errMsg("Tried to advance noise on a node with no noise engine");
         if (collection.has_value() && collection.value().get().hasName())
-            errMsg << ": collection \"" << collection.value().get().getName().value() << "\"";
+            errMsg << ": collection \"" << collection.value().get().getName() << "\"";
         if (id.has_value())
             errMsg << " (node ID: " << id.value() << ")";
         throw std::logic_error(errMsg.str());
     }
-    auto engine = noiseRng.value();
-    currentInputNoise = engine();
+    currentInputNoise = noise->next();
 }
 
 numeric odeF1(numeric x, numeric dx_dt, numeric totalStimulus) noexcept {
@@ -237,6 +391,35 @@ void K0::randomizeState(std::function<numeric()>& rng) noexcept {
     odeState[0] = rng();
 }
 
+void K0::clearState() noexcept {
+    odeState = {0, 0};
+    nextOdeState = {0, 0};
+    currentExternalStimulus = 0;
+    currentInputNoise = 0;
+    activationHistory.clear();
+}
+
+ksets::ActivationHistory& K0::getActivationHistory() noexcept {
+    return activationHistory;
+}
+
+K0::RawState K0::getRawState() const noexcept {
+    return {odeState, nextOdeState, currentExternalStimulus, currentInputNoise, sigmoidQ, noise};
+}
+
+void K0::restoreRawState(const RawState& state) noexcept {
+    odeState = state.odeState;
+    nextOdeState = state.nextOdeState;
+    currentExternalStimulus = state.externalStimulus;
+    currentInputNoise = state.inputNoise;
+    sigmoidQ = state.sigmoidQ;
+    noise = state.noise;
+}
+
+void K0::relayOutput(numeric output) noexcept {
+    activationHistory.put(output);
+}
+
 void K0Collection::initNodes(std::size_t nNodes, const K0Config& config) {
     if (nNodes == 0)
         throw std::invalid_argument("Number of nodes cannot be 0");
@@ -249,22 +432,21 @@ K0Collection::K0Collection(
     std::optional<std::string> name,
     K0Config config
 ) {
-    this->name.swap(name);
+    if (name.has_value())
+        setName(std::move(name.value()));
     initNodes(nNodes, config);
 }
 
-K0Collection::K0Collection(const K0Collection& other) noexcept {
+K0Collection::K0Collection(const K0Collection& other) noexcept: name(other.name) {
     std::map<const K0 *, std::shared_ptr<K0>> oldToNew = other.primaryNode()->cloneSubgraph();
     for (const std::shared_ptr<K0> oldNode : other) {
         if (oldToNew.find(oldNode.get()) == oldToNew.end())
             oldNode->cloneSubgraph(oldToNew);
         nodes.push_back(oldToNew.at(oldNode.get()));
+        oldToNew.erase(oldNode.get());
     }
-}
-
-K0Collection::~K0Collection() noexcept {
-    for (auto node : nodes)
-        node->clearInboundConnections();
+    for (auto& [oldNode, newNode] : oldToNew)
+        clonedSources.push_back(std::move(newNode));
 }
 
 std::shared_ptr<K0> K0Collection::node(std::size_t index) {
@@ -275,6 +457,11 @@ const std::shared_ptr<K0> K0Collection::node(std::size_t index) const {
     return nodes.at(index);
 }
 
+const std::string& K0Collection::getName() const noexcept {
+    static const std::string noName;
+    return name != nullptr ? *name : noName;
+}
+
 std::size_t K0Collection::size() const noexcept {
     return nodes.size();
 }
@@ -286,6 +473,12 @@ void K0Collection::updateNodeCollectionReferenceAndId() noexcept {
     }
 }
 
+void K0Collection::replaceNodes(const std::map<const K0 *, std::shared_ptr<K0>>& oldToNew) {
+    for (auto& node : nodes)
+        node = oldToNew.at(node.get());
+    updateNodeCollectionReferenceAndId();
+}
+
 void K0Collection::setExternalStimulus(numeric newExternalStimulus) noexcept {
     primaryNode()->setExternalStimulus(newExternalStimulus);
 }
@@ -15,4 +15,12 @@ K1::K1(K1Config config):
     primaryNode()->addInboundConnection(secondaryNode(), config.wSecondaryPrimary);
 }
 
-K1::K1(const K1& other) noexcept: K0Collection(other) {}
\ No newline at end of file
+K1::K1(const K1& other) noexcept: K0Collection(other) {}
+
+void K1::setWeights(const K1Config& config) {
+    if (copysign(1.0, config.wPrimarySecondary) != copysign(1.0, config.wSecondaryPrimary))
+        throw std::invalid_argument("Weights must both be positive or both be negative");
+
+    secondaryNode()->setInboundConnection(*primaryNode(), config.wPrimarySecondary);
+    primaryNode()->setInboundConnection(*secondaryNode(), config.wSecondaryPrimary);
+}
\ No newline at end of file
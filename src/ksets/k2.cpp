@@ -23,3 +23,22 @@ K2::K2(const K2Config config, std::optional<std::string> name) noexcept:
 }
 
 K2::K2(const K2& other) noexcept: K0Collection(other) {}
+
+void K2::setWeights(const K2Config& config) {
+    if (!config.checkWeights())
+        throw std::invalid_argument("Invalid K2 weights");
+
+    node(0)->setInboundConnection(*node(1), config.wee);
+    node(0)->setInboundConnection(*node(2), config.wie);
+    node(0)->setInboundConnection(*node(3), config.wie);
+
+    node(1)->setInboundConnection(*node(0), config.wee);
+    node(1)->setInboundConnection(*node(3), config.wie);
+
+    node(2)->setInboundConnection(*node(0), config.wei);
+    node(2)->setInboundConnection(*node(3), config.wii);
+
+    node(3)->setInboundConnection(*node(0), config.wei);
+    node(3)->setInboundConnection(*node(1), config.wei);
+    node(3)->setInboundConnection(*node(2), config.wii);
+}
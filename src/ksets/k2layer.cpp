@@ -1,6 +1,6 @@
 #include "ksets/k2layer.hpp"
 
-using ksets::K2, ksets::K2Layer, ksets::ActivationHistory, ksets::numeric;
+using ksets::K2, ksets::K2Layer, ksets::ActivationHistory, ksets::MatrixLayout, ksets::HistoryTierConfig, ksets::numeric;
 
 K2Layer::K2Layer(
     std::size_t nUnits,
@@ -47,6 +47,42 @@ bool K2Layer::connectAntipodalNodesLaterally(
     return true;
 }
 
+// Node i's lateral connections were added from units 0, ..., i - 1, i + 1, ..., n - 1 in that order, so each
+// search starts right after the last one found.
+void K2Layer::setPrimaryLateralWeights(numeric weight, std::size_t delay) {
+    if (weight < 0)
+        throw std::invalid_argument("Primary lateral weights must not be negative");
+    if (size() > 1) weight /= size() - 1;
+    for (auto& target : *this) {
+        std::size_t hint = 0;
+        for (auto& source : *this)
+            if (&source != &target)
+                hint = target.primaryNode()->setInboundConnection(*source.primaryNode(), weight, delay, hint) + 1;
+    }
+}
+
+void K2Layer::setAntipodalLateralWeights(numeric weight, std::size_t delay) {
+    if (weight > 0)
+        throw std::invalid_argument("Antipodal lateral weights must not be positive");
+    if (size() > 1) weight /= size() - 1;
+    for (auto& target : *this) {
+        std::size_t hint = 0;
+        for (auto& source : *this)
+            if (&source != &target)
+                hint = target.antipodalNode()->setInboundConnection(*source.antipodalNode(), weight, delay, hint) + 1;
+    }
+}
+
+void K2Layer::setUnitWeights(const K2Config& k2config) {
+    for (auto& unit : *this)
+        unit.setWeights(k2config);
+}
+
+void K2Layer::clearAverageActivationHistories() noexcept {
+    avgPrimaryActivation.clear();
+    avgAntipodalActivation.clear();
+}
+
 void K2Layer::setPrimaryHistorySize(std::size_t newSize) {
     avgPrimaryActivation.resize(newSize);
     for (auto& unit : *this)
@@ -71,6 +107,18 @@ void K2Layer::setAntipodalActivityMonitoring(std::size_t newSize) {
         unit.antipodalNode()->setActivityMonitoring(newSize);
 }
 
+void K2Layer::setPrimaryHistoryTiers(const std::vector<HistoryTierConfig>& tiers) {
+    avgPrimaryActivation.setSummaryTiers(tiers);
+    for (auto& unit : *this)
+        unit.primaryNode()->setHistoryTiers(tiers);
+}
+
+void K2Layer::setAntipodalHistoryTiers(const std::vector<HistoryTierConfig>& tiers) {
+    avgAntipodalActivation.setSummaryTiers(tiers);
+    for (auto& unit : *this)
+        unit.antipodalNode()->setHistoryTiers(tiers);
+}
+
 const ActivationHistory& K2Layer::getAveragePrimaryActivationHistory() const noexcept {
     return avgPrimaryActivation;
 }
@@ -79,6 +127,33 @@ const ActivationHistory& K2Layer::getAverageAntipodalActivationHistory() const n
     return avgAntipodalActivation;
 }
 
+ksets::ActivationHistory& K2Layer::getAveragePrimaryActivationHistory() noexcept {
+    return avgPrimaryActivation;
+}
+
+ksets::ActivationHistory& K2Layer::getAverageAntipodalActivationHistory() noexcept {
+    return avgAntipodalActivation;
+}
+
+void K2Layer::copyAverageActivationHistories(const K2Layer& other) {
+    avgPrimaryActivation = other.avgPrimaryActivation;
+    avgAntipodalActivation = other.avgAntipodalActivation;
+}
+
+void K2Layer::exportPrimaryHistories(std::size_t numSamples, numeric *destination, MatrixLayout layout) const {
+    std::vector<const ActivationHistory *> histories;
+    for (auto& unit : units)
+        histories.push_back(&unit.primaryNode()->getActivationHistory());
+    ksets::exportHistories(histories.data(), histories.size(), numSamples, destination, layout);
+}
+
+void K2Layer::exportAntipodalHistories(std::size_t numSamples, numeric *destination, MatrixLayout layout) const {
+    std::vector<const ActivationHistory *> histories;
+    for (auto& unit : units)
+        histories.push_back(&unit.antipodalNode()->getActivationHistory());
+    ksets::exportHistories(histories.data(), histories.size(), numSamples, destination, layout);
+}
+
 std::size_t K2Layer::size() const noexcept {
     return units.size();
 }
@@ -1,35 +1,69 @@
 #include "ksets/k3.hpp"
+#include "ksets/philox.hpp"
 #include <random>
 #include <sstream>
 #include <utility>
 #include <memory>
+#include <map>
+#include <set>
+#include <algorithm>
 
-using ksets::K0, ksets::K1, ksets::K2, ksets::K2Layer, ksets::K3;
+using ksets::K0, ksets::K0Collection, ksets::K1, ksets::K2, ksets::K2Layer, ksets::K3;
 using ksets::K0Config, ksets::K1Config, ksets::K2Config, ksets::K3Config;
-using ksets::rngseed, ksets::numeric;
+using ksets::rngseed, ksets::numeric, ksets::RunStatus, ksets::ActivationHistory, ksets::MatrixLayout;
 
 namespace {
-    std::function<numeric()> createGaussianRng(numeric stdDev, rngseed seed) {
-        std::mt19937 engine {seed};
-        std::normal_distribution<numeric> dist {0.00, stdDev};
-        return [engine = std::move(engine), dist]() mutable {return dist(engine);};
+    // stream ids are the purpose in the upper half and the node's position in K3::forEachNode in the lower
+    enum RandomStream : uint64_t {
+        INITIAL_STATE = 1,
+        INPUT_NOISE = 2,
+        LATERAL_WEIGHT_PERTURBATION = 3
+    };
+
+    uint64_t streamId(RandomStream purpose, std::size_t nodeIndex) noexcept {
+        return static_cast<uint64_t>(purpose) << 32 | nodeIndex;
     }
 
-    std::function<rngseed()> randomDeviceSeedGenerator(std::size_t batchSize) {
-        std::deque<rngseed> batch(batchSize, 0);
-        std::size_t i = batch.size() - 1;
-        std::random_device rd {};
-        std::array<rngseed, 4> s = {rd(), rd(), rd(), rd()};
-        return [batch = std::move(batch), s = std::move(s), i]() mutable {
-            static std::seed_seq seedGen(s.begin(), s.end());
-
-            i++;
-            if (i == batch.size()) {
-                seedGen.generate(batch.begin(), batch.end());
-                i = 0;
-            }
-            return batch[i];
+    // adjacency lists are indices into the node list, symmetric and sorted
+    std::vector<std::size_t> reverseCuthillMcKee(const std::vector<std::vector<std::size_t>>& adjacency) {
+        std::size_t numNodes = adjacency.size();
+        std::vector<std::size_t> byDegree(numNodes);
+        for (std::size_t i = 0; i < numNodes; i++)
+            byDegree[i] = i;
+        auto lowerDegree = [&adjacency](std::size_t a, std::size_t b) {
+            return adjacency[a].size() < adjacency[b].size();
         };
+        std::stable_sort(byDegree.begin(), byDegree.end(), lowerDegree);
+
+        std::vector<std::size_t> order;
+        order.reserve(numNodes);
+        std::vector<bool> visited(numNodes, false);
+        std::vector<std::size_t> neighbours;
+        // one breadth first search per connected component, each starting from its lowest degree node
+        for (std::size_t start : byDegree) {
+            if (visited[start])
+                continue;
+            visited[start] = true;
+            order.push_back(start);
+            for (std::size_t head = order.size() - 1; head < order.size(); head++) {
+                neighbours.clear();
+                for (std::size_t neighbour : adjacency[order[head]])
+                    if (!visited[neighbour])
+                        neighbours.push_back(neighbour);
+                std::stable_sort(neighbours.begin(), neighbours.end(), lowerDegree);
+                for (std::size_t neighbour : neighbours) {
+                    visited[neighbour] = true;
+                    order.push_back(neighbour);
+                }
+            }
+        }
+        std::reverse(order.begin(), order.end());
+        return order;
+    }
+
+    rngseed randomDeviceSeed() {
+        std::random_device rd {};
+        return static_cast<rngseed>(rd()) << 32 | rd();
     }
 
     K1Config pgConfig(const K3Config& k3config) {
@@ -59,9 +93,63 @@ namespace {
     K0Config dpcConfig(const K3Config& k3config) {
         return {k3config.outputHistorySize};
     }
+
+    // the fields of newConfig that reparameterization leaves as they are in current, set back to current's values
+    K3Config reparameterizedConfig(
+        const K3Config& current,
+        K3Config newConfig,
+        const ksets::ReparameterizationConfig& reparameterization
+    ) noexcept {
+        newConfig.outputHistorySize = current.outputHistorySize;
+        newConfig.outputActivityMonitoring = current.outputActivityMonitoring;
+        newConfig.nonOutputHistorySize = current.nonOutputHistorySize;
+        if (!reparameterization.intraUnit) {
+            newConfig.wPG_intraUnit = current.wPG_intraUnit;
+            newConfig.dPG_intraUnit = current.dPG_intraUnit;
+            newConfig.wOB_unitConfig = current.wOB_unitConfig;
+            newConfig.wAON_unitConfig = current.wAON_unitConfig;
+            newConfig.wPC_unitConfig = current.wPC_unitConfig;
+        }
+        if (!reparameterization.lateral) {
+            newConfig.wPG_interUnit = current.wPG_interUnit;
+            newConfig.dPG_interUnit = current.dPG_interUnit;
+            newConfig.wOB_inter = current.wOB_inter;
+            newConfig.noiseObLateralWeights = current.noiseObLateralWeights;
+        }
+        if (!reparameterization.lot) {
+            newConfig.wPG_OB = current.wPG_OB;
+            newConfig.dPG_OB = current.dPG_OB;
+            newConfig.wOB_AON_lot = current.wOB_AON_lot;
+            newConfig.dOB_AON_lot = current.dOB_AON_lot;
+            newConfig.wOB_PC_lot = current.wOB_PC_lot;
+            newConfig.dOB_PC_lot = current.dOB_PC_lot;
+            newConfig.wPC_DPC = current.wPC_DPC;
+            newConfig.dPC_DPC = current.dPC_DPC;
+        }
+        if (!reparameterization.mot) {
+            newConfig.wAON_PG_mot = current.wAON_PG_mot;
+            newConfig.dAON_PG_mot = current.dAON_PG_mot;
+            newConfig.wAON_OB_toAntipodal = current.wAON_OB_toAntipodal;
+            newConfig.dAON_OB_toAntipodal = current.dAON_OB_toAntipodal;
+            newConfig.wPC_AON_toAntipodal = current.wPC_AON_toAntipodal;
+            newConfig.dPC_AON_toAntipodal = current.dPC_AON_toAntipodal;
+            newConfig.wDPC_PC = current.wDPC_PC;
+            newConfig.dDPC_PC = current.dDPC_PC;
+            newConfig.wDPC_OB_toAntipodal = current.wDPC_OB_toAntipodal;
+            newConfig.dDPC_OB_toAntipodal = current.dDPC_OB_toAntipodal;
+        }
+        if (!reparameterization.noise) {
+            newConfig.noiseAON = current.noiseAON;
+            newConfig.noisePG = current.noisePG;
+            newConfig.noiseOB = current.noiseOB;
+        }
+        return newConfig;
+    }
 }
 
-K3::K3(std::size_t olfactoryBulbNumUnits, numeric initialRestMilliseconds, std::function<rngseed()> seedGen, ksets::K3Config config):
+K3::K3(std::size_t olfactoryBulbNumUnits, const ksets::K3Config& config, StructureOnly):
+    config(config),
+    runStart(std::chrono::steady_clock::now()),
     periglomerularCells(olfactoryBulbNumUnits, K1(pgConfig(config))),
     olfactoryBulb(olfactoryBulbNumUnits, obConfig(config)),
     anteriorOlfactoryNucleus(aonConfig(config)),
@@ -72,10 +160,16 @@ K3::K3(std::size_t olfactoryBulbNumUnits, numeric initialRestMilliseconds, std::
         throw std::invalid_argument("One or more K3 weights were invalid.");
     nameAndSetCollectionForAllSubcomponents();
     connectAllSubcomponents(config);
-    perturbObPrimaryLateralWeights(olfactoryBulbNumUnits, config, seedGen);
+}
+
+K3::K3(std::size_t olfactoryBulbNumUnits, numeric initialRestMilliseconds, rngseed seed, ksets::K3Config config):
+    K3(olfactoryBulbNumUnits, config, StructureOnly{})
+{
+    this->seed = seed;
+    perturbObPrimaryLateralWeights(olfactoryBulbNumUnits, config);
 
-    randomizeK0States(config, seedGen);
-    setupInputAndAonNoise(config, seedGen);
+    randomizeK0States(config);
+    setupInputAndAonNoise(config);
 
     olfactoryBulb.setPrimaryHistorySize(config.outputHistorySize);
     olfactoryBulb.setPrimaryActivityMonitoring(config.outputActivityMonitoring);
@@ -89,69 +183,277 @@ K3::K3(std::size_t olfactoryBulbNumUnits, numeric initialRestMilliseconds, std::
     rest(initialRestMilliseconds);
 }
 
+K3::K3(std::size_t olfactoryBulbNumUnits, numeric initialRestMilliseconds, std::function<rngseed()> seedFactory, ksets::K3Config config)
+    : K3(olfactoryBulbNumUnits, initialRestMilliseconds, seedFactory(), config) {}
+
 K3::K3(std::size_t olfactoryBulbNumUnits, numeric initialRestMilliseconds, ksets::K3Config config)
-    : K3(
-        olfactoryBulbNumUnits,
-        initialRestMilliseconds,
-        randomDeviceSeedGenerator(config.rngSeedGenBatchSize),
-        config
-    ) {}
-
-void K3::randomizeK0States(const K3Config& config, std::function<ksets::rngseed()>& seedGen) noexcept {
-    auto rng = createGaussianRng(config.noiseInitialK0States, seedGen());
-    for (auto& pgUnit : periglomerularCells)
-        pgUnit.randomizeK0States(rng);
-    olfactoryBulb.randomizeK0States(rng);
-    anteriorOlfactoryNucleus.randomizeK0States(rng);
-    prepiriformCortex.randomizeK0States(rng);
-    deepPyramidCells.randomizeK0States(rng);
+    : K3(olfactoryBulbNumUnits, initialRestMilliseconds, randomDeviceSeed(), config) {}
+
+K3::K3(const K3& other):
+    K3(other.size(), other.config, StructureOnly{})
+{
+    copyStateFrom(other);
+}
+
+void K3::copyStateFrom(const K3& other) {
+    if (other.size() != size())
+        throw std::invalid_argument("Cannot copy state between K3 sets of different sizes");
+
+    config = other.config;
+    seed = other.seed;
+    runStatus = other.runStatus;
+    iterationsRun = other.iterationsRun;
+    runStart = other.runStart;
+
+    std::vector<K0 *> otherNodes;
+    other.forEachNode([&otherNodes](const std::shared_ptr<K0>& node) { otherNodes.push_back(node.get()); });
+    std::set<const K0 *> ownNodes;
+    forEachNode([&ownNodes](const std::shared_ptr<K0>& node) { ownNodes.insert(node.get()); });
+    auto otherNode = otherNodes.begin();
+    forEachNode([&otherNode, &ownNodes](const std::shared_ptr<K0>& node) {
+        // a K4 appends its inter-set connections, from mirrors, after those the set made itself
+        std::size_t numSetConnections = node->numInboundConnections();
+        while (numSetConnections > 0 && ownNodes.count(node->connectionAt(numSetConnections - 1).source) == 0)
+            numSetConnections--;
+        node->copyStateFrom(**otherNode, numSetConnections);
+        otherNode++;
+    });
+    olfactoryBulb.copyAverageActivationHistories(other.olfactoryBulb);
+
+    std::vector<const K0Collection *> otherCollections;
+    other.forEachCollection([&otherCollections](const K0Collection& collection) {
+        otherCollections.push_back(&collection);
+    });
+    auto otherCollection = otherCollections.begin();
+    forEachCollection([&otherCollection](K0Collection& collection) {
+        collection.shareNameWith(**otherCollection);
+        otherCollection++;
+    });
+
+    if (other.obLateralLearning.has_value())
+        obLateralLearning.emplace(olfactoryBulb, other.obLateralLearning.value());
+    else
+        obLateralLearning.reset();
 }
 
-void K3::setupInputAndAonNoise(const K3Config& config, std::function<rngseed()>& seedGen) noexcept {
-    auto aonNoise = createGaussianRng(config.noiseAON, seedGen());
-    anteriorOlfactoryNucleus.primaryNode()->setRngEngine(std::move(aonNoise));
+void K3::reorderNodes(ksets::NodeOrdering ordering) {
+    std::vector<std::shared_ptr<K0>> oldNodes;
+    std::map<const K0 *, std::size_t> nodeIndices;
+    forEachNode([&oldNodes, &nodeIndices](const std::shared_ptr<K0>& node) {
+        nodeIndices.emplace(node.get(), oldNodes.size());
+        oldNodes.push_back(node);
+    });
+
+    std::vector<std::size_t> order;
+    if (ordering == ksets::NodeOrdering::REVERSE_CUTHILL_MCKEE) {
+        std::vector<std::vector<std::size_t>> adjacency(oldNodes.size());
+        for (std::size_t target = 0; target < oldNodes.size(); target++) {
+            for (auto& connection : std::as_const(*oldNodes[target])) {
+                auto source = nodeIndices.find(connection.source);
+                if (source == nodeIndices.end() || source->second == target)
+                    continue;
+                adjacency[target].push_back(source->second);
+                adjacency[source->second].push_back(target);
+            }
+        }
+        for (auto& neighbours : adjacency) {
+            std::sort(neighbours.begin(), neighbours.end());
+            neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+        }
+        order = reverseCuthillMcKee(adjacency);
+    } else {
+        for (std::size_t i = 0; i < oldNodes.size(); i++)
+            order.push_back(i);
+    }
+
+    // every node lives in the arena, and is shared through pointers aliasing it
+    auto arena = std::make_shared<std::vector<K0>>();
+    arena->reserve(oldNodes.size());
+    std::map<const K0 *, std::shared_ptr<K0>> oldToNew;
+    for (std::size_t index : order) {
+        const K0& oldNode = *oldNodes[index];
+        K0& newNode = arena->emplace_back(oldNode);
+        newNode.copyStateFrom(oldNode, 0);
+        oldToNew.emplace(&oldNode, std::shared_ptr<K0>(arena, &newNode));
+    }
+    for (auto& [oldNode, newNode] : oldToNew)
+        newNode->copyConnectionsFrom(*oldNode, oldToNew);
 
-    for (auto& pgUnit : periglomerularCells) {
-        auto engine = createGaussianRng(config.noisePG, seedGen());
-        pgUnit.primaryNode()->setRngEngine(std::move(engine));
+    forEachCollection([&oldToNew](K0Collection& collection) { collection.replaceNodes(oldToNew); });
+    if (obLateralLearning.has_value()) {
+        LateralHebbianLearning previous = std::move(obLateralLearning.value());
+        obLateralLearning.emplace(olfactoryBulb, previous);
     }
+}
 
-    for (auto& obUnit : olfactoryBulb) {
-        auto engine = createGaussianRng(config.noiseOB, seedGen());
-        obUnit.primaryNode()->setRngEngine(std::move(engine));
+RunStatus K3::reparameterize(const K3Config& newConfig, ksets::ReparameterizationConfig reparameterization) {
+    if (!newConfig.checkWeightsValidity())
+        throw std::invalid_argument("One or more K3 weights were invalid.");
+    // checked against the kept history sizes, before any connection is rewritten
+    K3Config updatedConfig = reparameterizedConfig(config, newConfig, reparameterization);
+    if (!updatedConfig.checkDelaysValidity())
+        throw std::invalid_argument("One or more K3 delays were invalid.");
+    config = updatedConfig;
+
+    if (reparameterization.intraUnit) {
+        for (auto& pgUnit : periglomerularCells)
+            pgUnit.setWeights(pgConfig(config));
+        olfactoryBulb.setUnitWeights(obConfig(config));
+        anteriorOlfactoryNucleus.setWeights(aonConfig(config));
+        prepiriformCortex.setWeights(pcConfig(config));
     }
+    // the same calls as connectAllSubcomponents and the constructor; the weights' signs were checked above
+    if (reparameterization.lateral) {
+        setPeriglomerularLateralWeights(config.wPG_interUnit);
+        olfactoryBulb.setPrimaryLateralWeights(config.wOB_inter[0]);
+        olfactoryBulb.setAntipodalLateralWeights(config.wOB_inter[1]);
+        perturbObPrimaryLateralWeights(size(), config);
+    }
+    if (reparameterization.lot || reparameterization.mot)
+        connectLayers(config, &reparameterization);
+    if (reparameterization.noise && !reparameterization.resetState) {
+        anteriorOlfactoryNucleus.primaryNode()->setNoiseStdDev(config.noiseAON);
+        for (auto& pgUnit : periglomerularCells)
+            pgUnit.primaryNode()->setNoiseStdDev(config.noisePG);
+        for (auto& obUnit : olfactoryBulb)
+            obUnit.primaryNode()->setNoiseStdDev(config.noiseOB);
+    }
+
+    // learning keeps its own copy of the lateral weights, and its statistics describe the old state
+    if (obLateralLearning.has_value() && (reparameterization.lateral || reparameterization.resetState)) {
+        ksets::HebbianConfig learningConfig = obLateralLearning->getConfig();
+        obLateralLearning.reset();
+        obLateralLearning.emplace(olfactoryBulb, TAG_OB_PRIMARY_LATERAL, learningConfig);
+    }
+
+    if (!reparameterization.resetState)
+        return runStatus;
+    forEachNode([](const std::shared_ptr<K0>& node) { node->clearState(); });
+    olfactoryBulb.clearAverageActivationHistories();
+    randomizeK0States(config);
+    setupInputAndAonNoise(config);
+    resetRunStatus();
+    return rest(reparameterization.initialRestMilliseconds);
+}
+
+void K3::setOutputHistoryTiers(const std::vector<ksets::HistoryTierConfig>& tiers) {
+    olfactoryBulb.setPrimaryHistoryTiers(tiers);
+    olfactoryBulb.setAntipodalHistoryTiers(tiers);
+    anteriorOlfactoryNucleus.primaryNode()->setHistoryTiers(tiers);
+    prepiriformCortex.primaryNode()->setHistoryTiers(tiers);
+}
+
+void K3::randomizeK0States(const K3Config& config) noexcept {
+    std::size_t nodeIndex = 0;
+    forEachNode([this, &config, &nodeIndex](const std::shared_ptr<K0>& node) {
+        ksets::NoiseStream noise {seed, streamId(INITIAL_STATE, nodeIndex++), config.noiseInitialK0States};
+        std::function<numeric()> rng = [&noise]() {return noise.next();};
+        node->randomizeState(rng);
+    });
+}
+
+void K3::setupInputAndAonNoise(const K3Config& config) noexcept {
+    std::map<const K0 *, std::size_t> nodeIndices;
+    forEachNode([&nodeIndices](const std::shared_ptr<K0>& node) { nodeIndices.emplace(node.get(), nodeIndices.size()); });
+    auto setupNoise = [this, &nodeIndices](K0& node, numeric stdDev) {
+        node.setNoiseStream({seed, streamId(INPUT_NOISE, nodeIndices.at(&node)), stdDev});
+    };
+
+    setupNoise(*anteriorOlfactoryNucleus.primaryNode(), config.noiseAON);
+    for (auto& pgUnit : periglomerularCells)
+        setupNoise(*pgUnit.primaryNode(), config.noisePG);
+    for (auto& obUnit : olfactoryBulb)
+        setupNoise(*obUnit.primaryNode(), config.noiseOB);
 }
 
-void K3::perturbObPrimaryLateralWeights(std::size_t numObUnits, const K3Config& config, std::function<rngseed()>& seedGen) noexcept {
+void K3::perturbObPrimaryLateralWeights(std::size_t numObUnits, const K3Config& config) noexcept {
     auto weight = config.noiseObLateralWeights;
     if (numObUnits > 1) weight /= numObUnits - 1;
-    auto rng = createGaussianRng(weight, seedGen());
-    for (auto& unit : olfactoryBulb) {
-        for (auto& connection : *unit.primaryNode()) {
+    std::size_t nodeIndex = 0;
+    forEachNode([this, weight, &nodeIndex](const std::shared_ptr<K0>& node) {
+        // one value per inbound connection, whether or not it gets perturbed
+        ksets::CounterGaussian gaussian {seed, streamId(LATERAL_WEIGHT_PERTURBATION, nodeIndex++)};
+        uint64_t connectionIndex = 0;
+        for (auto& connection : *node) {
             if (connection.tag.has_value() && connection.tag.value() == TAG_OB_PRIMARY_LATERAL)
-                connection.perturbWeight(rng());
+                connection.perturbWeight(weight * gaussian(connectionIndex));
+            connectionIndex++;
         }
-    }
+    });
+}
+
+
+std::size_t K3::numComponents() const noexcept {
+    return size() + 4;
+}
+
+std::vector<std::shared_ptr<K0>> K3::componentNodes(std::size_t component) const {
+    std::vector<std::shared_ptr<K0>> nodes;
+    std::size_t numUnits = size();
+    auto addAll = [&nodes](const K0Collection& collection) { nodes.insert(nodes.end(), collection.begin(), collection.end()); };
+    if (component < numUnits)
+        addAll(periglomerularCells[component]);
+    else if (component == numUnits)
+        for (auto& obUnit : olfactoryBulb)
+            addAll(obUnit);
+    else if (component == numUnits + 1)
+        addAll(anteriorOlfactoryNucleus);
+    else if (component == numUnits + 2)
+        addAll(prepiriformCortex);
+    else if (component == numUnits + 3)
+        addAll(deepPyramidCells);
+    else
+        throw std::out_of_range("K3 component index out of range");
+    return nodes;
 }
 
+void K3::calculateComponentNextState(std::size_t component) noexcept {
+    std::size_t numUnits = size();
+    if (component < numUnits)
+        periglomerularCells[component].calculateNextState();
+    else if (component == numUnits)
+        olfactoryBulb.calculateNextState();
+    else if (component == numUnits + 1)
+        anteriorOlfactoryNucleus.calculateNextState();
+    else if (component == numUnits + 2)
+        prepiriformCortex.calculateNextState();
+    else
+        deepPyramidCells.calculateNextState();
+}
+
+// Noise streams are independent of each other, so advancing them component by component gives the same
+// values as advancing them all at once.
+void K3::commitComponentNextState(std::size_t component) noexcept {
+    std::size_t numUnits = size();
+    if (component < numUnits) {
+        periglomerularCells[component].commitNextState();
+        periglomerularCells[component].primaryNode()->advanceNoise();
+    } else if (component == numUnits) {
+        olfactoryBulb.commitNextState();
+        for (auto& obUnit : olfactoryBulb)
+            obUnit.primaryNode()->advanceNoise();
+        if (obLateralLearning.has_value())
+            obLateralLearning->observe();
+        if (trace)
+            recordTrace();
+    } else if (component == numUnits + 1) {
+        anteriorOlfactoryNucleus.commitNextState();
+        anteriorOlfactoryNucleus.primaryNode()->advanceNoise();
+    } else if (component == numUnits + 2) {
+        prepiriformCortex.commitNextState();
+    } else {
+        deepPyramidCells.commitNextState();
+    }
+}
 
 void K3::calculateNextState() noexcept {
-    for (auto& pgUnit : periglomerularCells)
-        pgUnit.calculateNextState();
-    olfactoryBulb.calculateNextState();
-    anteriorOlfactoryNucleus.calculateNextState();
-    prepiriformCortex.calculateNextState();
-    deepPyramidCells.calculateNextState();
+    for (std::size_t component = 0; component < numComponents(); component++)
+        calculateComponentNextState(component);
 }
 
 void K3::commitNextState() noexcept {
-    for (auto& pgUnit : periglomerularCells)
-        pgUnit.commitNextState();
-    olfactoryBulb.commitNextState();
-    anteriorOlfactoryNucleus.commitNextState();
-    prepiriformCortex.commitNextState();
-    deepPyramidCells.commitNextState();
-    advanceSystemNoise();
+    for (std::size_t component = 0; component < numComponents(); component++)
+        commitComponentNextState(component);
 }
 
 void K3::calculateAndCommitNextState() noexcept {
@@ -159,12 +461,64 @@ void K3::calculateAndCommitNextState() noexcept {
     commitNextState();
 }
 
-void K3::advanceSystemNoise() noexcept {
-    anteriorOlfactoryNucleus.primaryNode()->advanceNoise();
-    for (auto& pgUnit : periglomerularCells)
-        pgUnit.primaryNode()->advanceNoise();
+void K3::recordTrace() noexcept {
+    uint64_t iteration = olfactoryBulb.begin()->primaryNode()->getActivationHistory().getNumPutsMade();
+    trace->record(iteration, [this](numeric *sample) {
+        for (auto& obUnit : olfactoryBulb)
+            for (auto& node : obUnit)
+                *sample++ = node->getCurrentOutput();
+    });
+}
+
+void K3::startTrace(const std::string& pathPrefix, ksets::TraceConfig config) {
+    trace.reset();
+    std::size_t numChannels = 0;
     for (auto& obUnit : olfactoryBulb)
-        obUnit.primaryNode()->advanceNoise();
+        numChannels += obUnit.end() - obUnit.begin();
+    trace = std::make_unique<ksets::TraceRecorder>(pathPrefix, numChannels, config);
+}
+
+ksets::TraceStats K3::stopTrace() {
+    if (!trace)
+        throw std::logic_error("No trace is running");
+    std::unique_ptr<ksets::TraceRecorder> finished = std::move(trace);
+    finished->close();
+    return finished->getStats();
+}
+
+ksets::TraceStats K3::getTraceStats() const {
+    if (!trace)
+        throw std::logic_error("No trace is running");
+    return trace->getStats();
+}
+
+void K3::enableObLateralLearning(ksets::HebbianConfig config) {
+    obLateralLearning.emplace(olfactoryBulb, TAG_OB_PRIMARY_LATERAL, config);
+}
+
+void K3::disableObLateralLearning() noexcept {
+    obLateralLearning.reset();
+}
+
+void K3::learnObLateralWeights() {
+    if (!obLateralLearning.has_value())
+        throw std::logic_error("Olfactory bulb lateral learning is disabled");
+    obLateralLearning->update();
+}
+
+const ksets::LateralHebbianLearning& K3::getObLateralLearning() const {
+    if (!obLateralLearning.has_value())
+        throw std::logic_error("Olfactory bulb lateral learning is disabled");
+    return obLateralLearning.value();
+}
+
+void K3::step() noexcept {
+    calculateAndCommitNextState();
+    iterationsRun++;
+}
+
+std::size_t K3::size() const noexcept {
+    return periglomerularCells.size();
 }
 
 void K3::eraseExternalStimulus() noexcept {
@@ -178,15 +532,100 @@ void K3::eraseExternalStimulus() noexcept {
     }
 }
 
-void K3::run(numeric milliseconds) noexcept {
+bool K3::hasFiniteState() const noexcept {
+    bool finite = true;
+    forEachNode([&finite](const std::shared_ptr<K0>& node) { finite = finite && node->isStateFinite(); });
+    return finite;
+}
+
+bool K3::isOlfactoryBulbSaturated(std::size_t window) const noexcept {
+    numeric ceiling = -1 + config.saturationTolerance;
+    for (auto& obUnit : olfactoryBulb) {
+        auto& history = obUnit.primaryNode()->getActivationHistory();
+        for (auto iter = history.tail(window); iter != history.end(); iter++)
+            if (*iter > ceiling)
+                return false;
+    }
+    return true;
+}
+
+RunStatus K3::checkRunHealth() const noexcept {
+    if (!hasFiniteState())
+        return RunStatus::NON_FINITE;
+
+    // variance(window) reads window+1 samples, and needs a window of at least 2
+    auto& avgHistory = olfactoryBulb.getAveragePrimaryActivationHistory();
+    if (avgHistory.size() < 3)
+        return RunStatus::OK;
+    std::size_t window = std::min(config.degeneracyCheckWindow, avgHistory.size() - 1);
+    if (window < 2 || iterationsRun < window)
+        return RunStatus::OK;
+
+    if (isOlfactoryBulbSaturated(window))
+        return RunStatus::SATURATED;
+    if (avgHistory.variance(window) < config.minOutputVariance)
+        return RunStatus::COLLAPSED;
+    return RunStatus::OK;
+}
+
+RunStatus K3::run(numeric milliseconds) noexcept {
+    if (runStatus != RunStatus::OK)
+        return runStatus;
+
+    std::size_t checkInterval = config.degeneracyCheckInterval;
+    if (checkInterval == 0)
+        checkInterval = DEFAULT_BUDGET_CHECK_INTERVAL;
+
     std::size_t iterations = ksets::odeMillisecondsToIters(milliseconds);
-    for (std::size_t i = 0; i < iterations; i++)
+    for (std::size_t i = 0; i < iterations; i++) {
+        if (config.maxRunIterations > 0 && iterationsRun >= config.maxRunIterations) {
+            runStatus = RunStatus::ITERATION_BUDGET_EXCEEDED;
+            break;
+        }
+
         calculateAndCommitNextState();
+        iterationsRun++;
+        if (iterationsRun % checkInterval != 0)
+            continue;
+
+        if (config.degeneracyCheckInterval > 0)
+            runStatus = checkRunHealth();
+        if (runStatus == RunStatus::OK && config.maxRunWallMilliseconds > 0) {
+            std::chrono::duration<numeric, std::milli> elapsed = std::chrono::steady_clock::now() - runStart;
+            if (elapsed.count() >= config.maxRunWallMilliseconds)
+                runStatus = RunStatus::TIME_BUDGET_EXCEEDED;
+        }
+        if (runStatus != RunStatus::OK)
+            break;
+    }
+    return runStatus;
 }
 
-void K3::rest(numeric milliseconds) noexcept {
+RunStatus K3::rest(numeric milliseconds) noexcept {
     eraseExternalStimulus();
-    run(milliseconds);
+    return run(milliseconds);
+}
+
+rngseed K3::getSeed() const noexcept {
+    return seed;
+}
+
+RunStatus K3::getRunStatus() const noexcept {
+    return runStatus;
+}
+
+std::size_t K3::getIterationsRun() const noexcept {
+    return iterationsRun;
+}
+
+void K3::resetRunStatus() noexcept {
+    runStatus = RunStatus::OK;
+    iterationsRun = 0;
+    runStart = std::chrono::steady_clock::now();
+}
+
+void K3::restartRunClock() noexcept {
+    runStart = std::chrono::steady_clock::now();
 }
 
 void K3::nameAndSetCollectionForAllSubcomponents() noexcept {
@@ -226,7 +665,33 @@ void K3::connectPeriglomerularCellsLaterally(numeric weight, std::size_t delay)
     }
 }
 
-void K3::connectLayers(const K3Config& config) noexcept {
+// rewrites the weights and delays made by connectPeriglomerularCellsLaterally, each search starting past the last
+void K3::setPeriglomerularLateralWeights(numeric weight, std::size_t delay) {
+    for (auto& target : periglomerularCells) {
+        std::size_t hint = 0;
+        for (auto& source : periglomerularCells)
+            if (&source != &target)
+                hint = target.primaryNode()->setInboundConnection(*source.primaryNode(), weight, delay, hint) + 1;
+    }
+}
+
+// Adds the connections between layers or, given which groups to rewrite, sets the weights and delays of those
+// already there in place, so both stay in step with a single description of the wiring.
+void K3::connectLayers(const K3Config& config, const ksets::ReparameterizationConfig *rewrite) {
+    // each target's connections are rewritten in the order they were added, so searching from just past the
+    // previous one takes one step each, even for the AON and PC primaries that read from every unit
+    std::map<const K0 *, std::size_t> hints;
+    auto link = [rewrite, &hints](K0& target, const std::shared_ptr<K0>& source, numeric weight, std::size_t delay, bool lot) {
+        if (rewrite == nullptr) {
+            target.addInboundConnection(source, weight, delay);
+        } else {
+            std::size_t& hint = hints[&target];
+            // connections of groups left alone are skipped over by the next search
+            if (lot ? rewrite->lot : rewrite->mot)
+                hint = target.setInboundConnection(*source, weight, delay, hint) + 1;
+        }
+    };
+
     auto pnIter = periglomerularCells.begin();
     auto obIter = olfactoryBulb.begin();
     while (pnIter != periglomerularCells.end()) {
@@ -234,49 +699,62 @@ void K3::connectLayers(const K3Config& config) noexcept {
         auto& pgUnit = *pnIter;
         auto& obUnit = *obIter;
 
-        obUnit.primaryNode()->addInboundConnection(pgUnit.primaryNode(), config.wPG_OB, config.dPG_OB);
+        link(*obUnit.primaryNode(), pgUnit.primaryNode(), config.wPG_OB, config.dPG_OB, true);
 
         // AON -> PON connections
-        pgUnit.primaryNode()->addInboundConnection(
+        link(
+            *pgUnit.primaryNode(),
             anteriorOlfactoryNucleus.primaryNode(),
             config.wAON_PG_mot,
-            config.dAON_PG_mot);
+            config.dAON_PG_mot,
+            false);
 
         // LOT connections, left on the diagram
-        anteriorOlfactoryNucleus.primaryNode()->addInboundConnection(
-            obUnit.primaryNode(), config.wOB_AON_lot, config.dOB_AON_lot);
-        prepiriformCortex.primaryNode()->addInboundConnection(
-            obUnit.primaryNode(), config.wOB_PC_lot, config.dOB_PC_lot);
+        link(
+            *anteriorOlfactoryNucleus.primaryNode(),
+            obUnit.primaryNode(), config.wOB_AON_lot, config.dOB_AON_lot, true);
+        link(
+            *prepiriformCortex.primaryNode(),
+            obUnit.primaryNode(), config.wOB_PC_lot, config.dOB_PC_lot, true);
 
         // MOT connections, right on the diagram
-        obUnit.antipodalNode()->addInboundConnection(
+        link(
+            *obUnit.antipodalNode(),
             anteriorOlfactoryNucleus.primaryNode(),
             config.wAON_OB_toAntipodal,
-            config.dAON_OB_toAntipodal);
-        obUnit.antipodalNode()->addInboundConnection(
-            deepPyramidCells.primaryNode(), config.wDPC_OB_toAntipodal, config.dDPC_OB_toAntipodal);
+            config.dAON_OB_toAntipodal,
+            false);
+        link(
+            *obUnit.antipodalNode(),
+            deepPyramidCells.primaryNode(), config.wDPC_OB_toAntipodal, config.dDPC_OB_toAntipodal, false);
 
         pnIter++;
         obIter++;
     }
 
     // Singled out connections, not part of any major chain
-    anteriorOlfactoryNucleus.antipodalNode()->addInboundConnection(
+    link(
+        *anteriorOlfactoryNucleus.antipodalNode(),
         prepiriformCortex.primaryNode(),
         config.wPC_AON_toAntipodal,
-        config.dPC_AON_toAntipodal);
+        config.dPC_AON_toAntipodal,
+        false);
 
     // Prepiriform cortex -> deep pyramid cells
-    deepPyramidCells.primaryNode()->addInboundConnection(
+    link(
+        *deepPyramidCells.primaryNode(),
         prepiriformCortex.antipodalNode(),
         config.wPC_DPC,
-        config.dPC_DPC);
+        config.dPC_DPC,
+        true);
 
     // Deep pyramid cells -> prepiriform cortex
-    prepiriformCortex.antipodalNode()->addInboundConnection(
+    link(
+        *prepiriformCortex.antipodalNode(),
         deepPyramidCells.primaryNode(),
         config.wDPC_PC,
-        config.dDPC_PC);
+        config.dDPC_PC,
+        false);
 }
 
 const K2Layer& K3::getOlfactoryBulb() const noexcept {
@@ -295,3 +773,63 @@ const std::shared_ptr<const K0> K3::getPrepiriformCortexPrimary() const noexcept
 const std::shared_ptr<const K0> K3::getDeepPyramidCells() const noexcept {
     return deepPyramidCells.primaryNode();
 }
+
+void K3::exportHistories(
+    const std::vector<std::shared_ptr<const K0>>& nodes,
+    std::size_t numSamples,
+    numeric *destination,
+    MatrixLayout layout
+) const {
+    std::set<const K0 *> ownNodes;
+    forEachNode([&ownNodes](const std::shared_ptr<K0>& node) { ownNodes.insert(node.get()); });
+    std::vector<const ActivationHistory *> histories;
+    histories.reserve(nodes.size());
+    for (auto& node : nodes) {
+        if (ownNodes.count(node.get()) == 0)
+            throw std::invalid_argument("Cannot export the history of a node from another set");
+        histories.push_back(&node->getActivationHistory());
+    }
+    ksets::exportHistories(histories.data(), histories.size(), numSamples, destination, layout);
+}
+
+K1& K3::getMutablePeriglomerularUnit(std::size_t index) {
+    return periglomerularCells.at(index);
+}
+
+const K1& K3::getPeriglomerularUnit(std::size_t index) const {
+    return periglomerularCells.at(index);
+}
+
+K2Layer& K3::getMutableOlfactoryBulb() noexcept {
+    return olfactoryBulb;
+}
+
+K2& K3::getMutableAnteriorOlfactoryNucleus() noexcept {
+    return anteriorOlfactoryNucleus;
+}
+
+std::shared_ptr<K0> K3::getMutablePrepiriformCortexPrimary() noexcept {
+    return prepiriformCortex.primaryNode();
+}
+
+std::shared_ptr<K0> K3::getMutableDeepPyramidCells() noexcept {
+    return deepPyramidCells.primaryNode();
+}
+
+const char *ksets::runStatusName(RunStatus status) noexcept {
+    switch (status) {
+        case RunStatus::OK:
+            return "ok";
+        case RunStatus::NON_FINITE:
+            return "non-finite state";
+        case RunStatus::SATURATED:
+            return "saturated at sigmoid floor";
+        case RunStatus::COLLAPSED:
+            return "collapsed variance";
+        case RunStatus::ITERATION_BUDGET_EXCEEDED:
+            return "iteration budget exceeded";
+        case RunStatus::TIME_BUDGET_EXCEEDED:
+            return "time budget exceeded";
+    }
+    return "unknown";
+}
\ No newline at end of file
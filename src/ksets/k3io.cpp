@@ -0,0 +1,343 @@
+#include "ksets/k3.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using ksets::K0, ksets::K3, ksets::K3Config, ksets::ActivationHistory, ksets::NoiseStream;
+using ksets::numeric, ksets::rngseed, ksets::RunStatus;
+
+static_assert(std::is_trivially_copyable_v<K3Config>, "K3Config must be trivially copyable to be saved as is");
+
+/*
+   File layout, in native byte order. Every section starts at a multiple of 8 bytes and is an array of fixed
+   size records, so a loader only has to map the file and index into it.
+
+       ModelHeader
+       K3Config                          raw bytes
+       NodeRecord[numNodes]              in K3::forEachNode order
+       ConnectionRecord[numConnections]  grouped by target node, in each node's connection order
+       numeric[numHistoryValues]         every history's values, oldest first
+*/
+
+// translation unit "private" types and functions
+namespace {
+    constexpr char MODEL_MAGIC[8] = "KSETSK3";
+    constexpr uint32_t MODEL_VERSION = 1;
+    constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    struct HistoryRecord {
+        uint64_t firstValue;
+        uint64_t numValues;
+        uint64_t numPuts;
+        uint64_t monitoringWindow;
+        numeric monitoringSum;
+        numeric monitoringVarianceNumerator;
+    };
+
+    struct ModelHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrderMark;
+        uint32_t numericSize;
+        uint32_t configSize;
+
+        uint64_t numUnits;
+        uint64_t seed;
+        uint64_t iterationsRun;
+        int32_t runStatus;
+        uint32_t reserved;
+
+        uint64_t numNodes;
+        uint64_t numConnections;
+        uint64_t numHistoryValues;
+
+        uint64_t configOffset;
+        uint64_t nodesOffset;
+        uint64_t connectionsOffset;
+        uint64_t historyValuesOffset;
+        uint64_t fileSize;
+
+        HistoryRecord obAveragePrimaryHistory;
+        HistoryRecord obAverageAntipodalHistory;
+    };
+
+    struct NodeRecord {
+        numeric odeState[2];
+        numeric nextOdeState[2];
+        numeric externalStimulus;
+        numeric inputNoise;
+        numeric sigmoidQ;
+        numeric noiseStdDev;
+        uint64_t hasNoise;
+        uint64_t noiseSeed;
+        uint64_t noiseStream;
+        uint64_t noisePosition;
+
+        uint64_t firstConnection;
+        uint64_t numConnections;
+        HistoryRecord history;
+    };
+
+    struct ConnectionRecord {
+        uint64_t source;
+        numeric weight;
+        int32_t tag;
+        uint32_t hasTag;
+        uint32_t delay;
+    };
+
+    constexpr uint64_t alignUp(uint64_t offset) noexcept {
+        return (offset + 7) / 8 * 8;
+    }
+
+    HistoryRecord appendHistory(const ActivationHistory& history, std::vector<numeric>& values) {
+        auto state = history.getRawState();
+        HistoryRecord record {
+            values.size(),
+            history.size(),
+            state.numPuts,
+            state.monitoringWindow,
+            state.monitoringSum,
+            state.monitoringVarianceNumerator
+        };
+        values.insert(values.end(), history.begin(), history.end());
+        return record;
+    }
+
+    void restoreHistory(ActivationHistory& history, const HistoryRecord& record, const numeric *values, uint64_t numValues) {
+        if (record.firstValue > numValues || record.numValues > numValues - record.firstValue)
+            throw std::runtime_error("Model history is out of bounds");
+        history.restoreRawState(
+            {record.numPuts, record.monitoringWindow, record.monitoringSum, record.monitoringVarianceNumerator},
+            values + record.firstValue,
+            record.numValues
+        );
+    }
+
+    // read only mapping of a whole file, unmapped on destruction
+    class MappedFile {
+        void *base = MAP_FAILED;
+        std::size_t length = 0;
+    public:
+        explicit MappedFile(const std::string& path) {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(), "Could not open model " + path);
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                length = info.st_size;
+                base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            int error = errno;
+            close(fd);
+            if (base == MAP_FAILED)
+                throw std::system_error(error, std::generic_category(), "Could not map model " + path);
+            madvise(base, length, MADV_SEQUENTIAL);
+        }
+
+        MappedFile(const MappedFile& other) = delete;
+
+        ~MappedFile() {
+            if (base != MAP_FAILED)
+                munmap(base, length);
+        }
+
+        std::size_t size() const noexcept { return length; }
+
+        template<typename T>
+        const T *at(uint64_t offset, uint64_t count) const {
+            if (offset % alignof(T) != 0 || offset > length || count > (length - offset) / sizeof(T))
+                throw std::runtime_error("Model file is truncated or corrupt");
+            return reinterpret_cast<const T *>(static_cast<const char *>(base) + offset);
+        }
+    };
+}
+
+void K3::save(const std::string& path) const {
+    std::map<const K0 *, uint64_t> nodeIndices;
+    forEachNode([&nodeIndices](const std::shared_ptr<K0>& node) { nodeIndices.emplace(node.get(), nodeIndices.size()); });
+
+    std::vector<NodeRecord> nodes;
+    std::vector<ConnectionRecord> connections;
+    std::vector<numeric> historyValues;
+    forEachNode([&](const std::shared_ptr<K0>& node) {
+        auto state = node->getRawState();
+        NodeRecord record {};
+        record.odeState[0] = state.odeState[0];
+        record.odeState[1] = state.odeState[1];
+        record.nextOdeState[0] = state.nextOdeState[0];
+        record.nextOdeState[1] = state.nextOdeState[1];
+        record.externalStimulus = state.externalStimulus;
+        record.inputNoise = state.inputNoise;
+        record.sigmoidQ = state.sigmoidQ;
+        if (state.noise.has_value()) {
+            record.hasNoise = 1;
+            record.noiseSeed = state.noise->seed;
+            record.noiseStream = state.noise->stream;
+            record.noiseStdDev = state.noise->stdDev;
+            record.noisePosition = state.noise->position;
+        }
+
+        record.firstConnection = connections.size();
+        for (auto& connection : std::as_const(*node)) {
+            auto source = nodeIndices.find(connection.source);
+            // connections from other sets, made by a K4
+            if (source == nodeIndices.end())
+                continue;
+            connections.push_back({
+                source->second,
+                connection.weight,
+                connection.tag.value_or(0),
+                connection.tag.has_value(),
+                static_cast<uint32_t>(connection.delay)
+            });
+        }
+        record.numConnections = connections.size() - record.firstConnection;
+        record.history = appendHistory(node->getActivationHistory(), historyValues);
+        nodes.push_back(record);
+    });
+
+    ModelHeader header {};
+    std::memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.byteOrderMark = BYTE_ORDER_MARK;
+    header.numericSize = sizeof(numeric);
+    header.configSize = sizeof(K3Config);
+    header.numUnits = size();
+    header.seed = seed;
+    header.iterationsRun = iterationsRun;
+    header.runStatus = static_cast<int32_t>(runStatus);
+    header.obAveragePrimaryHistory = appendHistory(olfactoryBulb.getAveragePrimaryActivationHistory(), historyValues);
+    header.obAverageAntipodalHistory = appendHistory(olfactoryBulb.getAverageAntipodalActivationHistory(), historyValues);
+    header.numNodes = nodes.size();
+    header.numConnections = connections.size();
+    header.numHistoryValues = historyValues.size();
+    header.configOffset = alignUp(sizeof(ModelHeader));
+    header.nodesOffset = alignUp(header.configOffset + sizeof(K3Config));
+    header.connectionsOffset = alignUp(header.nodesOffset + nodes.size() * sizeof(NodeRecord));
+    header.historyValuesOffset = alignUp(header.connectionsOffset + connections.size() * sizeof(ConnectionRecord));
+    header.fileSize = header.historyValuesOffset + historyValues.size() * sizeof(numeric);
+
+    // written to a temporary file first so that a crash mid-write keeps the previous model
+    std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream ofs(temporaryPath, std::ios::binary);
+        if (!ofs)
+            throw std::runtime_error("Could not open model file " + temporaryPath);
+        auto writeAt = [&ofs](uint64_t offset, const void *data, std::size_t length) {
+            static const char padding[8] = {};
+            ofs.write(padding, offset - static_cast<uint64_t>(ofs.tellp()));
+            ofs.write(static_cast<const char *>(data), length);
+        };
+        writeAt(0, &header, sizeof(header));
+        writeAt(header.configOffset, &config, sizeof(K3Config));
+        writeAt(header.nodesOffset, nodes.data(), nodes.size() * sizeof(NodeRecord));
+        writeAt(header.connectionsOffset, connections.data(), connections.size() * sizeof(ConnectionRecord));
+        writeAt(header.historyValuesOffset, historyValues.data(), historyValues.size() * sizeof(numeric));
+        if (!ofs)
+            throw std::runtime_error("Could not write model file " + temporaryPath);
+    }
+    if (std::rename(temporaryPath.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Could not replace model file " + path);
+}
+
+std::unique_ptr<K3> K3::load(const std::string& path) {
+    MappedFile file(path);
+    const ModelHeader& header = *file.at<ModelHeader>(0, 1);
+    if (std::memcmp(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0)
+        throw std::runtime_error(path + " is not a K3 model");
+    if (header.version != MODEL_VERSION)
+        throw std::runtime_error("Unsupported K3 model version " + std::to_string(header.version));
+    if (header.byteOrderMark != BYTE_ORDER_MARK || header.numericSize != sizeof(numeric) || header.configSize != sizeof(K3Config))
+        throw std::runtime_error("K3 model was written on an incompatible machine");
+    if (header.fileSize != file.size())
+        throw std::runtime_error("Model file is truncated or corrupt");
+
+    K3Config savedConfig;
+    std::memcpy(&savedConfig, file.at<K3Config>(header.configOffset, 1), sizeof(K3Config));
+    if (!savedConfig.checkDelaysValidity())
+        throw std::runtime_error("Model file is truncated or corrupt");
+    const NodeRecord *nodes = file.at<NodeRecord>(header.nodesOffset, header.numNodes);
+    const ConnectionRecord *connections = file.at<ConnectionRecord>(header.connectionsOffset, header.numConnections);
+    const numeric *historyValues = file.at<numeric>(header.historyValuesOffset, header.numHistoryValues);
+
+    if (header.runStatus < static_cast<int32_t>(RunStatus::OK) || header.runStatus > static_cast<int32_t>(RunStatus::TIME_BUDGET_EXCEEDED))
+        throw std::runtime_error("Model file is truncated or corrupt");
+
+    std::unique_ptr<K3> model(new K3(header.numUnits, savedConfig, StructureOnly{}));
+    model->seed = header.seed;
+    model->iterationsRun = header.iterationsRun;
+    model->runStatus = static_cast<RunStatus>(header.runStatus);
+
+    std::map<const K0 *, uint64_t> nodeIndices;
+    model->forEachNode([&nodeIndices](const std::shared_ptr<K0>& node) { nodeIndices.emplace(node.get(), nodeIndices.size()); });
+    if (nodeIndices.size() != header.numNodes)
+        throw std::runtime_error("Model topology does not match its config");
+
+    const NodeRecord *record = nodes;
+    model->forEachNode([&](const std::shared_ptr<K0>& node) {
+        if (record->firstConnection > header.numConnections || record->numConnections > header.numConnections - record->firstConnection)
+            throw std::runtime_error("Model file is truncated or corrupt");
+        const ConnectionRecord *savedConnection = connections + record->firstConnection;
+        const ConnectionRecord *savedConnectionsEnd = savedConnection + record->numConnections;
+        for (auto& connection : *node) {
+            std::optional<ksets::conntag> savedTag;
+            if (savedConnection != savedConnectionsEnd && savedConnection->hasTag)
+                savedTag = savedConnection->tag;
+            if (
+                savedConnection == savedConnectionsEnd
+                || nodeIndices.at(connection.source) != savedConnection->source
+                || connection.tag != savedTag
+                || savedConnection->delay > std::numeric_limits<uint16_t>::max()
+            )
+                throw std::runtime_error("Model topology does not match its config");
+            // the source's history is restored from its own record, which must hold the delayed value
+            if (savedConnection->delay >= nodes[savedConnection->source].history.numValues)
+                throw std::runtime_error("Model file is truncated or corrupt");
+            connection.setWeight(savedConnection->weight);
+            connection.setDelay(savedConnection->delay);
+            savedConnection++;
+        }
+        if (savedConnection != savedConnectionsEnd)
+            throw std::runtime_error("Model topology does not match its config");
+
+        K0::RawState state {
+            {record->odeState[0], record->odeState[1]},
+            {record->nextOdeState[0], record->nextOdeState[1]},
+            record->externalStimulus,
+            record->inputNoise,
+            record->sigmoidQ,
+            std::nullopt
+        };
+        if (record->hasNoise)
+            state.noise = NoiseStream {record->noiseSeed, record->noiseStream, record->noiseStdDev, record->noisePosition};
+        node->restoreRawState(state);
+        restoreHistory(node->getActivationHistory(), record->history, historyValues, header.numHistoryValues);
+        record++;
+    });
+    restoreHistory(
+        model->olfactoryBulb.getAveragePrimaryActivationHistory(),
+        header.obAveragePrimaryHistory,
+        historyValues,
+        header.numHistoryValues
+    );
+    restoreHistory(
+        model->olfactoryBulb.getAverageAntipodalActivationHistory(),
+        header.obAverageAntipodalHistory,
+        historyValues,
+        header.numHistoryValues
+    );
+    return model;
+}
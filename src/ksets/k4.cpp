@@ -0,0 +1,158 @@
+#include "ksets/k4.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+using ksets::K0, ksets::K0Config, ksets::K3, ksets::K4, ksets::numeric, ksets::conntag;
+
+// translation unit "private" class
+namespace {
+    // std::barrier is only available from C++20 onwards.
+    // The completion function runs on the last thread to arrive, while all others are still blocked.
+    class Barrier {
+        std::mutex mutex;
+        std::condition_variable allArrived;
+        std::size_t numThreads;
+        std::size_t numWaiting = 0;
+        std::size_t generation = 0;
+        std::function<void()> completion;
+    public:
+        Barrier(std::size_t numThreads, std::function<void()> completion):
+            numThreads(numThreads), completion(std::move(completion)) {}
+
+        void arriveAndWait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            std::size_t arrivalGeneration = generation;
+            numWaiting++;
+            if (numWaiting == numThreads) {
+                completion();
+                numWaiting = 0;
+                generation++;
+                allArrived.notify_all();
+            } else {
+                allArrived.wait(lock, [this, arrivalGeneration]() { return generation != arrivalGeneration; });
+            }
+        }
+    };
+}
+
+std::size_t K4::addSet(std::unique_ptr<K3> set) {
+    if (!set)
+        throw std::invalid_argument("Cannot add a null K3 to a K4");
+    sets.push_back(std::move(set));
+    return sets.size() - 1;
+}
+
+std::size_t K4::size() const noexcept {
+    return sets.size();
+}
+
+K3& K4::set(std::size_t index) {
+    return *sets.at(index);
+}
+
+const K3& K4::set(std::size_t index) const {
+    return *sets.at(index);
+}
+
+void K4::connect(
+    std::size_t sourceSet,
+    std::shared_ptr<K0> source,
+    std::size_t targetSet,
+    std::shared_ptr<K0> target,
+    numeric weight,
+    std::size_t delay,
+    std::optional<conntag> tag
+) {
+    if (sourceSet >= size() || targetSet >= size())
+        throw std::out_of_range("K3 set index out of range");
+    if (sourceSet == targetSet)
+        throw std::invalid_argument("Inter-set connections must join different sets");
+    if (delay >= source->getActivationHistory().size())
+        throw std::invalid_argument("Inter-set delay must be less than the source node's history size");
+
+    auto key = std::make_tuple(static_cast<const K0 *>(source.get()), targetSet, delay);
+    auto existing = linkIndices.find(key);
+    std::size_t linkIndex;
+    if (existing != linkIndices.end()) {
+        linkIndex = existing->second;
+    } else {
+        // the mirror always holds exactly the value the connection needs, so it only needs 1 sample
+        auto mirror = std::make_shared<K0>(K0Config(1));
+        links.push_back({sourceSet, targetSet, source, mirror, delay, {}});
+        linkIndex = links.size() - 1;
+        linkIndices.emplace(key, linkIndex);
+    }
+    target->addInboundConnection(links[linkIndex].mirror, weight, 0, tag);
+}
+
+std::size_t K4::getSynchronizationInterval() const noexcept {
+    if (links.empty())
+        return 0;
+    auto shortest = std::min_element(
+        links.begin(),
+        links.end(),
+        [](const Link& a, const Link& b) { return a.delay < b.delay; }
+    );
+    return shortest->delay + 1;
+}
+
+// Must only be called while no set is stepping. Fills each link's buffer with the
+// outputs its mirror will relay during the next epoch. At the start of iteration t+j of an
+// epoch starting at t, the target set needs the source output from t+j-delay, which is
+// already in the source's history as long as j < delay+1.
+void K4::exchange(std::size_t epochLength) noexcept {
+    for (auto& link : links) {
+        link.buffer.resize(epochLength);
+        for (std::size_t j = 0; j < epochLength; j++)
+            link.buffer[j] = link.source->getDelayedOutput(link.delay - j);
+    }
+}
+
+void K4::run(numeric milliseconds) {
+    std::size_t iterations = ksets::odeMillisecondsToIters(milliseconds);
+    if (sets.empty() || iterations == 0)
+        return;
+
+    std::size_t epochLength = getSynchronizationInterval();
+    if (epochLength == 0)
+        epochLength = iterations;
+
+    std::vector<std::vector<Link *>> inboundLinks(size());
+    for (auto& link : links)
+        inboundLinks[link.targetSet].push_back(&link);
+
+    exchange(epochLength);
+    Barrier barrier(size(), [this, epochLength]() { exchange(epochLength); });
+
+    auto worker = [this, &barrier, &inboundLinks, epochLength, iterations](std::size_t setIndex) {
+        K3& k3 = *sets[setIndex];
+        for (std::size_t done = 0; done < iterations; done += epochLength) {
+            std::size_t length = std::min(epochLength, iterations - done);
+            for (std::size_t j = 0; j < length; j++) {
+                for (Link *link : inboundLinks[setIndex])
+                    link->mirror->relayOutput(link->buffer[j]);
+                k3.step();
+            }
+            if (done + length < iterations)
+                barrier.arriveAndWait();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < size(); i++)
+        threads.emplace_back(worker, i);
+    worker(0);
+    for (auto& thread : threads)
+        thread.join();
+}
+
+void K4::rest(numeric milliseconds) {
+    for (auto& set : sets)
+        set->eraseExternalStimulus();
+    run(milliseconds);
+}
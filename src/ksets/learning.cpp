@@ -0,0 +1,124 @@
+#include "ksets/learning.hpp"
+
+#include <cmath>
+#include <map>
+#include <stdexcept>
+
+using ksets::LateralHebbianLearning, ksets::HebbianConfig, ksets::K2Layer, ksets::K0, ksets::numeric, ksets::conntag;
+
+LateralHebbianLearning::LateralHebbianLearning(K2Layer& layer, conntag tag, HebbianConfig config):
+    config(config),
+    layer(layer),
+    tag(tag),
+    numUnits(layer.size()),
+    weights(numUnits * numUnits, 0),
+    connectedMask(numUnits * numUnits, 0),
+    output(numUnits, 0),
+    activityMean(numUnits, 0),
+    activityVariance(numUnits, 0),
+    excessActivity(numUnits, 0)
+{
+    std::map<const K0 *, std::size_t> unitIndices;
+    for (std::size_t i = 0; i < numUnits; i++)
+        unitIndices.emplace(layer.unit(i).primaryNode().get(), i);
+
+    for (std::size_t target = 0; target < numUnits; target++) {
+        K0 *targetNode = layer.unit(target).primaryNode().get();
+        std::size_t connectionIndex = 0;
+        for (auto& connection : *targetNode) {
+            auto source = unitIndices.find(connection.source);
+            if (connection.tag == tag && source != unitIndices.end()) {
+                std::size_t blockIndex = target * numUnits + source->second;
+                if (connectedMask[blockIndex] != 0)
+                    throw std::invalid_argument("Units must be joined by at most one tagged lateral connection");
+                weights[blockIndex] = connection.weight;
+                connectedMask[blockIndex] = 1;
+                bindings.push_back({blockIndex, targetNode, connectionIndex});
+            }
+            connectionIndex++;
+        }
+    }
+    baselineWeights = weights;
+
+    for (std::size_t i = 0; i < numUnits; i++) {
+        output[i] = layer.unit(i).primaryNode()->getCurrentOutput();
+        activityMean[i] = output[i];
+    }
+}
+
+LateralHebbianLearning::LateralHebbianLearning(K2Layer& layer, const LateralHebbianLearning& other):
+    LateralHebbianLearning(layer, other.tag, other.config)
+{
+    if (numUnits != other.numUnits || bindings.size() != other.bindings.size())
+        throw std::invalid_argument("Cannot copy lateral learning between layers of different shapes");
+    numObservations = other.numObservations;
+    weights = other.weights;
+    baselineWeights = other.baselineWeights;
+    activityMean = other.activityMean;
+    activityVariance = other.activityVariance;
+    scatter();
+}
+
+void LateralHebbianLearning::observe() noexcept {
+    for (std::size_t i = 0; i < numUnits; i++)
+        output[i] = layer.unit(i).primaryNode()->getCurrentOutput();
+
+    numeric alpha = 1 / static_cast<numeric>(std::max<std::size_t>(config.activityWindow, 1));
+    for (std::size_t i = 0; i < numUnits; i++) {
+        numeric deviation = output[i] - activityMean[i];
+        activityMean[i] += alpha * deviation;
+        activityVariance[i] = (1 - alpha) * (activityVariance[i] + alpha * deviation * deviation);
+    }
+
+    numObservations++;
+    if (config.updateInterval > 0 && numObservations % config.updateInterval == 0)
+        update();
+}
+
+void LateralHebbianLearning::update() noexcept {
+    numeric meanActivity = 0;
+    for (std::size_t i = 0; i < numUnits; i++) {
+        excessActivity[i] = std::sqrt(activityVariance[i]);
+        meanActivity += excessActivity[i];
+    }
+    numeric threshold = (1 + config.activityThreshold) * meanActivity / numUnits;
+    for (std::size_t i = 0; i < numUnits; i++)
+        excessActivity[i] = std::max(excessActivity[i] - threshold, static_cast<numeric>(0));
+
+    numeric learningRate = config.learningRate;
+    numeric habituationRate = config.habituationRate;
+    for (std::size_t target = 0; target < numUnits; target++) {
+        numeric *row = weights.data() + target * numUnits;
+        const numeric *baseline = baselineWeights.data() + target * numUnits;
+        const numeric *mask = connectedMask.data() + target * numUnits;
+        numeric targetActivity = learningRate * excessActivity[target];
+        for (std::size_t source = 0; source < numUnits; source++) {
+            numeric current = row[source];
+            numeric updated = current
+                + mask[source] * (targetActivity * excessActivity[source] - habituationRate * (current - baseline[source]));
+            // same sign as the baseline, otherwise rejected
+            row[source] = updated * baseline[source] > 0 ? updated : current;
+        }
+    }
+    scatter();
+}
+
+void LateralHebbianLearning::resetWeights() noexcept {
+    weights = baselineWeights;
+    scatter();
+}
+
+void LateralHebbianLearning::scatter() noexcept {
+    for (auto& binding : bindings)
+        binding.target->connectionWeight(binding.connectionIndex) = weights[binding.blockIndex];
+}
+
+std::size_t LateralHebbianLearning::size() const noexcept {
+    return numUnits;
+}
+
+numeric LateralHebbianLearning::weight(std::size_t target, std::size_t source) const {
+    if (target >= numUnits || source >= numUnits)
+        throw std::out_of_range("Unit index out of range");
+    return weights[target * numUnits + source];
+}
@@ -0,0 +1,91 @@
+#include "ksets/k3.hpp"
+#include "ksets/tangent.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+using ksets::K3, ksets::K3Tangent, ksets::LyapunovConfig, ksets::LyapunovSpectrum;
+using ksets::numeric, ksets::RunStatus, ksets::NoiseStream;
+
+// translation unit "private" function
+namespace {
+    // Orthonormalizes the columns of a row-major numRows x numColumns matrix in order, with modified Gram-Schmidt,
+    // and writes the log of each column's norm after removing the previous columns from it.
+    void orthonormalizeColumns(numeric *rows, std::size_t numRows, std::size_t numColumns, double *logNorms) noexcept {
+        for (std::size_t column = 0; column < numColumns; column++) {
+            for (std::size_t previous = 0; previous < column; previous++) {
+                double dot = 0;
+                for (std::size_t row = 0; row < numRows; row++)
+                    dot += static_cast<double>(rows[row * numColumns + column]) * rows[row * numColumns + previous];
+                for (std::size_t row = 0; row < numRows; row++)
+                    rows[row * numColumns + column] -= dot * rows[row * numColumns + previous];
+            }
+
+            double squaredNorm = 0;
+            for (std::size_t row = 0; row < numRows; row++)
+                squaredNorm += static_cast<double>(rows[row * numColumns + column]) * rows[row * numColumns + column];
+            double norm = std::sqrt(squaredNorm);
+            logNorms[column] = std::log(norm);
+            // a collapsed vector stays collapsed, and its exponent goes to -inf
+            if (norm > 0)
+                for (std::size_t row = 0; row < numRows; row++)
+                    rows[row * numColumns + column] /= norm;
+        }
+    }
+}
+
+LyapunovSpectrum K3::estimateLyapunovExponents(LyapunovConfig lyapunovConfig) {
+    if (obLateralLearning.has_value())
+        throw std::logic_error("Cannot estimate Lyapunov exponents while lateral learning is enabled");
+    std::size_t renormalizationInterval = odeMillisecondsToIters(lyapunovConfig.renormalizationMilliseconds);
+    std::size_t numTransientIterations = odeMillisecondsToIters(lyapunovConfig.transientMilliseconds);
+    std::size_t numMeasureIterations = odeMillisecondsToIters(lyapunovConfig.measureMilliseconds);
+    if (lyapunovConfig.numExponents == 0)
+        throw std::invalid_argument("Must estimate at least one Lyapunov exponent");
+    if (renormalizationInterval == 0)
+        throw std::invalid_argument("Renormalization interval must be positive");
+    if (numMeasureIterations < renormalizationInterval)
+        throw std::invalid_argument("Measure time must cover at least one renormalization interval");
+
+    std::size_t numVectors = lyapunovConfig.numExponents;
+    K3Tangent tangent(*this, numVectors);
+    std::size_t numRows = tangent.getNumRows();
+    if (numVectors > numRows)
+        throw std::invalid_argument("More Lyapunov exponents requested than the set has dimensions");
+
+    // random initial states, with empty delay lines
+    numeric *tangents = tangent.data();
+    std::size_t numStateRows = 2 * tangent.getNodes().size();
+    for (std::size_t vector = 0; vector < numVectors; vector++) {
+        NoiseStream initial {lyapunovConfig.seed, vector, 1};
+        for (std::size_t row = 0; row < numStateRows; row++)
+            tangents[row * numVectors + vector] = initial.next();
+    }
+    std::vector<double> logNorms(numVectors), logGrowths(numVectors, 0);
+    orthonormalizeColumns(tangents, numRows, numVectors, logNorms.data());
+
+    LyapunovSpectrum spectrum;
+    std::size_t numMeasuredIterations = 0;
+    eraseExternalStimulus();
+    for (std::size_t iteration = 0; iteration < numTransientIterations + numMeasureIterations; iteration++) {
+        if (!tangent.step() || runStatus != RunStatus::OK)
+            break;
+        if ((iteration + 1) % renormalizationInterval != 0)
+            continue;
+        orthonormalizeColumns(tangents, numRows, numVectors, logNorms.data());
+        if (iteration < numTransientIterations)
+            continue;
+        numMeasuredIterations += renormalizationInterval;
+        for (std::size_t vector = 0; vector < numVectors; vector++)
+            logGrowths[vector] += logNorms[vector];
+        spectrum.largestExponentHistory.push_back(logGrowths[0] / odeItersToMilliseconds(numMeasuredIterations));
+    }
+
+    spectrum.measuredMilliseconds = odeItersToMilliseconds(numMeasuredIterations);
+    spectrum.runStatus = runStatus;
+    for (std::size_t vector = 0; vector < numVectors; vector++)
+        spectrum.exponents.push_back(
+            numMeasuredIterations > 0 ? logGrowths[vector] / spectrum.measuredMilliseconds : 0
+        );
+    return spectrum;
+}
@@ -0,0 +1,567 @@
+#include "ksets/optimizer.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+
+using ksets::PopulationOptimizer, ksets::SearchParameter, ksets::OptimizerConfig, ksets::OptimizerAlgorithm;
+using ksets::SuccessiveHalving, ksets::HalvingConfig, ksets::HalvingTrial;
+using ksets::Individual, ksets::K3, ksets::K3Config, ksets::numeric, ksets::rngseed;
+
+namespace {
+    constexpr const char *CHECKPOINT_MAGIC = "ksets-optimizer-checkpoint";
+    constexpr int CHECKPOINT_VERSION = 1;
+
+    rngseed splitmix64(rngseed x) noexcept {
+        x += 0x9e3779b97f4a7c15;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    numeric clamp01(numeric x) noexcept {
+        return std::min(std::max(x, static_cast<numeric>(0)), static_cast<numeric>(1));
+    }
+
+    bool betterThan(const Individual& a, const Individual& b) noexcept {
+        return a.fitness > b.fitness;
+    }
+
+    template<typename T>
+    void writeVector(std::ostream& os, const std::vector<T>& values) {
+        os << values.size();
+        for (auto value : values)
+            os << ' ' << value;
+        os << '\n';
+    }
+
+    // throws before allocating anything if the stored size is larger than maxSize
+    template<typename T>
+    void readVector(std::istream& is, std::vector<T>& values, std::size_t maxSize) {
+        std::size_t n = 0;
+        is >> n;
+        if (n > maxSize)
+            throw std::runtime_error("Malformed optimizer checkpoint: vector is longer than expected");
+        values.resize(n);
+        for (auto& value : values)
+            is >> value;
+    }
+
+    void expect(std::istream& is, const std::string& label) {
+        std::string actual;
+        is >> actual;
+        if (actual != label)
+            throw std::runtime_error("Malformed optimizer checkpoint: expected \"" + label + "\"");
+    }
+
+    // Sign constraints come from checkWeightsValidity itself: both ends of every range must keep
+    // an otherwise valid config valid, and a range cannot cross 0 since no weight may be 0.
+    void validateSearchSpace(const K3Config& baseConfig, const std::vector<SearchParameter>& parameters) {
+        if (parameters.empty())
+            throw std::invalid_argument("At least one parameter must be optimized");
+        if (!baseConfig.checkWeightsValidity())
+            throw std::invalid_argument("Base K3 config weights are invalid");
+        for (auto& parameter : parameters) {
+            if (!(parameter.lowerBound <= parameter.upperBound) || parameter.lowerBound * parameter.upperBound <= 0)
+                throw std::invalid_argument("Bounds of parameter " + parameter.name + " must be ordered and have the same sign");
+            for (numeric bound : {parameter.lowerBound, parameter.upperBound}) {
+                K3Config probe = baseConfig;
+                parameter.field(probe) = bound;
+                if (!probe.checkWeightsValidity())
+                    throw std::invalid_argument("Bounds of parameter " + parameter.name + " have the wrong sign");
+            }
+        }
+    }
+
+    K3Config genesToConfig(
+        const K3Config& baseConfig,
+        const std::vector<SearchParameter>& parameters,
+        const std::vector<numeric>& genes
+    ) {
+        K3Config result = baseConfig;
+        for (std::size_t i = 0; i < parameters.size(); i++) {
+            auto& parameter = parameters[i];
+            parameter.field(result) = parameter.lowerBound + clamp01(genes[i]) * (parameter.upperBound - parameter.lowerBound);
+        }
+        return result;
+    }
+
+    void writeIndividual(std::ostream& os, const Individual& individual) {
+        os << individual.fitness << ' ';
+        writeVector(os, individual.genes);
+    }
+
+    // fitness is written as text, which may be "-inf"
+    void readIndividual(std::istream& is, Individual& individual, std::size_t numGenes) {
+        std::string fitness;
+        is >> fitness;
+        individual.fitness = std::strtof(fitness.c_str(), nullptr);
+        readVector(is, individual.genes, numGenes);
+    }
+}
+
+std::vector<SearchParameter> ksets::defaultSearchParameters() {
+    return {
+        {"wOB_AON", [](K3Config& c) -> numeric& { return c.wOB_AON_lot; }, 1, 8},
+        {"wOB_PC", [](K3Config& c) -> numeric& { return c.wOB_PC_lot; }, 1, 8},
+        {"wAON_OB", [](K3Config& c) -> numeric& { return c.wAON_OB_toAntipodal; }, 1, 8},
+        {"wAON_PG", [](K3Config& c) -> numeric& { return c.wAON_PG_mot; }, 1, 8},
+        {"wPC_AON", [](K3Config& c) -> numeric& { return c.wPC_AON_toAntipodal; }, 1, 8},
+        {"wDPC_OB", [](K3Config& c) -> numeric& { return c.wDPC_OB_toAntipodal; }, 1, 8},
+        {"wDPC_PC", [](K3Config& c) -> numeric& { return c.wDPC_PC; }, 1, 8},
+        {"wPC_DPC", [](K3Config& c) -> numeric& { return c.wPC_DPC; }, -5, -1},
+        {"wOB_LAT_E", [](K3Config& c) -> numeric& { return c.wOB_inter[0]; }, 1, 8},
+        {"wOB_LAT_I", [](K3Config& c) -> numeric& { return c.wOB_inter[1]; }, -5, -1},
+    };
+}
+
+PopulationOptimizer::PopulationOptimizer(
+    K3Config baseConfig,
+    std::vector<SearchParameter> parameters,
+    OptimizerConfig config,
+    Fitness fitness
+):
+    baseConfig(baseConfig),
+    parameters(std::move(parameters)),
+    config(config),
+    fitness(std::move(fitness)),
+    rng(config.seed)
+{
+    if (config.algorithm == OptimizerAlgorithm::GENETIC && config.populationSize <= config.eliteCount)
+        throw std::invalid_argument("Population size must be greater than the elite count");
+    if (config.algorithm == OptimizerAlgorithm::CMA_ES && config.populationSize < 4)
+        throw std::invalid_argument("CMA-ES needs a population of at least 4");
+    if (config.tournamentSize == 0)
+        throw std::invalid_argument("Tournament size cannot be 0");
+
+    validateSearchSpace(baseConfig, this->parameters);
+}
+
+K3Config PopulationOptimizer::toConfig(const std::vector<numeric>& genes) const {
+    return genesToConfig(baseConfig, parameters, genes);
+}
+
+// evaluates population[first:] in parallel
+void PopulationOptimizer::evaluate(std::size_t first) {
+    ksets::parallelFor(config.numThreads, population.size() - first, [this, first](std::size_t offset) {
+        std::size_t i = first + offset;
+        auto& individual = population[i];
+        K3Config candidate = toConfig(individual.genes);
+        rngseed seed = splitmix64(splitmix64(config.seed ^ generation) ^ i);
+        numeric value;
+        try {
+            value = candidate.checkWeightsValidity() ? fitness(candidate, seed) : -std::numeric_limits<numeric>::infinity();
+        } catch (...) {
+            value = -std::numeric_limits<numeric>::infinity();
+        }
+        individual.fitness = std::isnan(value) ? -std::numeric_limits<numeric>::infinity() : value;
+    });
+
+    for (std::size_t i = first; i < population.size(); i++)
+        if (best.genes.empty() || betterThan(population[i], best))
+            best = population[i];
+}
+
+void PopulationOptimizer::initializeGenetic() {
+    std::uniform_real_distribution<numeric> uniform(0, 1);
+    population.assign(config.populationSize, Individual());
+    for (auto& individual : population) {
+        individual.genes.resize(numParameters());
+        for (auto& gene : individual.genes)
+            gene = uniform(rng);
+    }
+    evaluate(0);
+}
+
+const Individual& PopulationOptimizer::tournament() {
+    std::uniform_int_distribution<std::size_t> pick(0, population.size() - 1);
+    const Individual *winner = &population[pick(rng)];
+    for (std::size_t i = 1; i < config.tournamentSize; i++) {
+        const Individual *challenger = &population[pick(rng)];
+        if (betterThan(*challenger, *winner))
+            winner = challenger;
+    }
+    return *winner;
+}
+
+void PopulationOptimizer::nextGenerationGenetic() {
+    std::sort(population.begin(), population.end(), betterThan);
+
+    std::uniform_real_distribution<numeric> uniform(0, 1);
+    std::normal_distribution<numeric> mutation(0, config.mutationScale);
+
+    std::vector<Individual> offspring(population.begin(), population.begin() + config.eliteCount);
+    while (offspring.size() < config.populationSize) {
+        const Individual& first = tournament();
+        const Individual& second = tournament();
+        Individual child;
+        child.genes = first.genes;
+        if (uniform(rng) < config.crossoverRate) {
+            for (std::size_t i = 0; i < numParameters(); i++) {
+                numeric alpha = uniform(rng);
+                child.genes[i] = alpha * first.genes[i] + (1 - alpha) * second.genes[i];
+            }
+        }
+        for (auto& gene : child.genes)
+            if (uniform(rng) < config.mutationRate)
+                gene = clamp01(gene + mutation(rng));
+        offspring.push_back(std::move(child));
+    }
+    population = std::move(offspring);
+    evaluate(config.eliteCount);
+}
+
+void PopulationOptimizer::initializeCmaEs() {
+    std::size_t n = numParameters();
+    sigma = config.initialStepSize;
+    mean.assign(n, 0.5);
+    covarianceDiagonal.assign(n, 1);
+    sigmaPath.assign(n, 0);
+    covariancePath.assign(n, 0);
+    sampleCmaEs();
+}
+
+void PopulationOptimizer::sampleCmaEs() {
+    std::normal_distribution<numeric> normal(0, 1);
+    population.assign(config.populationSize, Individual());
+    for (auto& individual : population) {
+        individual.genes.resize(numParameters());
+        for (std::size_t i = 0; i < numParameters(); i++)
+            individual.genes[i] = clamp01(mean[i] + sigma * std::sqrt(covarianceDiagonal[i]) * normal(rng));
+    }
+    evaluate(0);
+}
+
+// Hansen's "The CMA Evolution Strategy: A Tutorial" default parameters, with the learning
+// rates of the covariance scaled up by (n+2)/3 as in Ros & Hansen's separable variant.
+// Out of bounds samples were clamped, and are treated as if they had been sampled there.
+void PopulationOptimizer::updateCmaEs() {
+    std::sort(population.begin(), population.end(), betterThan);
+
+    std::size_t numGenes = numParameters();
+    numeric n = numGenes;
+    std::size_t mu = population.size() / 2;
+    std::vector<numeric> weights(mu);
+    for (std::size_t i = 0; i < mu; i++)
+        weights[i] = std::log(mu + 0.5) - std::log(i + 1.0);
+    numeric weightSum = 0;
+    for (auto w : weights)
+        weightSum += w;
+    numeric weightSquaredSum = 0;
+    for (auto& w : weights) {
+        w /= weightSum;
+        weightSquaredSum += w * w;
+    }
+    numeric muEff = 1 / weightSquaredSum;
+
+    numeric cSigma = (muEff + 2) / (n + muEff + 5);
+    numeric dSigma = 1 + 2 * std::max(static_cast<numeric>(0), std::sqrt((muEff - 1) / (n + 1)) - 1) + cSigma;
+    numeric cc = (4 + muEff / n) / (n + 4 + 2 * muEff / n);
+    numeric c1 = 2 / ((n + 1.3) * (n + 1.3) + muEff);
+    numeric cMu = std::min(1 - c1, 2 * (muEff - 2 + 1 / muEff) / ((n + 2) * (n + 2) + muEff));
+    c1 = std::min(static_cast<numeric>(1), c1 * (n + 2) / 3);
+    cMu = std::min(1 - c1, cMu * (n + 2) / 3);
+    numeric chiN = std::sqrt(n) * (1 - 1 / (4 * n) + 1 / (21 * n * n));
+
+    std::vector<numeric> oldMean = mean;
+    for (std::size_t j = 0; j < numGenes; j++) {
+        mean[j] = 0;
+        for (std::size_t i = 0; i < mu; i++)
+            mean[j] += weights[i] * population[i].genes[j];
+    }
+
+    numeric sigmaPathNormSquared = 0;
+    for (std::size_t j = 0; j < numGenes; j++) {
+        numeric meanStep = (mean[j] - oldMean[j]) / sigma;
+        sigmaPath[j] = (1 - cSigma) * sigmaPath[j]
+            + std::sqrt(cSigma * (2 - cSigma) * muEff) * meanStep / std::sqrt(covarianceDiagonal[j]);
+        sigmaPathNormSquared += sigmaPath[j] * sigmaPath[j];
+    }
+    numeric sigmaPathNorm = std::sqrt(sigmaPathNormSquared);
+    bool hSigma = sigmaPathNorm / std::sqrt(1 - std::pow(1 - cSigma, 2 * (generation + 1))) < (1.4 + 2 / (n + 1)) * chiN;
+
+    for (std::size_t j = 0; j < numGenes; j++) {
+        numeric meanStep = (mean[j] - oldMean[j]) / sigma;
+        covariancePath[j] = (1 - cc) * covariancePath[j] + (hSigma ? std::sqrt(cc * (2 - cc) * muEff) * meanStep : 0);
+        numeric rankMu = 0;
+        for (std::size_t i = 0; i < mu; i++) {
+            numeric y = (population[i].genes[j] - oldMean[j]) / sigma;
+            rankMu += weights[i] * y * y;
+        }
+        covarianceDiagonal[j] = (1 - c1 - cMu) * covarianceDiagonal[j]
+            + c1 * (covariancePath[j] * covariancePath[j] + (hSigma ? 0 : cc * (2 - cc) * covarianceDiagonal[j]))
+            + cMu * rankMu;
+    }
+    sigma *= std::exp((cSigma / dSigma) * (sigmaPathNorm / chiN - 1));
+}
+
+void PopulationOptimizer::step() {
+    if (population.empty()) {
+        if (config.algorithm == OptimizerAlgorithm::GENETIC)
+            initializeGenetic();
+        else
+            initializeCmaEs();
+    } else if (config.algorithm == OptimizerAlgorithm::GENETIC) {
+        nextGenerationGenetic();
+    } else {
+        updateCmaEs();
+        sampleCmaEs();
+    }
+    generation++;
+}
+
+void PopulationOptimizer::run() {
+    while (generation < config.numGenerations) {
+        step();
+        if (!config.checkpointPath.empty() && config.checkpointInterval > 0 && generation % config.checkpointInterval == 0)
+            saveCheckpoint(config.checkpointPath);
+    }
+}
+
+void PopulationOptimizer::saveCheckpoint(const std::string& path) const {
+    // written to a temporary file first so that a crash mid-write keeps the previous checkpoint
+    std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream ofs(temporaryPath);
+        if (!ofs)
+            throw std::runtime_error("Could not open checkpoint file " + temporaryPath);
+        ofs.precision(std::numeric_limits<numeric>::max_digits10);
+
+        ofs << CHECKPOINT_MAGIC << ' ' << CHECKPOINT_VERSION << '\n';
+        ofs << "algorithm " << static_cast<int>(config.algorithm) << '\n';
+        ofs << "parameters " << numParameters();
+        for (auto& parameter : parameters)
+            ofs << ' ' << parameter.name;
+        ofs << '\n';
+        ofs << "generation " << generation << '\n';
+        ofs << "rng " << rng << '\n';
+        ofs << "best ";
+        writeIndividual(ofs, best);
+        ofs << "population " << population.size() << '\n';
+        for (auto& individual : population)
+            writeIndividual(ofs, individual);
+        ofs << "sigma " << sigma << '\n';
+        ofs << "mean ";
+        writeVector(ofs, mean);
+        ofs << "covariance ";
+        writeVector(ofs, covarianceDiagonal);
+        ofs << "sigmaPath ";
+        writeVector(ofs, sigmaPath);
+        ofs << "covariancePath ";
+        writeVector(ofs, covariancePath);
+        if (!ofs)
+            throw std::runtime_error("Could not write checkpoint file " + temporaryPath);
+    }
+    if (std::rename(temporaryPath.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Could not replace checkpoint file " + path);
+}
+
+void PopulationOptimizer::loadCheckpoint(const std::string& path) {
+    std::ifstream ifs(path);
+    if (!ifs)
+        throw std::runtime_error("Could not open checkpoint file " + path);
+
+    int version;
+    expect(ifs, CHECKPOINT_MAGIC);
+    ifs >> version;
+    if (version != CHECKPOINT_VERSION)
+        throw std::runtime_error("Unsupported optimizer checkpoint version");
+
+    int algorithm;
+    expect(ifs, "algorithm");
+    ifs >> algorithm;
+    if (algorithm != static_cast<int>(config.algorithm))
+        throw std::runtime_error("Checkpoint was made with a different algorithm");
+
+    std::size_t n;
+    expect(ifs, "parameters");
+    ifs >> n;
+    if (n != numParameters())
+        throw std::runtime_error("Checkpoint was made with a different parameter list");
+    for (auto& parameter : parameters) {
+        std::string name;
+        ifs >> name;
+        if (name != parameter.name)
+            throw std::runtime_error("Checkpoint was made with a different parameter list");
+    }
+
+    expect(ifs, "generation");
+    ifs >> generation;
+    expect(ifs, "rng");
+    ifs >> rng;
+    expect(ifs, "best");
+    readIndividual(ifs, best, n);
+
+    // read one by one, so a corrupt count runs out of input instead of memory
+    std::size_t populationSize = 0;
+    expect(ifs, "population");
+    ifs >> populationSize;
+    population.clear();
+    while (ifs && population.size() < populationSize) {
+        Individual individual;
+        readIndividual(ifs, individual, n);
+        population.push_back(std::move(individual));
+    }
+
+    expect(ifs, "sigma");
+    ifs >> sigma;
+    expect(ifs, "mean");
+    readVector(ifs, mean, n);
+    expect(ifs, "covariance");
+    readVector(ifs, covarianceDiagonal, n);
+    expect(ifs, "sigmaPath");
+    readVector(ifs, sigmaPath, n);
+    expect(ifs, "covariancePath");
+    readVector(ifs, covariancePath, n);
+
+    if (!ifs)
+        throw std::runtime_error("Malformed optimizer checkpoint " + path);
+
+    // the next step breeds or updates from what was loaded, which must be what a step could have left behind
+    auto complete = [n](const std::vector<numeric>& values) { return values.size() == n; };
+    bool valid = generation == 0 || !population.empty();
+    for (auto& individual : population)
+        valid = valid && complete(individual.genes);
+    if (!population.empty()) {
+        valid = valid && complete(best.genes);
+        if (config.algorithm == OptimizerAlgorithm::GENETIC) {
+            valid = valid && population.size() > config.eliteCount;
+        } else {
+            // updateCmaEs recombines the better half, which must not be empty
+            valid = valid && population.size() >= 2 && std::isfinite(sigma) && sigma > 0
+                && complete(mean) && complete(covarianceDiagonal) && complete(sigmaPath) && complete(covariancePath);
+        }
+    }
+    if (!valid)
+        throw std::runtime_error("Malformed optimizer checkpoint " + path);
+}
+
+std::size_t PopulationOptimizer::getGeneration() const noexcept {
+    return generation;
+}
+
+const std::vector<Individual>& PopulationOptimizer::getPopulation() const noexcept {
+    return population;
+}
+
+const Individual& PopulationOptimizer::getBest() const noexcept {
+    return best;
+}
+
+K3Config PopulationOptimizer::getBestConfig() const {
+    return toConfig(best.genes);
+}
+
+SuccessiveHalving::SuccessiveHalving(
+    K3Config baseConfig,
+    std::vector<SearchParameter> parameters,
+    HalvingConfig config,
+    Build build,
+    Advance advance
+):
+    baseConfig(baseConfig),
+    parameters(std::move(parameters)),
+    config(config),
+    build(std::move(build)),
+    advance(std::move(advance)),
+    rng(config.seed)
+{
+    if (config.numRungs == 0)
+        throw std::invalid_argument("Number of rungs cannot be 0");
+    if (config.reductionFactor < 2)
+        throw std::invalid_argument("Reduction factor must be at least 2");
+    validateSearchSpace(baseConfig, this->parameters);
+}
+
+K3Config SuccessiveHalving::toConfig(const std::vector<numeric>& genes) const {
+    return genesToConfig(baseConfig, parameters, genes);
+}
+
+void SuccessiveHalving::runBracket(std::size_t numCandidates, std::size_t firstCut) {
+    struct Candidate {
+        std::size_t trial;
+        rngseed seed;
+        std::unique_ptr<K3> model;
+    };
+
+    std::uniform_real_distribution<numeric> uniform(0, 1);
+    std::vector<Candidate> active;
+    for (std::size_t i = 0; i < numCandidates; i++) {
+        HalvingTrial trial;
+        trial.genes.resize(parameters.size());
+        for (auto& gene : trial.genes)
+            gene = uniform(rng);
+        trials.push_back(std::move(trial));
+        active.push_back({trials.size() - 1, splitmix64(config.seed ^ splitmix64(numCandidatesSampled++)), nullptr});
+    }
+
+    for (std::size_t rung = 0; rung < config.numRungs && !active.empty(); rung++) {
+        ksets::parallelFor(config.numThreads, active.size(), [this, &active, rung](std::size_t i) {
+            Candidate& candidate = active[i];
+            HalvingTrial& trial = trials[candidate.trial];
+            numeric value;
+            try {
+                // built lazily, so building is spread over the threads too
+                if (!candidate.model)
+                    candidate.model = build(toConfig(trial.genes), candidate.seed);
+                value = advance(*candidate.model, rung);
+            } catch (...) {
+                value = -std::numeric_limits<numeric>::infinity();
+            }
+            trial.fitness = std::isnan(value) ? -std::numeric_limits<numeric>::infinity() : value;
+            trial.rungsCompleted = rung + 1;
+        });
+        numRungsRun += active.size();
+
+        // candidates that failed go right away, whether or not this rung cuts
+        active.erase(
+            std::remove_if(active.begin(), active.end(), [this](const Candidate& candidate) {
+                return trials[candidate.trial].fitness == -std::numeric_limits<numeric>::infinity();
+            }),
+            active.end()
+        );
+        if (rung < firstCut || rung + 1 == config.numRungs)
+            continue;
+        std::stable_sort(active.begin(), active.end(), [this](const Candidate& a, const Candidate& b) {
+            return trials[a.trial].fitness > trials[b.trial].fitness;
+        });
+        active.resize(std::min(active.size(), std::max<std::size_t>(active.size() / config.reductionFactor, 1)));
+    }
+}
+
+void SuccessiveHalving::runSuccessiveHalving() {
+    runBracket(config.numCandidates, 0);
+}
+
+void SuccessiveHalving::runHyperband() {
+    // bracket s makes s cuts, starting with eta^s candidates scaled so every bracket costs about the same
+    std::size_t maxCuts = config.numRungs - 1;
+    for (std::size_t s = maxCuts + 1; s-- > 0;) {
+        numeric numCandidates = static_cast<numeric>(maxCuts + 1) / (s + 1) * std::pow(static_cast<numeric>(config.reductionFactor), s);
+        runBracket(static_cast<std::size_t>(std::ceil(numCandidates)), maxCuts - s);
+    }
+}
+
+const std::vector<HalvingTrial>& SuccessiveHalving::getTrials() const noexcept {
+    return trials;
+}
+
+const HalvingTrial& SuccessiveHalving::getBest() const {
+    if (trials.empty())
+        throw std::logic_error("No candidate was evaluated yet");
+    return *std::max_element(trials.begin(), trials.end(), [](const HalvingTrial& a, const HalvingTrial& b) {
+        if (a.rungsCompleted != b.rungsCompleted)
+            return a.rungsCompleted < b.rungsCompleted;
+        return a.fitness < b.fitness;
+    });
+}
+
+K3Config SuccessiveHalving::getBestConfig() const {
+    return toConfig(getBest().genes);
+}
+
+std::size_t SuccessiveHalving::getNumRungsRun() const noexcept {
+    return numRungsRun;
+}
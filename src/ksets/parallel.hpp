@@ -0,0 +1,42 @@
+#pragma once
+
+// Not installed with the library: shared by the translation units that spread independent work over threads.
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace ksets {
+    // Runs a worker for every i in [0, count) on up to numThreads threads, 0 meaning one per hardware thread,
+    // handing out indices one at a time so uneven tasks still balance. Each thread calls makeWorker() once and
+    // runs what it returns for every index it takes, so a worker can keep state across them, e.g. a model.
+    // The calling thread is one of the threads.
+    template<typename MakeWorker>
+    void parallelForWithWorkers(std::size_t numThreads, std::size_t count, MakeWorker makeWorker) {
+        if (numThreads == 0)
+            numThreads = std::max(1u, std::thread::hardware_concurrency());
+        numThreads = std::min(numThreads, count);
+
+        std::atomic<std::size_t> next {0};
+        auto run = [&next, count, &makeWorker]() {
+            auto worker = makeWorker();
+            std::size_t i;
+            while ((i = next.fetch_add(1)) < count)
+                worker(i);
+        };
+        std::vector<std::thread> threads;
+        for (std::size_t t = 1; t < numThreads; t++)
+            threads.emplace_back(run);
+        run();
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    // runs task(i) for every i in [0, count), as above
+    template<typename Task>
+    void parallelFor(std::size_t numThreads, std::size_t count, const Task& task) {
+        parallelForWithWorkers(numThreads, count, [&task]() { return std::ref(task); });
+    }
+}
@@ -0,0 +1,360 @@
+#include "ksets/k3.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <thread>
+
+using ksets::K0, ksets::K0Config, ksets::K3, ksets::PartitionConfig, ksets::PartitionPlan;
+using ksets::numeric, ksets::RunStatus;
+
+// translation unit "private" types and functions
+namespace {
+    struct Edge {
+        std::size_t source;
+        std::size_t target;
+        std::size_t delay;
+    };
+
+    // Kosaraju's algorithm. Returns the strongly connected component of every vertex, numbered in order of
+    // their smallest vertex.
+    std::vector<std::size_t> stronglyConnectedComponents(std::size_t numVertices, const std::vector<Edge>& edges) {
+        std::vector<std::vector<std::size_t>> forward(numVertices), backward(numVertices);
+        for (auto& edge : edges) {
+            forward[edge.source].push_back(edge.target);
+            backward[edge.target].push_back(edge.source);
+        }
+
+        std::vector<std::size_t> finishOrder;
+        std::vector<bool> visited(numVertices, false);
+        std::vector<std::pair<std::size_t, std::size_t>> stack;
+        for (std::size_t start = 0; start < numVertices; start++) {
+            if (visited[start])
+                continue;
+            visited[start] = true;
+            stack.push_back({start, 0});
+            while (!stack.empty()) {
+                auto& [vertex, next] = stack.back();
+                if (next < forward[vertex].size()) {
+                    std::size_t neighbour = forward[vertex][next++];
+                    if (!visited[neighbour]) {
+                        visited[neighbour] = true;
+                        stack.push_back({neighbour, 0});
+                    }
+                } else {
+                    finishOrder.push_back(vertex);
+                    stack.pop_back();
+                }
+            }
+        }
+
+        constexpr std::size_t UNASSIGNED = -1;
+        std::vector<std::size_t> component(numVertices, UNASSIGNED);
+        std::size_t numComponents = 0;
+        std::vector<std::size_t> pending;
+        for (auto root = finishOrder.rbegin(); root != finishOrder.rend(); root++) {
+            if (component[*root] != UNASSIGNED)
+                continue;
+            component[*root] = numComponents;
+            pending.push_back(*root);
+            while (!pending.empty()) {
+                std::size_t vertex = pending.back();
+                pending.pop_back();
+                for (std::size_t neighbour : backward[vertex]) {
+                    if (component[neighbour] == UNASSIGNED) {
+                        component[neighbour] = numComponents;
+                        pending.push_back(neighbour);
+                    }
+                }
+            }
+            numComponents++;
+        }
+
+        // renumber by smallest vertex, so results do not depend on traversal order
+        std::vector<std::size_t> renumbered(numComponents, UNASSIGNED);
+        std::size_t nextNumber = 0;
+        for (std::size_t vertex = 0; vertex < numVertices; vertex++)
+            if (renumbered[component[vertex]] == UNASSIGNED)
+                renumbered[component[vertex]] = nextNumber++;
+        for (auto& c : component)
+            c = renumbered[c];
+        return component;
+    }
+
+    // Values a connection's source produced, from `delay` iterations before the run started onwards.
+    // Written by the source partition's worker and read by the target partition's.
+    struct Link {
+        std::size_t sourcePartition;
+        std::size_t targetPartition;
+        K0 *source;
+        std::shared_ptr<K0> mirror;
+        std::size_t delay;
+        std::vector<numeric> ring;
+
+        numeric& at(int64_t time) noexcept {
+            return ring[static_cast<std::size_t>(time + static_cast<int64_t>(delay)) % ring.size()];
+        }
+    };
+
+    struct Redirection {
+        K0 *target;
+        std::size_t connectionIndex;
+        K0 *source;
+        std::size_t delay;
+    };
+
+    // Stops and joins a partitioned run's workers, then points the cut connections back at their sources,
+    // however the run ends.
+    struct RunCleanup {
+        std::vector<Redirection> redirections;
+        std::vector<std::thread> threads;
+        std::atomic<bool> stop{false};
+
+        ~RunCleanup() {
+            stop.store(true, std::memory_order_release);
+            for (auto& thread : threads)
+                thread.join();
+            for (auto& redirection : redirections)
+                redirection.target->redirectConnection(redirection.connectionIndex, *redirection.source, redirection.delay);
+        }
+    };
+
+    struct Partition {
+        std::vector<std::size_t> components;
+        std::size_t numNodes = 0;
+        std::vector<Link *> inbound;
+        std::vector<Link *> outbound;
+    };
+}
+
+PartitionPlan K3::planPartitions(std::size_t minCutDelay) const {
+    std::map<const K0 *, std::size_t> componentOf;
+    for (std::size_t component = 0; component < numComponents(); component++)
+        for (auto& node : componentNodes(component))
+            componentOf.emplace(node.get(), component);
+
+    std::vector<Edge> edges, shortEdges;
+    for (auto& [target, targetComponent] : componentOf) {
+        for (auto& connection : *target) {
+            auto source = componentOf.find(connection.source);
+            if (source == componentOf.end() || source->second == targetComponent)
+                continue;
+            edges.push_back({source->second, targetComponent, connection.delay});
+            if (connection.delay < minCutDelay)
+                shortEdges.push_back(edges.back());
+        }
+    }
+
+    PartitionPlan plan;
+    std::vector<std::size_t> partitionOf = stronglyConnectedComponents(numComponents(), shortEdges);
+    for (std::size_t component = 0; component < numComponents(); component++) {
+        if (partitionOf[component] >= plan.partitions.size())
+            plan.partitions.resize(partitionOf[component] + 1);
+        plan.partitions[partitionOf[component]].push_back(component);
+    }
+
+    // a cut connection is part of a cycle if its partitions are strongly connected through any connections
+    std::vector<Edge> partitionEdges;
+    for (auto& edge : edges)
+        if (partitionOf[edge.source] != partitionOf[edge.target])
+            partitionEdges.push_back({partitionOf[edge.source], partitionOf[edge.target], edge.delay});
+    std::vector<std::size_t> cycleOf = stronglyConnectedComponents(plan.partitions.size(), partitionEdges);
+    plan.numCutConnections = partitionEdges.size();
+    for (auto& edge : partitionEdges)
+        if (cycleOf[edge.source] == cycleOf[edge.target] && edge.delay >= minCutDelay
+                && (plan.minFeedbackDelay == 0 || edge.delay < plan.minFeedbackDelay))
+            plan.minFeedbackDelay = edge.delay;
+    return plan;
+}
+
+RunStatus K3::restPartitioned(numeric milliseconds, PartitionConfig partitionConfig) {
+    eraseExternalStimulus();
+    return runPartitioned(milliseconds, partitionConfig);
+}
+
+RunStatus K3::runPartitioned(numeric milliseconds, PartitionConfig partitionConfig) {
+    if (runStatus != RunStatus::OK)
+        return runStatus;
+
+    std::size_t iterations = ksets::odeMillisecondsToIters(milliseconds);
+    bool iterationBudgetExceeded = false;
+    if (config.maxRunIterations > 0 && iterationsRun + iterations > config.maxRunIterations) {
+        iterations = config.maxRunIterations - std::min(iterationsRun, config.maxRunIterations);
+        iterationBudgetExceeded = true;
+    }
+
+    PartitionPlan plan = planPartitions(partitionConfig.minCutDelay);
+    std::size_t numPartitions = plan.partitions.size();
+    std::vector<Partition> partitions(numPartitions);
+    std::map<const K0 *, std::size_t> partitionOf;
+    for (std::size_t p = 0; p < numPartitions; p++) {
+        partitions[p].components = plan.partitions[p];
+        for (std::size_t component : plan.partitions[p]) {
+            for (auto& node : componentNodes(component)) {
+                partitionOf.emplace(node.get(), p);
+                partitions[p].numNodes++;
+            }
+        }
+    }
+
+    std::size_t numThreads = partitionConfig.numThreads;
+    if (numThreads == 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    numThreads = std::min(numThreads, numPartitions);
+    // largest partitions first, each to the least loaded worker
+    std::vector<std::size_t> bySize(numPartitions);
+    for (std::size_t p = 0; p < numPartitions; p++)
+        bySize[p] = p;
+    std::stable_sort(bySize.begin(), bySize.end(), [&partitions](std::size_t a, std::size_t b) {
+        return partitions[a].numNodes > partitions[b].numNodes;
+    });
+    std::vector<std::vector<std::size_t>> owned(numThreads);
+    std::vector<std::size_t> load(numThreads, 0);
+    for (std::size_t p : bySize) {
+        std::size_t worker = std::min_element(load.begin(), load.end()) - load.begin();
+        owned[worker].push_back(p);
+        load[worker] += partitions[p].numNodes;
+    }
+
+    std::vector<std::atomic<int64_t>> progress(numPartitions);
+    for (auto& done : progress)
+        done.store(0);
+    // how far the workers may go before the next check point
+    std::atomic<int64_t> target(0);
+    int64_t maxLead = static_cast<int64_t>(partitionConfig.maxLead);
+
+    auto tryStep = [this, &partitions, &progress, maxLead](std::size_t p) {
+        Partition& partition = partitions[p];
+        int64_t now = progress[p].load(std::memory_order_relaxed);
+        for (Link *link : partition.inbound)
+            if (progress[link->sourcePartition].load(std::memory_order_acquire) < now - static_cast<int64_t>(link->delay))
+                return false;
+        for (Link *link : partition.outbound)
+            if (now + 1 > progress[link->targetPartition].load(std::memory_order_acquire) + maxLead)
+                return false;
+
+        for (Link *link : partition.inbound)
+            link->mirror->relayOutput(link->at(now - static_cast<int64_t>(link->delay)));
+        for (std::size_t component : partition.components)
+            calculateComponentNextState(component);
+        for (std::size_t component : partition.components)
+            commitComponentNextState(component);
+        for (Link *link : partition.outbound)
+            link->at(now + 1) = link->source->getCurrentOutput();
+        progress[p].store(now + 1, std::memory_order_release);
+        return true;
+    };
+
+    // steps a thread's partitions until every one of them reaches until
+    auto advance = [&owned, &progress, &tryStep](std::size_t thread, int64_t until) {
+        while (true) {
+            bool finished = true;
+            bool advanced = false;
+            for (std::size_t p : owned[thread]) {
+                while (progress[p].load(std::memory_order_relaxed) < until && tryStep(p))
+                    advanced = true;
+                finished = finished && progress[p].load(std::memory_order_relaxed) >= until;
+            }
+            if (finished)
+                break;
+            if (!advanced)
+                std::this_thread::yield();
+        }
+    };
+
+    // every cut connection reads from a mirror, one per (source, target partition, delay)
+    std::vector<std::unique_ptr<Link>> links;
+    std::map<std::tuple<const K0 *, std::size_t, std::size_t>, Link *> linkIndex;
+    // declared after everything the workers and the redirected connections use, so it runs first
+    RunCleanup cleanup;
+    std::map<const K0 *, K0 *> mutableNodes;
+    forEachNode([&mutableNodes](const std::shared_ptr<K0>& node) { mutableNodes.emplace(node.get(), node.get()); });
+    for (auto& [node, nodePartition] : partitionOf) {
+        K0 *target = mutableNodes.at(node);
+        for (std::size_t i = 0; i < target->numInboundConnections(); i++) {
+            auto connection = target->connectionAt(i);
+            auto source = partitionOf.find(connection.source);
+            if (source == partitionOf.end() || source->second == nodePartition)
+                continue;
+
+            auto key = std::make_tuple(static_cast<const K0 *>(connection.source), nodePartition, std::size_t(connection.delay));
+            auto existing = linkIndex.find(key);
+            Link *link;
+            if (existing != linkIndex.end()) {
+                link = existing->second;
+            } else {
+                links.push_back(std::make_unique<Link>(Link {
+                    source->second,
+                    nodePartition,
+                    connection.source,
+                    std::make_shared<K0>(K0Config(1)),
+                    connection.delay,
+                    std::vector<numeric>(connection.delay + partitionConfig.maxLead + 2)
+                }));
+                link = links.back().get();
+                linkIndex.emplace(key, link);
+                partitions[source->second].outbound.push_back(link);
+                partitions[nodePartition].inbound.push_back(link);
+                for (int64_t time = -static_cast<int64_t>(link->delay); time <= 0; time++)
+                    link->at(time) = link->source->getDelayedOutput(-time);
+            }
+            cleanup.redirections.push_back({target, i, mutableNodes.at(connection.source), connection.delay});
+            target->redirectConnection(i, *link->mirror, 0);
+        }
+    }
+
+    // the other workers are started once and follow target until told to stop; this thread steps its own
+    // partitions and then waits on every partition's progress before running the checks
+    std::atomic<bool>& stop = cleanup.stop;
+    for (std::size_t t = 1; t < numThreads; t++) {
+        cleanup.threads.emplace_back([&owned, &progress, &tryStep, &target, &stop](std::size_t thread) {
+            while (!stop.load(std::memory_order_acquire)) {
+                int64_t until = target.load(std::memory_order_acquire);
+                bool advanced = false;
+                for (std::size_t p : owned[thread])
+                    while (progress[p].load(std::memory_order_relaxed) < until && tryStep(p))
+                        advanced = true;
+                if (!advanced)
+                    std::this_thread::yield();
+            }
+        }, t);
+    }
+
+    // workers only stop where run would check the set's health
+    bool checksEnabled = config.degeneracyCheckInterval > 0 || config.maxRunWallMilliseconds > 0;
+    std::size_t checkInterval = config.degeneracyCheckInterval;
+    if (checkInterval == 0)
+        checkInterval = DEFAULT_BUDGET_CHECK_INTERVAL;
+
+    std::size_t done = 0;
+    while (done < iterations) {
+        std::size_t length = iterations - done;
+        if (checksEnabled)
+            length = std::min(length, checkInterval - iterationsRun % checkInterval);
+        int64_t until = static_cast<int64_t>(done + length);
+
+        target.store(until, std::memory_order_release);
+        advance(0, until);
+        for (auto& partitionProgress : progress)
+            while (partitionProgress.load(std::memory_order_acquire) < until)
+                std::this_thread::yield();
+
+        done += length;
+        iterationsRun += length;
+        if (iterationsRun % checkInterval != 0)
+            continue;
+        if (config.degeneracyCheckInterval > 0)
+            runStatus = checkRunHealth();
+        if (runStatus == RunStatus::OK && config.maxRunWallMilliseconds > 0) {
+            std::chrono::duration<numeric, std::milli> elapsed = std::chrono::steady_clock::now() - runStart;
+            if (elapsed.count() >= config.maxRunWallMilliseconds)
+                runStatus = RunStatus::TIME_BUDGET_EXCEEDED;
+        }
+        if (runStatus != RunStatus::OK)
+            break;
+    }
+
+    if (runStatus == RunStatus::OK && iterationBudgetExceeded)
+        runStatus = RunStatus::ITERATION_BUDGET_EXCEEDED;
+    return runStatus;
+}
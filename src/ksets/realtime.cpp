@@ -0,0 +1,100 @@
+#include "ksets/realtime.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+
+using ksets::K0, ksets::RealtimeStepper, ksets::RealtimeConfig, ksets::RealtimeStats, ksets::TraceOverflow, ksets::numeric;
+
+std::chrono::nanoseconds RealtimeStats::latencyPercentile(double fraction) const {
+    if (numSteps == 0)
+        throw std::logic_error("No steps were recorded");
+    if (!(fraction >= 0 && fraction <= 1))
+        throw std::invalid_argument("Percentile fraction must be in [0, 1]");
+
+    uint64_t wanted = std::max<uint64_t>(std::ceil(fraction * numSteps), 1);
+    uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < latencyHistogram.size(); bucket++) {
+        seen += latencyHistogram[bucket];
+        if (seen >= wanted)
+            return histogramBucketWidth * (bucket + 1);
+    }
+    return maxLatency;
+}
+
+RealtimeStepper::RealtimeStepper(K3& model, RealtimeConfig config): model(model), config(config) {
+    if (config.pace && config.period.count() <= 0)
+        throw std::invalid_argument("Pacing period must be positive");
+    if (config.histogramBucketWidth.count() <= 0 || config.numHistogramBuckets == 0)
+        throw std::invalid_argument("Latency histogram must have positive bucket width and count");
+    if (model.trace && model.trace->getConfig().overflow == TraceOverflow::BLOCK)
+        throw std::invalid_argument("Cannot step in real time while a blocking trace is running");
+
+    model.forEachNode([](const std::shared_ptr<K0>& node) { node->unshareConnectionParameters(); });
+    latencyHistogram.assign(config.numHistogramBuckets, 0);
+}
+
+bool RealtimeStepper::step(const numeric *stimulus) noexcept {
+    Clock::time_point release;
+    if (config.pace) {
+        if (!started)
+            nextRelease = Clock::now();
+        release = nextRelease;
+        std::this_thread::sleep_until(release);
+    } else {
+        release = Clock::now();
+    }
+    started = true;
+
+    if (stimulus != nullptr) {
+        auto obUnit = model.olfactoryBulb.begin();
+        for (auto& pgUnit : model.periglomerularCells) {
+            pgUnit.setExternalStimulus(*stimulus);
+            obUnit->setExternalStimulus(*stimulus);
+            obUnit++;
+            stimulus++;
+        }
+    } else {
+        model.eraseExternalStimulus();
+    }
+    model.step();
+
+    Clock::time_point finish = Clock::now();
+    Clock::duration latency = finish - release;
+    numSteps++;
+    maxLatency = std::max(maxLatency, latency);
+    std::size_t bucket = latency / config.histogramBucketWidth;
+    latencyHistogram[std::min(bucket, latencyHistogram.size() - 1)]++;
+    bool metDeadline = latency <= config.deadline;
+    if (!metDeadline)
+        numDeadlineMisses++;
+
+    if (config.pace) {
+        nextRelease = release + config.period;
+        if (!config.catchUp && finish > nextRelease) {
+            nextRelease = finish;
+            numResynchronizations++;
+        }
+    }
+    return metDeadline;
+}
+
+RealtimeStats RealtimeStepper::getStats() const {
+    RealtimeStats stats;
+    stats.numSteps = numSteps;
+    stats.numDeadlineMisses = numDeadlineMisses;
+    stats.numResynchronizations = numResynchronizations;
+    stats.maxLatency = std::chrono::duration_cast<std::chrono::nanoseconds>(maxLatency);
+    stats.latencyHistogram = latencyHistogram;
+    stats.histogramBucketWidth = config.histogramBucketWidth;
+    return stats;
+}
+
+void RealtimeStepper::resetStats() noexcept {
+    numSteps = 0;
+    numDeadlineMisses = 0;
+    numResynchronizations = 0;
+    maxLatency = Clock::duration::zero();
+    std::fill(latencyHistogram.begin(), latencyHistogram.end(), 0);
+}
@@ -0,0 +1,369 @@
+#include "ksets/resultstore.hpp"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using ksets::ResultStore, ksets::EvaluationKey, ksets::StoredResult, ksets::K3Config, ksets::numeric;
+
+#ifndef KSETS_VERSION
+#define KSETS_VERSION "unknown"
+#endif
+
+static_assert(sizeof(numeric) == sizeof(float), "Result stores hold float32 values");
+
+// translation unit "private" types and functions
+namespace {
+    constexpr char STORE_MAGIC[8] = "KSETSRJ";
+
+    struct StoreHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+    };
+    static_assert(sizeof(StoreHeader) == 16, "Result store header must have no padding");
+
+    struct RecordHeader {
+        uint32_t keySize;
+        uint32_t numValues;
+        int32_t runStatus;
+        uint32_t reserved;
+        uint64_t checksum;
+    };
+    static_assert(sizeof(RecordHeader) == 24, "Result store record header must have no padding");
+
+    // sanity limit, so a corrupted size cannot make a reader allocate gigabytes
+    constexpr uint32_t MAX_KEY_SIZE = 1 << 20;
+
+    constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325;
+    constexpr uint64_t FNV_PRIME = 0x100000001b3;
+
+    uint64_t fnv1a(const void *data, std::size_t length, uint64_t hash=FNV_OFFSET_BASIS) noexcept {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (std::size_t i = 0; i < length; i++) {
+            hash ^= bytes[i];
+            hash *= FNV_PRIME;
+        }
+        return hash;
+    }
+
+    uint64_t alignUp(uint64_t offset) noexcept {
+        return (offset + 7) / 8 * 8;
+    }
+
+    uint64_t recordChecksum(const RecordHeader& header, const char *key, const numeric *values) noexcept {
+        uint64_t hash = fnv1a(&header, offsetof(RecordHeader, checksum));
+        hash = fnv1a(key, header.keySize, hash);
+        return fnv1a(values, header.numValues * sizeof(numeric), hash);
+    }
+
+    class CanonicalWriter {
+        std::string bytes;
+    public:
+        void put(uint64_t value) {
+            bytes.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        void put(numeric value) {
+            // -0 and 0 configure the same model
+            if (value == 0)
+                value = 0;
+            uint32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            bytes.append(reinterpret_cast<const char *>(&bits), sizeof(bits));
+        }
+
+        void put(const std::string& value) {
+            put(static_cast<uint64_t>(value.size()));
+            bytes.append(value);
+        }
+
+        void put(const ksets::K0Config& config) {
+            put(static_cast<uint64_t>(config.historySize));
+            put(config.sigmoidQ);
+        }
+
+        void put(const ksets::K1Config& config) {
+            put(config.wPrimarySecondary);
+            put(config.wSecondaryPrimary);
+            put(config.k0config);
+        }
+
+        void put(const ksets::K2Config& config) {
+            for (numeric weight : {config.wee, config.wei, config.wie, config.wii})
+                put(weight);
+            put(config.k0config);
+        }
+
+        std::string take() noexcept {
+            return std::move(bytes);
+        }
+    };
+
+    // every field of K3Config, in declaration order; must be extended along with it
+    void putConfig(CanonicalWriter& writer, const K3Config& config) {
+        writer.put(config.wPG_interUnit);
+        writer.put(static_cast<uint64_t>(config.dPG_interUnit));
+        writer.put(config.wPG_intraUnit);
+        writer.put(static_cast<uint64_t>(config.dPG_intraUnit));
+        writer.put(config.wPG_OB);
+        writer.put(static_cast<uint64_t>(config.dPG_OB));
+        writer.put(config.wOB_AON_lot);
+        writer.put(static_cast<uint64_t>(config.dOB_AON_lot));
+        writer.put(config.wOB_PC_lot);
+        writer.put(static_cast<uint64_t>(config.dOB_PC_lot));
+        writer.put(config.wAON_PG_mot);
+        writer.put(static_cast<uint64_t>(config.dAON_PG_mot));
+        writer.put(config.wAON_OB_toAntipodal);
+        writer.put(static_cast<uint64_t>(config.dAON_OB_toAntipodal));
+        writer.put(config.wPC_AON_toAntipodal);
+        writer.put(static_cast<uint64_t>(config.dPC_AON_toAntipodal));
+        writer.put(config.wPC_DPC);
+        writer.put(static_cast<uint64_t>(config.dPC_DPC));
+        writer.put(config.wDPC_PC);
+        writer.put(static_cast<uint64_t>(config.dDPC_PC));
+        writer.put(config.wDPC_OB_toAntipodal);
+        writer.put(static_cast<uint64_t>(config.dDPC_OB_toAntipodal));
+        writer.put(config.noiseAON);
+        writer.put(config.noisePG);
+        writer.put(config.noiseOB);
+        writer.put(config.wOB_unitConfig);
+        writer.put(config.wOB_inter[0]);
+        writer.put(config.wOB_inter[1]);
+        writer.put(config.noiseObLateralWeights);
+        writer.put(config.wAON_unitConfig);
+        writer.put(config.wPC_unitConfig);
+        writer.put(static_cast<uint64_t>(config.outputHistorySize));
+        writer.put(static_cast<uint64_t>(config.outputActivityMonitoring));
+        writer.put(static_cast<uint64_t>(config.nonOutputHistorySize));
+        writer.put(config.noiseInitialK0States);
+        writer.put(static_cast<uint64_t>(config.degeneracyCheckInterval));
+        writer.put(static_cast<uint64_t>(config.degeneracyCheckWindow));
+        writer.put(config.saturationTolerance);
+        writer.put(config.minOutputVariance);
+        writer.put(static_cast<uint64_t>(config.maxRunIterations));
+        writer.put(config.maxRunWallMilliseconds);
+    }
+
+    // holds a flock for as long as it lives
+    class FileLock {
+        int fd;
+    public:
+        FileLock(int fd, int operation): fd(fd) {
+            while (flock(fd, operation) != 0)
+                if (errno != EINTR)
+                    throw std::system_error(errno, std::generic_category(), "Could not lock result store");
+        }
+
+        FileLock(const FileLock& other) = delete;
+
+        ~FileLock() {
+            flock(fd, LOCK_UN);
+        }
+    };
+
+    void writeAllAt(int fd, const void *data, std::size_t length, uint64_t offset, const std::string& path) {
+        const char *cursor = static_cast<const char *>(data);
+        while (length > 0) {
+            ssize_t written = pwrite(fd, cursor, length, offset);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                throw std::system_error(errno, std::generic_category(), "Could not write result store " + path);
+            cursor += written;
+            length -= written;
+            offset += written;
+        }
+    }
+}
+
+const char *ksets::libraryVersion() noexcept {
+    return KSETS_VERSION;
+}
+
+std::string EvaluationKey::canonicalBytes() const {
+    CanonicalWriter writer;
+    writer.put(std::string(libraryVersion()));
+    writer.put(protocol);
+    writer.put(static_cast<uint64_t>(numUnits));
+    writer.put(static_cast<uint64_t>(seed));
+    putConfig(writer, config);
+    return writer.take();
+}
+
+uint64_t EvaluationKey::hash() const {
+    std::string bytes = canonicalBytes();
+    return fnv1a(bytes.data(), bytes.size());
+}
+
+ResultStore::ResultStore(const std::string& path): path(path) {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Could not open result store " + path);
+
+    try {
+        FileLock lock(fd, LOCK_EX);
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+            throw std::system_error(errno, std::generic_category(), "Could not stat result store " + path);
+
+        StoreHeader header;
+        if (info.st_size == 0) {
+            std::memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+            header.version = RESULT_STORE_VERSION;
+            header.reserved = 0;
+            writeAllAt(fd, &header, sizeof(header), 0, path);
+            if (fdatasync(fd) != 0)
+                throw std::system_error(errno, std::generic_category(), "Could not sync result store " + path);
+        } else if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+                || std::memcmp(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0) {
+            throw std::runtime_error(path + " is not a result store");
+        } else if (header.version != RESULT_STORE_VERSION) {
+            throw std::runtime_error("Result store " + path + " has an unsupported version");
+        }
+        validLength = sizeof(StoreHeader);
+        readNewRecords();
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+}
+
+ResultStore::~ResultStore() {
+    close(fd);
+}
+
+bool ResultStore::readNewRecords() {
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+        throw std::system_error(errno, std::generic_category(), "Could not stat result store " + path);
+    uint64_t fileSize = info.st_size;
+    if (fileSize <= validLength)
+        return fileSize == validLength;
+
+    std::string buffer(fileSize - validLength, '\0');
+    std::size_t numRead = 0;
+    while (numRead < buffer.size()) {
+        ssize_t chunk = pread(fd, buffer.data() + numRead, buffer.size() - numRead, validLength + numRead);
+        if (chunk < 0 && errno == EINTR)
+            continue;
+        if (chunk <= 0)
+            break;
+        numRead += chunk;
+    }
+    buffer.resize(numRead);
+
+    std::size_t offset = 0;
+    while (offset + sizeof(RecordHeader) <= buffer.size()) {
+        RecordHeader header;
+        std::memcpy(&header, buffer.data() + offset, sizeof(header));
+        if (header.keySize > MAX_KEY_SIZE || header.numValues > (buffer.size() - offset) / sizeof(numeric))
+            break;
+        std::size_t keyOffset = offset + sizeof(RecordHeader);
+        std::size_t valuesOffset = keyOffset + header.keySize;
+        std::size_t recordEnd = alignUp(valuesOffset + header.numValues * sizeof(numeric));
+        if (recordEnd > buffer.size())
+            break;
+
+        std::vector<numeric> values(header.numValues);
+        std::memcpy(values.data(), buffer.data() + valuesOffset, header.numValues * sizeof(numeric));
+        if (recordChecksum(header, buffer.data() + keyOffset, values.data()) != header.checksum)
+            break;
+
+        std::string key(buffer.data() + keyOffset, header.keySize);
+        uint64_t hash = fnv1a(key.data(), key.size());
+        // concurrent writers check under the lock, but keep the first copy of a key regardless
+        if (lookup(key, hash) == nullptr) {
+            index.emplace(hash, entries.size());
+            entries.push_back({std::move(key), {static_cast<RunStatus>(header.runStatus), std::move(values)}});
+        }
+        offset = recordEnd;
+    }
+    validLength += offset;
+    return validLength == fileSize;
+}
+
+const StoredResult *ResultStore::lookup(const std::string& key, uint64_t hash) const {
+    auto [first, last] = index.equal_range(hash);
+    for (auto entry = first; entry != last; entry++)
+        if (entries[entry->second].first == key)
+            return &entries[entry->second].second;
+    return nullptr;
+}
+
+std::optional<StoredResult> ResultStore::find(const EvaluationKey& key) {
+    std::string bytes = key.canonicalBytes();
+    uint64_t hash = fnv1a(bytes.data(), bytes.size());
+    std::lock_guard<std::mutex> guard(mutex);
+    if (const StoredResult *result = lookup(bytes, hash))
+        return *result;
+
+    FileLock lock(fd, LOCK_SH);
+    readNewRecords();
+    if (const StoredResult *result = lookup(bytes, hash))
+        return *result;
+    return std::nullopt;
+}
+
+bool ResultStore::insert(const EvaluationKey& key, const StoredResult& result) {
+    std::string bytes = key.canonicalBytes();
+    uint64_t hash = fnv1a(bytes.data(), bytes.size());
+    if (bytes.size() > MAX_KEY_SIZE)
+        throw std::invalid_argument("Evaluation key is too long");
+
+    std::lock_guard<std::mutex> guard(mutex);
+    FileLock lock(fd, LOCK_EX);
+    // a record torn by a crashed writer is cut off, so it does not hide the ones after it
+    if (!readNewRecords() && ftruncate(fd, validLength) != 0)
+        throw std::system_error(errno, std::generic_category(), "Could not truncate result store " + path);
+    if (lookup(bytes, hash) != nullptr)
+        return false;
+
+    RecordHeader header;
+    header.keySize = bytes.size();
+    header.numValues = result.values.size();
+    header.runStatus = static_cast<int32_t>(result.runStatus);
+    header.reserved = 0;
+    header.checksum = recordChecksum(header, bytes.data(), result.values.data());
+
+    std::string record(reinterpret_cast<const char *>(&header), sizeof(header));
+    record += bytes;
+    record.append(reinterpret_cast<const char *>(result.values.data()), result.values.size() * sizeof(numeric));
+    record.resize(alignUp(record.size()), '\0');
+    writeAllAt(fd, record.data(), record.size(), validLength, path);
+    if (fdatasync(fd) != 0)
+        throw std::system_error(errno, std::generic_category(), "Could not sync result store " + path);
+
+    validLength += record.size();
+    index.emplace(hash, entries.size());
+    entries.push_back({std::move(bytes), result});
+    return true;
+}
+
+StoredResult ResultStore::findOrEvaluate(const EvaluationKey& key, const std::function<StoredResult()>& evaluate) {
+    if (auto stored = find(key))
+        return *stored;
+    StoredResult result = evaluate();
+    if (insert(key, result))
+        return result;
+    // someone else stored it first
+    return find(key).value_or(result);
+}
+
+void ResultStore::refresh() {
+    std::lock_guard<std::mutex> guard(mutex);
+    FileLock lock(fd, LOCK_SH);
+    readNewRecords();
+}
+
+std::size_t ResultStore::size() {
+    std::lock_guard<std::mutex> guard(mutex);
+    return entries.size();
+}
@@ -0,0 +1,166 @@
+#include "ksets/sensitivity.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <stdexcept>
+
+using ksets::K0, ksets::K3, ksets::K3Config, ksets::K3Sensitivity, ksets::RunStatus, ksets::numeric;
+
+// translation unit "private" types and functions
+namespace {
+    std::size_t requireFields(const std::vector<K3Sensitivity::Field>& fields) {
+        if (fields.empty())
+            throw std::invalid_argument("Need at least one field to differentiate with respect to");
+        return fields.size();
+    }
+
+    // inbound connection weights of every node, in forEachNode order
+    std::vector<std::vector<numeric>> connectionWeights(const std::vector<const K0 *>& nodes) {
+        std::vector<std::vector<numeric>> weights;
+        for (const K0 *node : nodes) {
+            auto& nodeWeights = weights.emplace_back();
+            for (auto& connection : *node)
+                nodeWeights.push_back(connection.weight);
+        }
+        return weights;
+    }
+}
+
+K3Sensitivity::K3Sensitivity(K3& model, const std::vector<Field>& fields, std::vector<std::shared_ptr<const K0>> nodes):
+    model(model),
+    numFields(requireFields(fields)),
+    tangent(model, numFields)
+{
+    if (model.obLateralLearning.has_value())
+        throw std::logic_error("Cannot track sensitivities while lateral learning is enabled");
+
+    std::map<const K0 *, std::size_t> tangentRows;
+    for (std::size_t row = 0; row < tangent.getNodes().size(); row++)
+        tangentRows.emplace(tangent.getNodes()[row], row);
+    if (nodes.empty()) {
+        for (auto& obUnit : model.getOlfactoryBulb())
+            nodes.push_back(obUnit.primaryNode());
+    }
+    for (auto& node : nodes) {
+        auto row = tangentRows.find(node.get());
+        if (row == tangentRows.end())
+            throw std::invalid_argument("Cannot track the output of a node from another set");
+        tangentNodes.push_back(row->second);
+    }
+    this->nodes = std::move(nodes);
+
+    deriveWeights(fields);
+    resetStatistics();
+}
+
+// Connection weights are linear in the config's weights, so building the structure again with one field
+// changed gives the derivative of every connection weight with respect to it exactly. The olfactory bulb's
+// lateral weight perturbation is additive, so it does not change the derivatives.
+void K3Sensitivity::deriveWeights(const std::vector<Field>& fields) {
+    auto structureWeights = [this](const K3Config& config) {
+        K3 structure(model.size(), config, K3::StructureOnly{});
+        std::vector<const K0 *> structureNodes;
+        structure.forEachNode([&structureNodes](const std::shared_ptr<K0>& node) { structureNodes.push_back(node.get()); });
+        return connectionWeights(structureNodes);
+    };
+
+    auto baseWeights = structureWeights(model.config);
+    for (std::size_t field = 0; field < numFields; field++) {
+        K3Config changed = model.config;
+        numeric& value = fields[field](changed);
+        // doubling keeps the weight's sign, so the changed config stays valid
+        numeric delta = value != 0 ? value : 1;
+        value += delta;
+        auto changedWeights = structureWeights(changed);
+
+        bool found = false;
+        for (std::size_t node = 0; node < baseWeights.size(); node++) {
+            for (std::size_t connection = 0; connection < baseWeights[node].size(); connection++) {
+                numeric difference = changedWeights[node][connection] - baseWeights[node][connection];
+                if (difference == 0)
+                    continue;
+                tangent.addWeightDerivative(field, node, connection, difference / delta);
+                found = true;
+            }
+        }
+        if (!found)
+            throw std::invalid_argument("Field does not set any connection weight");
+    }
+}
+
+RunStatus K3Sensitivity::run(numeric milliseconds) {
+    std::size_t numIterations = odeMillisecondsToIters(milliseconds);
+    for (std::size_t iteration = 0; iteration < numIterations; iteration++) {
+        if (!tangent.step())
+            break;
+        numSamples++;
+        for (std::size_t node = 0; node < nodes.size(); node++) {
+            double output = nodes[node]->getCurrentOutput();
+            const numeric *outputTangents = tangent.outputTangents(tangentNodes[node]);
+            outputSums[node] += output;
+            squaredOutputSums[node] += output * output;
+            for (std::size_t field = 0; field < numFields; field++) {
+                tangentSums[node * numFields + field] += outputTangents[field];
+                crossSums[node * numFields + field] += output * outputTangents[field];
+            }
+        }
+        if (model.getRunStatus() != RunStatus::OK)
+            break;
+    }
+    return model.getRunStatus();
+}
+
+RunStatus K3Sensitivity::rest(numeric milliseconds) {
+    model.eraseExternalStimulus();
+    return run(milliseconds);
+}
+
+numeric K3Sensitivity::getOutput(std::size_t node) const {
+    return nodes.at(node)->getCurrentOutput();
+}
+
+numeric K3Sensitivity::getOutputSensitivity(std::size_t node, std::size_t field) const {
+    if (field >= numFields)
+        throw std::out_of_range("Field index out of range");
+    return tangent.outputTangents(tangentNodes.at(node))[field];
+}
+
+numeric K3Sensitivity::getMean(std::size_t node) const {
+    if (numSamples == 0)
+        throw std::logic_error("No iterations were run");
+    return outputSums.at(node) / numSamples;
+}
+
+numeric K3Sensitivity::getMeanSensitivity(std::size_t node, std::size_t field) const {
+    if (numSamples == 0)
+        throw std::logic_error("No iterations were run");
+    if (field >= numFields)
+        throw std::out_of_range("Field index out of range");
+    return tangentSums.at(node * numFields + field) / numSamples;
+}
+
+numeric K3Sensitivity::getStdDev(std::size_t node) const {
+    numeric mean = getMean(node);
+    double variance = squaredOutputSums[node] / numSamples - static_cast<double>(mean) * mean;
+    return std::sqrt(std::max(variance, 0.0));
+}
+
+// d(stddev) = d(variance) / (2 stddev), and d(variance) = 2 (mean of output * d(output) - mean * d(mean))
+numeric K3Sensitivity::getStdDevSensitivity(std::size_t node, std::size_t field) const {
+    numeric meanSensitivity = getMeanSensitivity(node, field);
+    numeric stdDev = getStdDev(node);
+    if (stdDev == 0)
+        return 0;
+    double varianceSensitivity = 2 * (crossSums[node * numFields + field] / numSamples
+        - static_cast<double>(getMean(node)) * meanSensitivity);
+    return varianceSensitivity / (2 * stdDev);
+}
+
+void K3Sensitivity::resetStatistics() noexcept {
+    numSamples = 0;
+    outputSums.assign(nodes.size(), 0);
+    squaredOutputSums.assign(nodes.size(), 0);
+    tangentSums.assign(nodes.size() * numFields, 0);
+    crossSums.assign(nodes.size() * numFields, 0);
+}
@@ -0,0 +1,413 @@
+#include "ksets/server.hpp"
+#include "ksets/resultstore.hpp"
+#include "ksets/stream.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using ksets::EvaluationServer, ksets::ServerConfig, ksets::EvaluationKind, ksets::EvaluationStatus;
+using ksets::K3, ksets::K3Config, ksets::K3Stream, ksets::numeric, ksets::rngseed, ksets::RunStatus;
+using ksets::EvaluationKey;
+
+static_assert(std::is_trivially_copyable_v<K3Config>, "K3Config must be trivially copyable to be sent as is");
+static_assert(sizeof(numeric) == sizeof(float), "The protocol carries float32 values, which are sent straight from memory");
+
+// translation unit "private" types and functions
+namespace {
+    constexpr char REQUEST_MAGIC[8] = "KSETSRQ";
+    constexpr char RESPONSE_MAGIC[8] = "KSETSRS";
+
+    struct RequestHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t kind;
+        uint32_t numUnits;
+        uint32_t numPhases;
+        uint64_t seed;
+        float initialRestMilliseconds;
+        uint32_t configSize;
+    };
+    static_assert(sizeof(RequestHeader) == 40, "Request header must have no padding");
+
+    struct PhaseHeader {
+        float milliseconds;
+        uint32_t hasPattern;
+    };
+
+    struct ResponseHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t status;
+        uint32_t runStatus;
+        uint32_t numRows;
+        uint32_t numColumns;
+        uint32_t messageLength;
+    };
+    static_assert(sizeof(ResponseHeader) == 32, "Response header must have no padding");
+
+    struct Phase {
+        numeric milliseconds;
+        std::vector<numeric> pattern;
+    };
+
+    // thrown for requests that are answered with EvaluationStatus::REJECTED
+    class RejectedRequest : public std::runtime_error {
+        using std::runtime_error::runtime_error;
+    };
+
+    // false if the peer closed the connection, or went idle past its receive timeout, before sending length bytes
+    bool readFully(int connection, void *destination, std::size_t length) {
+        char *cursor = static_cast<char *>(destination);
+        while (length > 0) {
+            ssize_t numRead = recv(connection, cursor, length, 0);
+            if (numRead < 0 && errno == EINTR)
+                continue;
+            if (numRead <= 0)
+                return false;
+            cursor += numRead;
+            length -= numRead;
+        }
+        return true;
+    }
+
+    bool writeFully(int connection, const void *source, std::size_t length) {
+        const char *cursor = static_cast<const char *>(source);
+        while (length > 0) {
+            ssize_t numWritten = send(connection, cursor, length, MSG_NOSIGNAL);
+            if (numWritten < 0 && errno == EINTR)
+                continue;
+            if (numWritten <= 0)
+                return false;
+            cursor += numWritten;
+            length -= numWritten;
+        }
+        return true;
+    }
+
+    bool sendResponse(
+        int connection,
+        EvaluationStatus status,
+        RunStatus runStatus,
+        std::size_t numRows,
+        std::size_t numColumns,
+        const std::string& message,
+        const numeric *values
+    ) {
+        ResponseHeader header;
+        std::memcpy(header.magic, RESPONSE_MAGIC, sizeof(RESPONSE_MAGIC));
+        header.version = ksets::SERVER_PROTOCOL_VERSION;
+        header.status = static_cast<uint32_t>(status);
+        header.runStatus = static_cast<uint32_t>(runStatus);
+        header.numRows = numRows;
+        header.numColumns = numColumns;
+        header.messageLength = message.size();
+        return writeFully(connection, &header, sizeof(header))
+            && writeFully(connection, message.data(), message.size())
+            && writeFully(connection, values, numRows * numColumns * sizeof(numeric));
+    }
+
+    std::size_t validIterations(numeric milliseconds, std::size_t maxIterations) {
+        if (!std::isfinite(milliseconds) || milliseconds < 0)
+            throw RejectedRequest("Durations must be finite and non negative");
+        if (milliseconds > ksets::odeItersToMilliseconds(maxIterations))
+            throw RejectedRequest("Request exceeds the server's iteration limit");
+        return ksets::odeMillisecondsToIters(milliseconds);
+    }
+
+    // everything but the weights, which checkWeightsValidity covers, that could crash or exhaust the server
+    void validateConfig(const K3Config& config, const ServerConfig& limits) {
+        if (config.outputHistorySize > limits.maxHistorySize || config.nonOutputHistorySize > limits.maxHistorySize)
+            throw RejectedRequest("History sizes must be at most " + std::to_string(limits.maxHistorySize));
+        if (config.outputActivityMonitoring != 0 && config.outputActivityMonitoring + 2 > config.outputHistorySize)
+            throw RejectedRequest("Activity monitoring window must be at least 2 shorter than the output history");
+        if (config.degeneracyCheckWindow > limits.maxHistorySize)
+            throw RejectedRequest("Degeneracy check window must be at most " + std::to_string(limits.maxHistorySize));
+        if (!config.checkDelaysValidity())
+            throw RejectedRequest("Every delay must be shorter than the history of the node it reads from");
+    }
+
+    std::string canonicalConfigBytes(const K3Config& config) {
+        EvaluationKey key;
+        key.config = config;
+        return key.canonicalBytes();
+    }
+}
+
+EvaluationServer::ModelKey::ModelKey(
+    std::size_t numUnits,
+    rngseed seed,
+    numeric initialRestMilliseconds,
+    const K3Config& config
+) : numUnits(numUnits),
+    seed(seed),
+    initialRestMilliseconds(initialRestMilliseconds),
+    config(config),
+    configBytes(canonicalConfigBytes(config)) {}
+
+bool EvaluationServer::ModelKey::operator==(const ModelKey& other) const noexcept {
+    return numUnits == other.numUnits
+        && seed == other.seed
+        && initialRestMilliseconds == other.initialRestMilliseconds
+        && configBytes == other.configBytes;
+}
+
+EvaluationServer::EvaluationServer(const std::string& socketPath, ServerConfig config):
+    config(config), socketPath(socketPath)
+{
+    if (this->config.numWorkers == 0)
+        this->config.numWorkers = std::max(1u, std::thread::hardware_concurrency());
+
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path))
+        throw std::invalid_argument("Socket path must be between 1 and " + std::to_string(sizeof(address.sun_path) - 1) + " bytes long");
+    std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    for (std::size_t numUnits : this->config.prewarmUnitCounts)
+        warmedModel({numUnits, this->config.prewarmSeed, this->config.prewarmInitialRestMilliseconds, this->config.baseConfig});
+
+    // a socket file left over by a server that did not shut down cleanly
+    struct stat info;
+    if (lstat(socketPath.c_str(), &info) == 0) {
+        if (!S_ISSOCK(info.st_mode))
+            throw std::invalid_argument(socketPath + " exists and is not a socket");
+        unlink(socketPath.c_str());
+    }
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+        throw std::system_error(errno, std::generic_category(), "Could not create server socket");
+    if (bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0
+            || listen(listener, SOMAXCONN) != 0) {
+        int error = errno;
+        close(listener);
+        throw std::system_error(error, std::generic_category(), "Could not listen on " + socketPath);
+    }
+}
+
+EvaluationServer::~EvaluationServer() {
+    stop();
+    close(listener);
+    unlink(socketPath.c_str());
+}
+
+std::shared_ptr<const K3> EvaluationServer::warmedModel(const ModelKey& key) {
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        for (auto entry = cache.begin(); entry != cache.end(); entry++) {
+            if (entry->key == key) {
+                cache.splice(cache.begin(), cache, entry);
+                return entry->model;
+            }
+        }
+    }
+
+    // warmed up outside the lock, so other requests are not held up; a concurrent duplicate is discarded
+    auto model = std::make_shared<const K3>(key.numUnits, key.initialRestMilliseconds, key.seed, key.config);
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    for (auto& entry : cache)
+        if (entry.key == key)
+            return entry.model;
+    cache.push_front({key, model});
+    if (cache.size() > std::max<std::size_t>(config.maxCachedModels, 1))
+        cache.pop_back();
+    return model;
+}
+
+std::size_t EvaluationServer::getNumCachedModels() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return cache.size();
+}
+
+void EvaluationServer::serve() {
+    for (std::size_t i = 0; i < config.numWorkers; i++)
+        workers.emplace_back(&EvaluationServer::workerMain, this);
+
+    while (!stopping.load()) {
+        int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (connection < 0) {
+            // out of file descriptors and the like are transient, so keep serving the open connections
+            if (errno != EINTR && !stopping.load())
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        if (config.idleTimeoutMilliseconds > 0) {
+            timeval timeout {};
+            timeout.tv_sec = config.idleTimeoutMilliseconds / 1000;
+            timeout.tv_usec = config.idleTimeoutMilliseconds % 1000 * 1000;
+            setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        }
+        std::lock_guard<std::mutex> lock(queueMutex);
+        pendingConnections.push_back(connection);
+        openConnections.insert(connection);
+        queueChanged.notify_one();
+    }
+
+    {
+        // clients get the answer to the request in flight, then see the connection close
+        std::lock_guard<std::mutex> lock(queueMutex);
+        for (int connection : openConnections)
+            shutdown(connection, SHUT_RD);
+        queueChanged.notify_all();
+    }
+    for (auto& worker : workers)
+        worker.join();
+    workers.clear();
+}
+
+void EvaluationServer::stop() noexcept {
+    stopping.store(true);
+    shutdown(listener, SHUT_RDWR);
+}
+
+void EvaluationServer::workerMain() noexcept {
+    // each worker reuses its model as long as consecutive requests ask for the same one
+    std::unique_ptr<K3> scratch;
+    ModelKey scratchKey {};
+    while (true) {
+        int connection;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueChanged.wait(lock, [this]() { return stopping.load() || !pendingConnections.empty(); });
+            if (pendingConnections.empty())
+                return;
+            connection = pendingConnections.front();
+            pendingConnections.pop_front();
+        }
+
+        try {
+            serveConnection(connection, scratch, scratchKey);
+        } catch (...) {
+            // out of memory and the like only cost the client its connection
+            scratch.reset();
+        }
+
+        std::lock_guard<std::mutex> lock(queueMutex);
+        openConnections.erase(connection);
+        close(connection);
+    }
+}
+
+void EvaluationServer::serveConnection(int connection, std::unique_ptr<K3>& scratch, ModelKey& scratchKey) {
+    while (true) {
+        RequestHeader header;
+        if (!readFully(connection, &header, sizeof(header)))
+            return;
+
+        std::vector<numeric> values;
+        std::size_t numRows = 0;
+        std::size_t numColumns = 0;
+        RunStatus runStatus = RunStatus::OK;
+        try {
+            if (std::memcmp(header.magic, REQUEST_MAGIC, sizeof(REQUEST_MAGIC)) != 0)
+                throw RejectedRequest("Not an evaluation request");
+            if (header.version != SERVER_PROTOCOL_VERSION)
+                throw RejectedRequest("Unsupported protocol version");
+            auto kind = static_cast<EvaluationKind>(header.kind);
+            if (kind != EvaluationKind::TRACE && kind != EvaluationKind::PHASE_STDDEV)
+                throw RejectedRequest("Unknown evaluation kind");
+            if (header.numUnits == 0 || header.numUnits > config.maxUnits)
+                throw RejectedRequest("Number of units must be between 1 and " + std::to_string(config.maxUnits));
+            if (header.numPhases > config.maxIterations)
+                throw RejectedRequest("Request exceeds the server's iteration limit");
+            // a trace's rows are only known once its phases are read, so those are checked as they arrive
+            if (kind == EvaluationKind::PHASE_STDDEV && header.numPhases > config.maxResponseValues / header.numUnits)
+                throw RejectedRequest("Response would exceed the server's size limit");
+            if (header.configSize != 0 && header.configSize != sizeof(K3Config))
+                throw RejectedRequest("Config size does not match the server's K3Config");
+            validIterations(header.initialRestMilliseconds, config.maxIterations);
+
+            K3Config modelConfig = config.baseConfig;
+            if (header.configSize != 0 && !readFully(connection, &modelConfig, sizeof(K3Config)))
+                return;
+            if (!modelConfig.checkWeightsValidity())
+                throw RejectedRequest("One or more K3 weights were invalid");
+            validateConfig(modelConfig, config);
+            ModelKey key(header.numUnits, header.seed, header.initialRestMilliseconds, modelConfig);
+
+            std::vector<Phase> phases(header.numPhases);
+            std::size_t numIterations = 0;
+            for (auto& phase : phases) {
+                PhaseHeader phaseHeader;
+                if (!readFully(connection, &phaseHeader, sizeof(phaseHeader)))
+                    return;
+                phase.milliseconds = phaseHeader.milliseconds;
+                numIterations += validIterations(phase.milliseconds, config.maxIterations);
+                if (numIterations > config.maxIterations)
+                    throw RejectedRequest("Request exceeds the server's iteration limit");
+                if (kind == EvaluationKind::TRACE && numIterations > config.maxResponseValues / header.numUnits)
+                    throw RejectedRequest("Response would exceed the server's size limit");
+                if (phaseHeader.hasPattern > 1)
+                    throw RejectedRequest("Phase pattern flag must be 0 or 1");
+                if (phaseHeader.hasPattern == 1) {
+                    phase.pattern.resize(header.numUnits);
+                    if (!readFully(connection, phase.pattern.data(), header.numUnits * sizeof(numeric)))
+                        return;
+                }
+            }
+
+            std::shared_ptr<const K3> warmed = warmedModel(key);
+            if (scratch && scratchKey == key) {
+                scratch->copyStateFrom(*warmed);
+            } else {
+                scratch.reset();
+                scratch = std::make_unique<K3>(*warmed);
+                scratchKey = key;
+            }
+            // the warmed model's clock started when it was built
+            scratch->restartRunClock();
+
+            numColumns = header.numUnits;
+            numRows = kind == EvaluationKind::TRACE ? numIterations : phases.size();
+            values.assign(numRows * numColumns, std::numeric_limits<numeric>::quiet_NaN());
+            numeric *row = values.data();
+            for (auto& phase : phases) {
+                std::unique_ptr<K3Stream> stream = phase.pattern.empty()
+                    ? std::make_unique<K3Stream>(*scratch, phase.milliseconds)
+                    : std::make_unique<K3Stream>(*scratch, phase.milliseconds, phase.pattern.begin(), phase.pattern.end());
+                if (kind == EvaluationKind::TRACE) {
+                    for (const auto& sample : *stream) {
+                        std::copy(sample.begin(), sample.end(), row);
+                        row += numColumns;
+                    }
+                } else {
+                    std::vector<double> mean(numColumns, 0), squaredDeviations(numColumns, 0);
+                    std::size_t count = 0;
+                    for (const auto& sample : *stream) {
+                        count++;
+                        for (std::size_t unit = 0; unit < numColumns; unit++) {
+                            double deviation = sample[unit] - mean[unit];
+                            mean[unit] += deviation / count;
+                            squaredDeviations[unit] += deviation * (sample[unit] - mean[unit]);
+                        }
+                    }
+                    if (stream->getRunStatus() != RunStatus::OK)
+                        break;
+                    for (std::size_t unit = 0; unit < numColumns; unit++)
+                        row[unit] = count > 0 ? static_cast<numeric>(std::sqrt(squaredDeviations[unit] / count)) : 0;
+                    row += numColumns;
+                }
+            }
+            runStatus = scratch->getRunStatus();
+        } catch (const RejectedRequest& rejection) {
+            sendResponse(connection, EvaluationStatus::REJECTED, RunStatus::OK, 0, 0, rejection.what(), nullptr);
+            return;
+        }
+
+        EvaluationStatus status = runStatus == RunStatus::OK ? EvaluationStatus::OK : EvaluationStatus::ABORTED;
+        if (!sendResponse(connection, status, runStatus, numRows, numColumns, "", values.data()))
+            return;
+    }
+}
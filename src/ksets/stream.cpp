@@ -0,0 +1,76 @@
+#include "ksets/stream.hpp"
+
+#include <set>
+#include <stdexcept>
+
+using ksets::K0, ksets::K3, ksets::K3Stream, ksets::RunStatus, ksets::numeric;
+
+K3Stream::K3Stream(K3& model, numeric milliseconds, std::vector<std::shared_ptr<const K0>> nodes):
+    model(model),
+    numIterations(odeMillisecondsToIters(milliseconds))
+{
+    selectNodes(std::move(nodes));
+    model.eraseExternalStimulus();
+}
+
+void K3Stream::selectNodes(std::vector<std::shared_ptr<const K0>> selected) {
+    if (selected.empty()) {
+        for (auto& obUnit : model.getOlfactoryBulb())
+            selected.push_back(obUnit.primaryNode());
+    } else {
+        std::set<const K0 *> ownNodes;
+        model.forEachNode([&ownNodes](const std::shared_ptr<K0>& node) { ownNodes.insert(node.get()); });
+        for (auto& node : selected)
+            if (ownNodes.count(node.get()) == 0)
+                throw std::invalid_argument("Cannot stream the output of a node from another set");
+    }
+    nodes = std::move(selected);
+    sample.resize(nodes.size());
+    for (std::size_t i = 0; i < nodes.size(); i++)
+        sample[i] = nodes[i]->getCurrentOutput();
+}
+
+bool K3Stream::next() {
+    started = true;
+    if (aborted || numStepsTaken >= numIterations)
+        return false;
+
+    // run does nothing once the set is aborted, and may abort before or right after stepping
+    std::size_t iterationsBefore = model.getIterationsRun();
+    model.run(odeItersToMilliseconds(1));
+    if (model.getIterationsRun() == iterationsBefore) {
+        aborted = true;
+        return false;
+    }
+
+    numStepsTaken++;
+    for (std::size_t i = 0; i < nodes.size(); i++)
+        sample[i] = nodes[i]->getCurrentOutput();
+    return true;
+}
+
+const std::vector<numeric>& K3Stream::current() const noexcept {
+    return sample;
+}
+
+K3Stream::Iterator K3Stream::begin() {
+    if (started)
+        throw std::logic_error("A stream can only be iterated once");
+    return Iterator(next() ? this : nullptr);
+}
+
+K3Stream::Iterator K3Stream::end() noexcept {
+    return Iterator(nullptr);
+}
+
+std::size_t K3Stream::getNumStepsTaken() const noexcept {
+    return numStepsTaken;
+}
+
+std::size_t K3Stream::getNumIterations() const noexcept {
+    return numIterations;
+}
+
+RunStatus K3Stream::getRunStatus() const noexcept {
+    return model.getRunStatus();
+}
@@ -0,0 +1,165 @@
+#include "ksets/tangent.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <map>
+#include <stdexcept>
+
+using ksets::K0, ksets::K3, ksets::K3Tangent, ksets::numeric;
+
+// translation unit "private" types and functions
+namespace {
+    // One RK4 step of K0's ODE is affine in (x, dx/dt, net input), the input being held over the step, so its
+    // Jacobian is the same for every node and every step: next = stateMatrix * state + inputColumn * input.
+    struct LinearStep {
+        numeric stateMatrix[2][2];
+        numeric inputColumn[2];
+    };
+
+    LinearStep linearizeOdeStep() noexcept {
+        using ksets::ODE_A_DECAY_RATE, ksets::ODE_B_RISE_RATE, ksets::ODE_STEP_SIZE;
+        // same steps as K0::calculateNextState, without the constant terms
+        auto step = [](double x, double dx, double input) {
+            auto f2 = [input](double x, double dx) {
+                return -(ODE_A_DECAY_RATE + ODE_B_RISE_RATE) * dx + ODE_A_DECAY_RATE * ODE_B_RISE_RATE * (input - x);
+            };
+            double k1 = dx * ODE_STEP_SIZE;
+            double l1 = f2(x, dx) * ODE_STEP_SIZE;
+            double k2 = (dx + l1/2) * ODE_STEP_SIZE;
+            double l2 = f2(x + k1/2, dx + l1/2) * ODE_STEP_SIZE;
+            double k3 = (dx + l2/2) * ODE_STEP_SIZE;
+            double l3 = f2(x + k2/2, dx + l2/2) * ODE_STEP_SIZE;
+            double k4 = (dx + l3) * ODE_STEP_SIZE;
+            double l4 = f2(x + k3, dx + l3) * ODE_STEP_SIZE;
+            return std::array<double, 2> {x + (k1 + 2*k2 + 2*k3 + k4) / 6, dx + (l1 + 2*l2 + 2*l3 + l4) / 6};
+        };
+
+        auto fromX = step(1, 0, 0);
+        auto fromDx = step(0, 1, 0);
+        auto fromInput = step(0, 0, 1);
+        LinearStep linear;
+        for (std::size_t row = 0; row < 2; row++) {
+            linear.stateMatrix[row][0] = fromX[row];
+            linear.stateMatrix[row][1] = fromDx[row];
+            linear.inputColumn[row] = fromInput[row];
+        }
+        return linear;
+    }
+
+    const LinearStep LINEAR_STEP = linearizeOdeStep();
+
+    // derivative of ksets::sigmoid, 0 where it is clamped at -1
+    numeric sigmoidDerivative(numeric x, numeric q) noexcept {
+        numeric growth = std::exp(x);
+        numeric decay = std::exp(-(growth - 1) / q);
+        if (q * (1 - decay) <= -1)
+            return 0;
+        return growth * decay;
+    }
+
+    constexpr std::size_t OTHER_SET = -1;
+}
+
+K3Tangent::K3Tangent(K3& model, std::size_t numVectors): model(model), numVectors(numVectors) {
+    if (numVectors == 0)
+        throw std::invalid_argument("Tangent needs at least one vector");
+
+    std::map<const K0 *, std::size_t> nodeIndices;
+    model.forEachNode([this, &nodeIndices](const std::shared_ptr<K0>& node) {
+        nodeIndices.emplace(node.get(), nodes.size());
+        nodes.push_back(node.get());
+    });
+
+    std::size_t maxDelay = 0;
+    firstConnection.push_back(0);
+    for (const K0 *node : nodes) {
+        auto& positions = connectionPositions.emplace_back();
+        for (auto& connection : *node) {
+            auto source = nodeIndices.find(connection.source);
+            if (source == nodeIndices.end()) {
+                positions.push_back(OTHER_SET);
+                continue;
+            }
+            positions.push_back(connectionSources.size());
+            connectionSources.push_back(source->second);
+            connectionDelays.push_back(connection.delay);
+            connectionWeights.push_back(connection.weight);
+            maxDelay = std::max<std::size_t>(maxDelay, connection.delay);
+        }
+        firstConnection.push_back(connectionSources.size());
+    }
+
+    numSlots = maxDelay + 1;
+    tangents.assign(nodes.size() * (2 + numSlots) * numVectors, 0);
+    netInputs.resize(nodes.size() * numVectors);
+}
+
+numeric *K3Tangent::outputSlot(std::size_t slot, std::size_t node) noexcept {
+    return tangents.data() + ((2 + slot) * nodes.size() + node) * numVectors;
+}
+
+const numeric *K3Tangent::outputTangents(std::size_t node) const noexcept {
+    return tangents.data() + ((2 + newestSlot) * nodes.size() + node) * numVectors;
+}
+
+void K3Tangent::addWeightDerivative(std::size_t vector, std::size_t node, std::size_t connection, numeric derivative) {
+    if (vector >= numVectors || node >= nodes.size() || connection >= connectionPositions[node].size())
+        throw std::out_of_range("No such tangent vector or connection");
+    std::size_t position = connectionPositions[node][connection];
+    if (position == OTHER_SET)
+        throw std::invalid_argument("Cannot differentiate with respect to a connection from another set");
+    weightDerivatives.push_back({node, position, vector, derivative});
+}
+
+bool K3Tangent::step() {
+    std::size_t numNodes = nodes.size();
+    // net input from the outputs before this iteration's commit, as in K0::calculateNetInput
+    std::fill(netInputs.begin(), netInputs.end(), 0);
+    for (std::size_t node = 0; node < numNodes; node++) {
+        numeric *input = netInputs.data() + node * numVectors;
+        for (std::size_t connection = firstConnection[node]; connection < firstConnection[node + 1]; connection++) {
+            std::size_t slot = (newestSlot + numSlots - connectionDelays[connection]) % numSlots;
+            const numeric *source = outputSlot(slot, connectionSources[connection]);
+            numeric weight = connectionWeights[connection];
+            for (std::size_t vector = 0; vector < numVectors; vector++)
+                input[vector] += weight * source[vector];
+        }
+    }
+    for (auto& weight : weightDerivatives) {
+        const K0 *source = nodes[connectionSources[weight.connection]];
+        netInputs[weight.target * numVectors + weight.vector]
+            += weight.derivative * source->getDelayedOutput(connectionDelays[weight.connection]);
+    }
+
+    for (std::size_t node = 0; node < numNodes; node++) {
+        numeric *x = tangents.data() + 2 * node * numVectors;
+        numeric *dx = x + numVectors;
+        const numeric *input = netInputs.data() + node * numVectors;
+        for (std::size_t vector = 0; vector < numVectors; vector++) {
+            numeric nextX = LINEAR_STEP.stateMatrix[0][0] * x[vector] + LINEAR_STEP.stateMatrix[0][1] * dx[vector]
+                + LINEAR_STEP.inputColumn[0] * input[vector];
+            numeric nextDx = LINEAR_STEP.stateMatrix[1][0] * x[vector] + LINEAR_STEP.stateMatrix[1][1] * dx[vector]
+                + LINEAR_STEP.inputColumn[1] * input[vector];
+            x[vector] = nextX;
+            dx[vector] = nextDx;
+        }
+    }
+
+    std::size_t iterationsBefore = model.getIterationsRun();
+    model.run(odeItersToMilliseconds(1));
+    if (model.getIterationsRun() == iterationsBefore)
+        return false;
+
+    // outputs are the sigmoid of the committed state
+    newestSlot = (newestSlot + 1) % numSlots;
+    for (std::size_t node = 0; node < numNodes; node++) {
+        K0::RawState state = nodes[node]->getRawState();
+        numeric slope = sigmoidDerivative(state.odeState[0], state.sigmoidQ);
+        const numeric *x = tangents.data() + 2 * node * numVectors;
+        numeric *output = outputSlot(newestSlot, node);
+        for (std::size_t vector = 0; vector < numVectors; vector++)
+            output[vector] = slope * x[vector];
+    }
+    return true;
+}
@@ -0,0 +1,484 @@
+#include "ksets/topology.hpp"
+#include "ksets/k2.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <system_error>
+#include <cerrno>
+#include <tuple>
+#include <utility>
+
+using ksets::K0, ksets::K0Config, ksets::K2Config, ksets::Network, ksets::TopologyDescription;
+using ksets::PopulationDescription, ksets::ConnectionDescription, ksets::UnitType, ksets::ConnectionPattern;
+using ksets::numeric, ksets::rngseed, ksets::conntag;
+
+// translation unit "private" types and functions
+namespace {
+    // (target, source, index into the unit weights) of each intra unit connection, in the order K1 and K2 add them
+    struct UnitConnection {
+        std::size_t target, source, weight;
+    };
+    const std::vector<UnitConnection> K1_CONNECTIONS = {{1, 0, 0}, {0, 1, 1}};
+    const std::vector<UnitConnection> K2_CONNECTIONS = {
+        {0, 1, 0}, {0, 2, 2}, {0, 3, 2},
+        {1, 0, 0}, {1, 3, 2},
+        {2, 0, 1}, {2, 3, 3},
+        {3, 0, 1}, {3, 1, 1}, {3, 2, 3}
+    };
+
+    std::size_t unitSize(UnitType unitType) noexcept {
+        switch (unitType) {
+        case UnitType::K0:
+            return 1;
+        case UnitType::K1:
+            return 2;
+        default:
+            return 4;
+        }
+    }
+
+    const std::vector<UnitConnection>& unitConnections(UnitType unitType) noexcept {
+        static const std::vector<UnitConnection> none;
+        switch (unitType) {
+        case UnitType::K0:
+            return none;
+        case UnitType::K1:
+            return K1_CONNECTIONS;
+        default:
+            return K2_CONNECTIONS;
+        }
+    }
+
+    // a connection as stored before wiring, in the edge array of its target. Delay and tag are looked up in its
+    // description, as all of a description's connections share them
+    struct Edge {
+        uint32_t source;
+        numeric weight;
+        uint32_t description;
+    };
+    constexpr uint32_t INTRA_UNIT = std::numeric_limits<uint32_t>::max();
+
+    std::size_t numUnitWeights(UnitType unitType) noexcept {
+        return unitType == UnitType::K0 ? 0 : unitType == UnitType::K1 ? 2 : 4;
+    }
+
+    void checkUnitWeights(const PopulationDescription& population) {
+        const auto& weights = population.unitWeights;
+        if (weights.size() != numUnitWeights(population.unitType))
+            throw std::invalid_argument("Population " + population.name + " has the wrong number of unit weights");
+        if (population.unitType == UnitType::K1 && std::copysign(1.0, weights[0]) != std::copysign(1.0, weights[1]))
+            throw std::invalid_argument("Population " + population.name + " unit weights must have the same sign");
+        if (
+            population.unitType == UnitType::K2
+            && !K2Config(std::array<numeric, 4>{weights[0], weights[1], weights[2], weights[3]}).checkWeights()
+        )
+            throw std::invalid_argument("Population " + population.name + " has invalid K2 weights");
+    }
+
+    // number of source units driving each target unit
+    std::size_t numSourcesPerUnit(const ConnectionDescription& connection, std::size_t numSourceUnits) noexcept {
+        switch (connection.pattern) {
+        case ConnectionPattern::ONE_TO_ONE:
+            return 1;
+        case ConnectionPattern::ALL_TO_ALL:
+            return numSourceUnits;
+        default:
+            return numSourceUnits - 1;
+        }
+    }
+
+    class LineParser {
+        std::size_t lineNumber;
+    public:
+        explicit LineParser(std::size_t lineNumber) noexcept: lineNumber(lineNumber) {}
+
+        [[noreturn]] void fail(const std::string& problem) const {
+            throw std::runtime_error("Topology line " + std::to_string(lineNumber) + ": " + problem);
+        }
+
+        numeric number(const std::string& text) const {
+            std::size_t parsed = 0;
+            numeric value = 0;
+            try {
+                value = std::stof(text, &parsed);
+            } catch (const std::logic_error&) {
+                parsed = 0;
+            }
+            if (parsed == 0 || parsed != text.size() || !std::isfinite(value))
+                fail("\"" + text + "\" is not a number");
+            return value;
+        }
+
+        std::size_t count(const std::string& text) const {
+            std::size_t parsed = 0;
+            unsigned long long value = 0;
+            try {
+                value = std::stoull(text, &parsed);
+            } catch (const std::logic_error&) {
+                parsed = 0;
+            }
+            if (parsed == 0 || parsed != text.size() || text[0] == '-')
+                fail("\"" + text + "\" is not a non-negative integer");
+            return value;
+        }
+
+        // splits key=value
+        std::pair<std::string, std::string> option(const std::string& token) const {
+            std::size_t equals = token.find('=');
+            if (equals == std::string::npos || equals == 0)
+                fail("expected key=value, got \"" + token + "\"");
+            return {token.substr(0, equals), token.substr(equals + 1)};
+        }
+
+        // <population>.<node>, as (population index, node within the unit)
+        std::pair<std::size_t, std::size_t> endpoint(const TopologyDescription& topology, const std::string& token) const {
+            std::size_t dot = token.rfind('.');
+            if (dot == std::string::npos)
+                fail("expected <population>.<node>, got \"" + token + "\"");
+            std::string populationName = token.substr(0, dot);
+            std::string nodeName = token.substr(dot + 1);
+
+            std::size_t population = topology.populations.size();
+            for (std::size_t i = 0; i < topology.populations.size(); i++)
+                if (topology.populations[i].name == populationName)
+                    population = i;
+            if (population == topology.populations.size())
+                fail("population " + populationName + " is not declared");
+
+            std::size_t node;
+            if (nodeName == "primary")
+                node = 0;
+            else if (nodeName == "secondary")
+                node = 1;
+            else if (nodeName == "antipodal" && topology.populations[population].unitType == UnitType::K2)
+                node = 3;
+            else
+                node = count(nodeName);
+            if (node >= unitSize(topology.populations[population].unitType))
+                fail("population " + populationName + " units have no node " + nodeName);
+            return {population, node};
+        }
+    };
+
+    PopulationDescription parsePopulation(
+        const LineParser& parser,
+        const TopologyDescription& topology,
+        const std::vector<std::string>& tokens
+    ) {
+        if (tokens.size() < 4)
+            parser.fail("expected population <name> <K0|K1|K2> <units> [options]");
+        PopulationDescription population;
+        population.name = tokens[1];
+        for (auto& other : topology.populations)
+            if (other.name == population.name)
+                parser.fail("population " + population.name + " is declared twice");
+
+        if (tokens[2] == "K0")
+            population.unitType = UnitType::K0;
+        else if (tokens[2] == "K1")
+            population.unitType = UnitType::K1;
+        else if (tokens[2] == "K2")
+            population.unitType = UnitType::K2;
+        else
+            parser.fail("unknown unit type \"" + tokens[2] + "\"");
+
+        population.numUnits = parser.count(tokens[3]);
+        if (population.numUnits == 0)
+            parser.fail("population " + population.name + " has no units");
+
+        for (std::size_t i = 4; i < tokens.size(); i++) {
+            auto [key, value] = parser.option(tokens[i]);
+            if (key == "weights") {
+                std::stringstream weights(value);
+                std::string weight;
+                while (std::getline(weights, weight, ','))
+                    population.unitWeights.push_back(parser.number(weight));
+            } else if (key == "history") {
+                population.k0config.historySize = parser.count(value);
+            } else if (key == "q") {
+                population.k0config.sigmoidQ = parser.number(value);
+            } else if (key == "noise") {
+                population.noise = parser.number(value);
+            } else {
+                parser.fail("unknown population option \"" + key + "\"");
+            }
+        }
+        try {
+            checkUnitWeights(population);
+        } catch (const std::invalid_argument& error) {
+            parser.fail(error.what());
+        }
+        return population;
+    }
+
+    ConnectionDescription parseConnection(
+        const LineParser& parser,
+        const TopologyDescription& topology,
+        const std::vector<std::string>& tokens
+    ) {
+        if (tokens.size() < 5 || tokens[2] != "->")
+            parser.fail("expected connect <population>.<node> -> <population>.<node> <pattern> [options]");
+        ConnectionDescription connection;
+        std::tie(connection.sourcePopulation, connection.sourceNode) = parser.endpoint(topology, tokens[1]);
+        std::tie(connection.targetPopulation, connection.targetNode) = parser.endpoint(topology, tokens[3]);
+
+        if (tokens[4] == "one-to-one")
+            connection.pattern = ConnectionPattern::ONE_TO_ONE;
+        else if (tokens[4] == "all-to-all")
+            connection.pattern = ConnectionPattern::ALL_TO_ALL;
+        else if (tokens[4] == "all-to-others")
+            connection.pattern = ConnectionPattern::ALL_TO_OTHERS;
+        else
+            parser.fail("unknown connection pattern \"" + tokens[4] + "\"");
+
+        bool hasWeight = false;
+        for (std::size_t i = 5; i < tokens.size(); i++) {
+            auto [key, value] = parser.option(tokens[i]);
+            if (key == "weight") {
+                connection.weight = parser.number(value);
+                hasWeight = true;
+            } else if (key == "delay") {
+                connection.delay = parser.count(value);
+            } else if (key == "tag") {
+                std::size_t parsed = 0;
+                try {
+                    connection.tag = std::stoi(value, &parsed);
+                } catch (const std::logic_error&) {
+                    parsed = 0;
+                }
+                if (parsed == 0 || parsed != value.size())
+                    parser.fail("\"" + value + "\" is not a tag");
+            } else {
+                parser.fail("unknown connection option \"" + key + "\"");
+            }
+        }
+        if (!hasWeight)
+            parser.fail("connection has no weight");
+        return connection;
+    }
+}
+
+std::size_t TopologyDescription::populationIndex(const std::string& name) const {
+    for (std::size_t i = 0; i < populations.size(); i++)
+        if (populations[i].name == name)
+            return i;
+    throw std::out_of_range("No population named " + name);
+}
+
+TopologyDescription TopologyDescription::parse(std::istream& in) {
+    TopologyDescription topology;
+    std::string line;
+    for (std::size_t lineNumber = 1; std::getline(in, line); lineNumber++) {
+        std::size_t comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+        std::stringstream words(line);
+        std::vector<std::string> tokens;
+        for (std::string token; words >> token;)
+            tokens.push_back(token);
+        if (tokens.empty())
+            continue;
+
+        LineParser parser(lineNumber);
+        if (tokens[0] == "population")
+            topology.populations.push_back(parsePopulation(parser, topology, tokens));
+        else if (tokens[0] == "connect")
+            topology.connections.push_back(parseConnection(parser, topology, tokens));
+        else
+            parser.fail("unknown declaration \"" + tokens[0] + "\"");
+    }
+    if (in.bad())
+        throw std::runtime_error("Could not read topology");
+    return topology;
+}
+
+TopologyDescription TopologyDescription::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file)
+        throw std::system_error(errno, std::generic_category(), "Could not open topology " + path);
+    try {
+        return parse(file);
+    } catch (const std::runtime_error& error) {
+        throw std::runtime_error(path + ": " + error.what());
+    }
+}
+
+Network::Network(const TopologyDescription& topology, rngseed seed) {
+    std::size_t numNodes = 0;
+    for (auto& description : topology.populations) {
+        if (description.numUnits == 0)
+            throw std::invalid_argument("Population " + description.name + " has no units");
+        checkUnitWeights(description);
+        populations.push_back({
+            description.name,
+            description.unitType,
+            numNodes,
+            description.numUnits,
+            unitSize(description.unitType)
+        });
+        numNodes += description.numUnits * unitSize(description.unitType);
+    }
+    if (numNodes >= INTRA_UNIT || topology.connections.size() >= INTRA_UNIT)
+        throw std::invalid_argument("Topology is too large");
+
+    for (auto& connection : topology.connections) {
+        const Population& source = population(connection.sourcePopulation);
+        const Population& target = population(connection.targetPopulation);
+        if (connection.sourceNode >= source.unitSize || connection.targetNode >= target.unitSize)
+            throw std::invalid_argument("Connection refers to a node its units do not have");
+        if (connection.pattern != ConnectionPattern::ALL_TO_ALL && source.numUnits != target.numUnits)
+            throw std::invalid_argument("Connection joins populations " + source.name + " and " + target.name
+                + " unit by unit, but they have different sizes");
+        if (connection.delay > std::numeric_limits<uint16_t>::max())
+            throw std::invalid_argument("Connection delay does not fit in 16 bits");
+        if (connection.delay >= topology.populations[connection.sourcePopulation].k0config.historySize)
+            throw std::invalid_argument("Connection delay does not fit in population " + source.name + " history");
+    }
+
+    // Every connection goes into one edge array, grouped by target node, before any node is wired. Each node's
+    // connections are then added sorted by source, so the net input reads its sources in memory order.
+    std::vector<std::size_t> edgeOffsets(numNodes + 1, 0);
+    for (auto& population : populations)
+        for (std::size_t unit = 0; unit < population.numUnits; unit++)
+            for (auto& connection : unitConnections(population.unitType))
+                edgeOffsets[population.firstNode + unit * population.unitSize + connection.target + 1]++;
+    for (auto& connection : topology.connections) {
+        const Population& source = populations[connection.sourcePopulation];
+        const Population& target = populations[connection.targetPopulation];
+        std::size_t numSources = numSourcesPerUnit(connection, source.numUnits);
+        for (std::size_t unit = 0; unit < target.numUnits; unit++)
+            edgeOffsets[target.firstNode + unit * target.unitSize + connection.targetNode + 1] += numSources;
+    }
+    for (std::size_t node = 0; node < numNodes; node++)
+        edgeOffsets[node + 1] += edgeOffsets[node];
+
+    std::vector<Edge> edges(edgeOffsets.back());
+    std::vector<std::size_t> edgeEnds(edgeOffsets.begin(), edgeOffsets.end() - 1);
+    auto addEdge = [&edges, &edgeEnds](std::size_t target, Edge edge) { edges[edgeEnds[target]++] = edge; };
+    for (std::size_t p = 0; p < populations.size(); p++) {
+        const Population& population = populations[p];
+        const auto& weights = topology.populations[p].unitWeights;
+        for (std::size_t unit = 0; unit < population.numUnits; unit++) {
+            std::size_t firstNode = population.firstNode + unit * population.unitSize;
+            for (auto& connection : unitConnections(population.unitType))
+                addEdge(firstNode + connection.target, {
+                    static_cast<uint32_t>(firstNode + connection.source),
+                    weights[connection.weight],
+                    INTRA_UNIT
+                });
+        }
+    }
+    for (uint32_t description = 0; description < topology.connections.size(); description++) {
+        const ConnectionDescription& connection = topology.connections[description];
+        const Population& source = populations[connection.sourcePopulation];
+        const Population& target = populations[connection.targetPopulation];
+        for (std::size_t targetUnit = 0; targetUnit < target.numUnits; targetUnit++) {
+            std::size_t targetNode = target.firstNode + targetUnit * target.unitSize + connection.targetNode;
+            auto connect = [&](std::size_t sourceUnit) {
+                addEdge(targetNode, {
+                    static_cast<uint32_t>(source.firstNode + sourceUnit * source.unitSize + connection.sourceNode),
+                    connection.weight,
+                    description
+                });
+            };
+            if (connection.pattern == ConnectionPattern::ONE_TO_ONE) {
+                connect(targetUnit);
+                continue;
+            }
+            for (std::size_t sourceUnit = 0; sourceUnit < source.numUnits; sourceUnit++)
+                if (connection.pattern == ConnectionPattern::ALL_TO_ALL || sourceUnit != targetUnit)
+                    connect(sourceUnit);
+        }
+    }
+
+    // every node lives in the arena, which owns them all, so edges need no ownership of their own
+    nodes = std::make_unique<std::vector<K0>>();
+    nodes->reserve(numNodes);
+    for (std::size_t p = 0; p < populations.size(); p++)
+        for (std::size_t node = 0; node < populations[p].numUnits * populations[p].unitSize; node++)
+            nodes->emplace_back(topology.populations[p].k0config).setId(nodes->size() - 1);
+
+    for (std::size_t node = 0; node < numNodes; node++) {
+        auto first = edges.begin() + edgeOffsets[node];
+        auto last = edges.begin() + edgeOffsets[node + 1];
+        std::stable_sort(first, last, [](const Edge& a, const Edge& b) { return a.source < b.source; });
+        K0& target = (*nodes)[node];
+        target.reserveInboundConnections(last - first);
+        for (auto edge = first; edge != last; edge++) {
+            K0& source = (*nodes)[edge->source];
+            if (edge->description == INTRA_UNIT) {
+                target.addInboundConnection(source, edge->weight);
+            } else {
+                const ConnectionDescription& connection = topology.connections[edge->description];
+                target.addInboundConnection(source, edge->weight, connection.delay, connection.tag);
+            }
+        }
+    }
+
+    for (std::size_t p = 0; p < populations.size(); p++) {
+        numeric noise = topology.populations[p].noise;
+        if (noise == 0)
+            continue;
+        for (std::size_t unit = 0; unit < populations[p].numUnits; unit++) {
+            std::size_t node = populations[p].firstNode + unit * populations[p].unitSize;
+            (*nodes)[node].setNoiseStream({seed, node, noise});
+            noisyNodes.push_back(node);
+        }
+    }
+}
+
+const Network::Population& Network::population(std::size_t index) const {
+    if (index >= populations.size())
+        throw std::out_of_range("Population index out of range");
+    return populations[index];
+}
+
+std::size_t Network::populationIndex(const std::string& name) const {
+    for (std::size_t i = 0; i < populations.size(); i++)
+        if (populations[i].name == name)
+            return i;
+    throw std::out_of_range("No population named " + name);
+}
+
+const std::string& Network::populationName(std::size_t population) const {
+    return this->population(population).name;
+}
+
+std::size_t Network::populationSize(std::size_t population) const {
+    return this->population(population).numUnits;
+}
+
+K0& Network::node(std::size_t population, std::size_t unit, std::size_t unitNode) {
+    return const_cast<K0&>(std::as_const(*this).node(population, unit, unitNode));
+}
+
+const K0& Network::node(std::size_t population, std::size_t unit, std::size_t unitNode) const {
+    const Population& owner = this->population(population);
+    if (unit >= owner.numUnits || unitNode >= owner.unitSize)
+        throw std::out_of_range("Node index out of range");
+    return (*nodes)[owner.firstNode + unit * owner.unitSize + unitNode];
+}
+
+void Network::eraseExternalStimulus() noexcept {
+    for (auto& node : *nodes)
+        node.setExternalStimulus(0);
+}
+
+void Network::step() noexcept {
+    for (auto& node : *nodes)
+        node.calculateNextState();
+    for (auto& node : *nodes)
+        node.commitNextState();
+    for (std::size_t node : noisyNodes)
+        (*nodes)[node].advanceNoise();
+    iterationsRun++;
+}
+
+void Network::run(numeric milliseconds) noexcept {
+    std::size_t iterations = ksets::odeMillisecondsToIters(milliseconds);
+    for (std::size_t i = 0; i < iterations; i++)
+        step();
+}
@@ -0,0 +1,222 @@
+#include "ksets/trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+using ksets::TraceRecorder, ksets::TraceConfig, ksets::TraceStats, ksets::numeric;
+
+static_assert(sizeof(numeric) == sizeof(float), "Traces store float32 samples, which are written straight from the buffer");
+
+// translation unit "private" types and functions
+namespace {
+    constexpr char CHUNK_MAGIC[8] = "KSETSTC";
+    constexpr char INDEX_MAGIC[8] = "KSETSTI";
+
+    struct ChunkHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t numChannels;
+        uint64_t firstIteration;
+        uint64_t numSamples;
+    };
+    static_assert(sizeof(ChunkHeader) == 32, "Trace chunk header must have no padding");
+
+    struct IndexHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t numChannels;
+    };
+    static_assert(sizeof(IndexHeader) == 16, "Trace index header must have no padding");
+
+    struct IndexEntry {
+        uint64_t chunk;
+        uint64_t firstIteration;
+        uint64_t numSamples;
+    };
+
+    // how long the writer sleeps when the buffer is empty
+    constexpr auto IDLE_WAIT = std::chrono::milliseconds(1);
+
+    void writeAll(std::FILE *file, const void *data, std::size_t length, const std::string& path) {
+        if (std::fwrite(data, 1, length, file) != length)
+            throw std::system_error(errno, std::generic_category(), "Could not write trace file " + path);
+    }
+}
+
+TraceRecorder::TraceRecorder(const std::string& pathPrefix, std::size_t numChannels, TraceConfig config):
+    config(config),
+    pathPrefix(pathPrefix),
+    numChannels(numChannels)
+{
+    if (numChannels == 0)
+        throw std::invalid_argument("Trace must have at least one channel");
+    if (config.bufferSamples == 0 || config.chunkSamples == 0)
+        throw std::invalid_argument("Trace buffer and chunk sizes cannot be 0");
+
+    values.resize(config.bufferSamples * numChannels);
+    iterations.resize(config.bufferSamples);
+
+    std::string indexPath = pathPrefix + ".index";
+    index = std::fopen(indexPath.c_str(), "wb");
+    if (index == nullptr)
+        throw std::system_error(errno, std::generic_category(), "Could not create trace index " + indexPath);
+    IndexHeader header;
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = TRACE_VERSION;
+    header.numChannels = numChannels;
+    if (std::fwrite(&header, sizeof(header), 1, index) != 1 || std::fflush(index) != 0) {
+        int error = errno;
+        std::fclose(index);
+        throw std::system_error(error, std::generic_category(), "Could not write trace index " + indexPath);
+    }
+
+    writer = std::thread(&TraceRecorder::writerMain, this);
+}
+
+TraceRecorder::~TraceRecorder() {
+    try {
+        close();
+    } catch (...) {}
+}
+
+std::string TraceRecorder::chunkPath(uint64_t chunk) const {
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), ".%06llu.chunk", static_cast<unsigned long long>(chunk));
+    return pathPrefix + suffix;
+}
+
+void TraceRecorder::writerMain() noexcept {
+    while (true) {
+        // read before the write index, so samples published before stopping are never missed
+        bool stopRequested = stopping.load(std::memory_order_acquire);
+        uint64_t first = readIndex.load(std::memory_order_relaxed);
+        uint64_t last = writeIndex.load(std::memory_order_acquire);
+        if (first == last) {
+            if (stopRequested)
+                break;
+            std::this_thread::sleep_for(IDLE_WAIT);
+            continue;
+        }
+
+        // after a failure the buffer is still drained, so a blocking producer does not hang
+        if (!writeError) {
+            try {
+                writeSamples(first, last);
+            } catch (...) {
+                writeError = std::current_exception();
+            }
+        }
+        readIndex.store(last, std::memory_order_release);
+    }
+
+    if (!writeError) {
+        try {
+            finishChunk();
+        } catch (...) {
+            writeError = std::current_exception();
+        }
+    }
+}
+
+void TraceRecorder::writeSamples(uint64_t first, uint64_t last) {
+    std::size_t capacity = iterations.size();
+    while (first < last) {
+        std::size_t slot = first % capacity;
+        uint64_t iteration = iterations[slot];
+        if (chunkFile != nullptr
+                && (iteration != chunkFirstIteration + chunkNumSamples || chunkNumSamples == config.chunkSamples))
+            finishChunk();
+        if (chunkFile == nullptr)
+            startChunk(iteration);
+
+        // longest run of consecutive iterations that neither wraps around the buffer nor overflows the chunk
+        std::size_t runLength = 1;
+        std::size_t maxRunLength = std::min<uint64_t>({
+            last - first,
+            capacity - slot,
+            config.chunkSamples - chunkNumSamples
+        });
+        while (runLength < maxRunLength && iterations[slot + runLength] == iteration + runLength)
+            runLength++;
+
+        writeAll(chunkFile, values.data() + slot * numChannels, runLength * numChannels * sizeof(numeric), chunkPath(numChunks));
+        chunkNumSamples += runLength;
+        numWritten.store(numWritten.load(std::memory_order_relaxed) + runLength, std::memory_order_relaxed);
+        first += runLength;
+    }
+}
+
+void TraceRecorder::startChunk(uint64_t firstIteration) {
+    std::string path = chunkPath(numChunks) + ".tmp";
+    chunkFile = std::fopen(path.c_str(), "wb");
+    if (chunkFile == nullptr)
+        throw std::system_error(errno, std::generic_category(), "Could not create trace chunk " + path);
+    chunkFirstIteration = firstIteration;
+    chunkNumSamples = 0;
+
+    // the sample count is filled in when the chunk is finished
+    ChunkHeader header;
+    std::memcpy(header.magic, CHUNK_MAGIC, sizeof(CHUNK_MAGIC));
+    header.version = TRACE_VERSION;
+    header.numChannels = numChannels;
+    header.firstIteration = firstIteration;
+    header.numSamples = 0;
+    writeAll(chunkFile, &header, sizeof(header), path);
+}
+
+void TraceRecorder::finishChunk() {
+    if (chunkFile == nullptr)
+        return;
+
+    uint64_t chunk = numChunks.load(std::memory_order_relaxed);
+    std::string path = chunkPath(chunk);
+    std::string temporaryPath = path + ".tmp";
+    std::FILE *file = chunkFile;
+    chunkFile = nullptr;
+    bool written = std::fseek(file, offsetof(ChunkHeader, numSamples), SEEK_SET) == 0
+        && std::fwrite(&chunkNumSamples, sizeof(chunkNumSamples), 1, file) == 1;
+    written = std::fclose(file) == 0 && written;
+    if (!written)
+        throw std::system_error(errno, std::generic_category(), "Could not write trace chunk " + temporaryPath);
+    if (std::rename(temporaryPath.c_str(), path.c_str()) != 0)
+        throw std::system_error(errno, std::generic_category(), "Could not replace trace chunk " + path);
+
+    IndexEntry entry {chunk, chunkFirstIteration, chunkNumSamples};
+    writeAll(index, &entry, sizeof(entry), pathPrefix + ".index");
+    if (std::fflush(index) != 0)
+        throw std::system_error(errno, std::generic_category(), "Could not write trace index " + pathPrefix + ".index");
+    numChunks.store(chunk + 1, std::memory_order_relaxed);
+}
+
+void TraceRecorder::close() {
+    if (!writer.joinable())
+        return;
+    stopping.store(true, std::memory_order_release);
+    writer.join();
+    std::fclose(index);
+    index = nullptr;
+    if (writeError)
+        std::rethrow_exception(writeError);
+}
+
+TraceStats TraceRecorder::getStats() const noexcept {
+    TraceStats stats;
+    stats.numRecorded = numRecorded.load(std::memory_order_relaxed);
+    stats.numDropped = numDropped.load(std::memory_order_relaxed);
+    stats.numBackpressureEvents = numBackpressureEvents.load(std::memory_order_relaxed);
+    stats.numWritten = numWritten.load(std::memory_order_relaxed);
+    stats.numChunks = numChunks.load(std::memory_order_relaxed);
+    return stats;
+}
+
+std::size_t TraceRecorder::getNumChannels() const noexcept {
+    return numChannels;
+}
+
+const TraceConfig& TraceRecorder::getConfig() const noexcept {
+    return config;
+}
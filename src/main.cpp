@@ -9,10 +9,11 @@
 #include "ksets/k3.hpp"
 
 void writeCsv(std::ofstream& ofs, std::size_t len, const ksets::ActivationHistory& history) {
-    // yes, both get and tail take len-1 as argument
-    ofs << history.get(len-1);
-    for (auto iter = history.tail(len-1); iter != history.end(); iter++)
-        ofs << ',' << *iter;
+    std::vector<ksets::numeric> values(len);
+    history.copyTail(len, values.data());
+    ofs << values[0];
+    for (std::size_t i = 1; i < len; i++)
+        ofs << ',' << values[i];
     ofs << '\n';
 }
 
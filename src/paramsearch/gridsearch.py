@@ -166,6 +166,9 @@ class K3Model(BaseEstimator):
 
     def calc_score(self):
         data = self.run_with_params()
+        if not isinstance(data, np.ndarray):
+            # run was aborted or failed, data is already the score
+            return data
         segments = np.split(data, axis=1, indices_or_sections=5)
         concat_resting_segments = np.concatenate((segments[0], segments[2], segments[4]), axis=1)
         concat_resting_segments_avg = np.average(concat_resting_segments, axis=0)
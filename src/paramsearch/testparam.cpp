@@ -9,6 +9,7 @@ constexpr rngseed SEED = 1997'12'02;
 constexpr int PROCEDURE_N_STEPS = 5;
 constexpr int STEP_DURATION_MS = 500;
 constexpr int PROCEDURE_DURATION_MS = PROCEDURE_N_STEPS * STEP_DURATION_MS;
+constexpr numeric DEGENERACY_CHECK_INTERVAL_MS = 50;
 // END CONFIG
 
 constexpr int PROCEDURE_DURATION_ITERS = ksets::odeMillisecondsToIters(PROCEDURE_DURATION_MS);
@@ -17,6 +18,7 @@ constexpr int PROCEDURE_DURATION_ITERS = ksets::odeMillisecondsToIters(PROCEDURE
 
 #include <iostream>
 #include <random>
+#include <vector>
 
 using std::strtoul, std::strtof;
 
@@ -37,22 +39,6 @@ enum Arg {
     NARGS
 };
 
-std::function<rngseed()> randomDeviceSeedGenerator(rngseed seed) {
-    std::deque<rngseed> batch(32, 0);
-    std::size_t i = batch.size() - 1;
-    std::random_device rd {};
-    return [batch = std::move(batch), seed, i]() mutable {
-        static std::seed_seq seedGen({ seed });
-
-        i++;
-        if (i == batch.size()) {
-            seedGen.generate(batch.begin(), batch.end());
-            i = 0;
-        }
-        return batch[i];
-    };
-}
-
 struct Args {
     std::size_t numUnits;
     rngseed seed;
@@ -66,6 +52,7 @@ K3Config parseArgs(int argc, char *argv[]) {
     K3Config config;
     config.outputActivityMonitoring = 0;
     config.outputHistorySize = PROCEDURE_DURATION_ITERS;
+    config.degeneracyCheckInterval = ksets::odeMillisecondsToIters(DEGENERACY_CHECK_INTERVAL_MS);
 
     config.wOB_AON_lot = strtof(argv[W_OB_AON], &errptr);
     assertm(!*errptr, "Invalid wOB_AON");
@@ -124,10 +111,11 @@ void doSimulation(K3& model) {
 }
 
 void writeCsv(const ksets::ActivationHistory& history) {
-    // yes, both get and tail take len-1 as argument
-    std::cout << history.get(PROCEDURE_DURATION_ITERS-1);
-    for (auto iter = history.tail(PROCEDURE_DURATION_ITERS-1); iter != history.end(); iter++)
-        std::cout << ',' << *iter;
+    std::vector<ksets::numeric> values(PROCEDURE_DURATION_ITERS);
+    history.copyTail(values.size(), values.data());
+    std::cout << values[0];
+    for (std::size_t i = 1; i < values.size(); i++)
+        std::cout << ',' << values[i];
     std::cout << '\n';
 }
 
@@ -138,7 +126,13 @@ void writeToStdout(const K3& model) {
 
 int main(int argc, char *argv[]) {
     K3Config config = parseArgs(argc, argv);
-    K3 model(NUM_UNITS, INITIAL_REST, randomDeviceSeedGenerator(SEED), config);
+    K3 model(NUM_UNITS, INITIAL_REST, SEED, config);
     doSimulation(model);
+
+    // aborted runs are reported through the return code, which gridsearch.py scores as -inf
+    if (model.getRunStatus() != ksets::RunStatus::OK) {
+        std::cerr << "Run aborted: " << ksets::runStatusName(model.getRunStatus()) << '\n';
+        return 1;
+    }
     writeToStdout(model);
 }
\ No newline at end of file